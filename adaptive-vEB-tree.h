@@ -0,0 +1,339 @@
+#ifndef ADAPTIVE_VEB_TREE
+#define ADAPTIVE_VEB_TREE
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vEB-tree.h"
+#include "weighted-vEB-tree.h"
+
+// A static set of keys that follows the keys it is asked for. Lookups go to
+// a WeightedVebTree, and a sample of them (one in sampleInterval per thread)
+// is counted in a count-min sketch that belongs to the looking-up thread, so
+// profiling costs a decrement per lookup and never contends. relayout
+// rebuilds the tree in the background from the counts seen since the last
+// rebuild and swaps it in atomically; lookups carry on with the old tree
+// until then.
+//
+// With relayoutSamples set, that happens by itself every time that many
+// samples have been taken, and sooner when the hot keys move. A tree built
+// for one set of hot keys is worse than a balanced one for any other, so the
+// sampled lookups also measure how deep they go: when a window of them goes a
+// quarter deeper than the profile the tree was built from says they should,
+// the profile starts over, so that it forgets the old hot keys, and the tree
+// is rebuilt as soon as there are a few windows' worth of samples.
+//
+// Lookups are safe from any number of threads. Each thread keeps a
+// reference to the tree it last used, so a replaced tree is freed once every
+// thread that used it has moved on to the new one (or exited).
+template <typename Key, typename Params = VebTreeParams<Key> >
+class AdaptiveVebTree {
+public:
+  typedef Key key_type;
+
+  // Builds a tree from keys in sorted order, with equal weights to start
+  // with. A sampleInterval of 0 turns profiling off. Each thread's sketch
+  // has four rows of sketchWidth counters, which must be a power of two.
+  AdaptiveVebTree(const std::vector<key_type>& keys,
+                  size_t relayoutSamples = 0, unsigned sampleInterval = 64,
+                  size_t sketchWidth = size_t(1) << 14);
+  ~AdaptiveVebTree();
+
+  bool contains(const key_type& key) const;
+
+  // Starts rebuilding the tree from the profile in a background thread,
+  // unless a rebuild is already running. Returns whether it started one.
+  bool relayout() const;
+  // Waits for a running rebuild, if any, to be swapped in.
+  void wait_for_relayout() const;
+  // The number of rebuilds swapped in so far.
+  size_t relayouts() const { return numRelayouts.load(); }
+
+  // The number of keys in the tree.
+  size_t size() const { return keys.size(); }
+
+private:
+  AdaptiveVebTree(const AdaptiveVebTree&) = delete;
+  void operator=(const AdaptiveVebTree&) = delete;
+
+  typedef WeightedVebTree<Key, Params> Tree;
+
+  static const int kSketchRows = 4;
+  // The number of samples whose depths are compared at a time, and the
+  // number to collect after the hot keys move before rebuilding.
+  static const uint64_t kDriftWindow = 1024;
+  static const uint64_t kRetrainSamples = 4 * kDriftWindow;
+
+  // A count-min sketch written by a single thread. The counters are atomic
+  // only so that a rebuild can read them while that thread carries on.
+  struct Sketch {
+    explicit Sketch(size_t width)
+        : counts(new std::atomic<uint32_t>[kSketchRows * width]) {
+      for (size_t i = 0; i < kSketchRows * width; i++) {
+        counts[i].store(0, std::memory_order_relaxed);
+      }
+    }
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+  };
+
+  // What each thread keeps between lookups: which tree (by id) it last
+  // looked in, and at which version, so it only touches shared state when
+  // either changes.
+  struct ThreadState {
+    ThreadState() : owner(0), version(0), sketch(nullptr), countdown(0) {}
+    uint64_t owner;
+    uint64_t version;
+    std::shared_ptr<const Tree> tree;
+    Sketch * sketch;
+    unsigned countdown;
+  };
+  static thread_local ThreadState threadState;
+
+  // The counter for key in the given row of a sketch.
+  size_t slot(const key_type& key, int row) const {
+    static const uint64_t kMultipliers[kSketchRows] = {
+      0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full,
+      0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+    uint64_t hash = uint64_t(std::hash<key_type>()(key)) * kMultipliers[row];
+    return row * sketchWidth + (hash >> (64 - sketchBits));
+  }
+
+  void refresh(ThreadState& state) const;
+  void record(ThreadState& state, const key_type& key) const;
+  void checkDrift(uint64_t windowSum) const;
+  void mergeSketches(std::vector<uint64_t>& counts) const;
+  void rebuild() const;
+
+  std::vector<key_type> keys;
+  size_t relayoutSamples;
+  unsigned sampleInterval;
+  size_t sketchWidth;
+  int sketchBits;
+  // Tells this tree's thread states from another's; never reused.
+  uint64_t id;
+
+  mutable std::shared_ptr<const Tree> current;
+  mutable std::atomic<uint64_t> version;
+  mutable std::atomic<size_t> numRelayouts;
+  mutable std::atomic<size_t> samples;
+  mutable std::atomic<bool> rebuilding;
+  // The depths of the samples in the current window, and the total depth a
+  // window should have: what the profile the tree was built from predicts,
+  // or for the first tree, whatever the first window measures (0 until
+  // then).
+  // Updates from different threads can interleave and lose a sample here or
+  // there, which doesn't matter for a heuristic.
+  mutable std::atomic<uint64_t> windowDepth;
+  mutable std::atomic<uint64_t> windowSamples;
+  mutable std::atomic<uint64_t> baselineDepth;
+  // Guards sketches, worker and previousCounts.
+  mutable std::mutex mutex;
+  mutable std::map<std::thread::id, std::unique_ptr<Sketch> > sketches;
+  mutable std::thread worker;
+  // The merged counts as of the start of the profile, which the next
+  // rebuild subtracts to get the counts since.
+  mutable std::vector<uint64_t> previousCounts;
+};
+
+template <typename Key, typename Params>
+thread_local typename AdaptiveVebTree<Key, Params>::ThreadState
+    AdaptiveVebTree<Key, Params>::threadState;
+
+template <typename Key, typename Params>
+AdaptiveVebTree<Key, Params>::AdaptiveVebTree(
+    const std::vector<key_type>& keys, size_t relayoutSamples,
+    unsigned sampleInterval, size_t sketchWidth)
+    : keys(keys), relayoutSamples(relayoutSamples),
+      sampleInterval(sampleInterval), sketchWidth(sketchWidth), sketchBits(0),
+      version(1), numRelayouts(0), samples(0), rebuilding(false),
+      windowDepth(0), windowSamples(0), baselineDepth(0),
+      previousCounts(kSketchRows * sketchWidth, 0) {
+  assert(sketchWidth >= 2 && (sketchWidth & (sketchWidth - 1)) == 0);
+  while ((size_t(1) << sketchBits) < sketchWidth) {
+    sketchBits++;
+  }
+  static std::atomic<uint64_t> nextId(1);
+  id = nextId++;
+  current = std::make_shared<const Tree>(
+      keys, std::vector<double>(keys.size(), 1.0));
+}
+
+template <typename Key, typename Params>
+AdaptiveVebTree<Key, Params>::~AdaptiveVebTree() {
+  wait_for_relayout();
+}
+
+template <typename Key, typename Params>
+bool AdaptiveVebTree<Key, Params>::contains(const key_type& key) const {
+  ThreadState& state = threadState;
+  if (state.owner != id ||
+      state.version != version.load(std::memory_order_acquire)) {
+    refresh(state);
+  }
+  if (state.sketch != nullptr && --state.countdown == 0) {
+    record(state, key);
+  }
+  return state.tree->contains(key);
+}
+
+// Picks up the current tree, and this thread's sketch if it's new to us.
+template <typename Key, typename Params>
+void AdaptiveVebTree<Key, Params>::refresh(ThreadState& state) const {
+  if (state.owner != id) {
+    state.owner = id;
+    state.sketch = nullptr;
+    if (sampleInterval != 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::unique_ptr<Sketch>& sketch = sketches[std::this_thread::get_id()];
+      if (!sketch) {
+        sketch.reset(new Sketch(sketchWidth));
+      }
+      state.sketch = sketch.get();
+      state.countdown = sampleInterval;
+    }
+  }
+  state.version = version.load(std::memory_order_acquire);
+  state.tree = std::atomic_load(&current);
+}
+
+template <typename Key, typename Params>
+void AdaptiveVebTree<Key, Params>::record(ThreadState& state,
+                                          const key_type& key) const {
+  state.countdown = sampleInterval;
+  for (int row = 0; row < kSketchRows; row++) {
+    std::atomic<uint32_t>& count = state.sketch->counts[slot(key, row)];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+  if (relayoutSamples == 0) {
+    return;
+  }
+  uint64_t depth = state.tree->depth(key);
+  uint64_t sum = windowDepth.fetch_add(depth, std::memory_order_relaxed) + depth;
+  if (windowSamples.fetch_add(1, std::memory_order_relaxed) + 1 == kDriftWindow) {
+    checkDrift(sum);
+  }
+  if (samples.fetch_add(1, std::memory_order_relaxed) + 1 >= relayoutSamples) {
+    relayout();
+  }
+}
+
+template <typename Key, typename Params>
+void AdaptiveVebTree<Key, Params>::checkDrift(uint64_t windowSum) const {
+  windowDepth.store(0, std::memory_order_relaxed);
+  windowSamples.store(0, std::memory_order_relaxed);
+  uint64_t baseline = baselineDepth.load(std::memory_order_relaxed);
+  if (baseline == 0) {
+    baselineDepth.store(windowSum, std::memory_order_relaxed);
+    return;
+  }
+  if (windowSum * 4 <= baseline * 5 || rebuilding.load()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    mergeSketches(previousCounts);
+  }
+  // Until the rebuild, the window just finished stands in as the baseline,
+  // so this doesn't go off again in the meantime.
+  baselineDepth.store(windowSum, std::memory_order_relaxed);
+  samples.store(relayoutSamples > kRetrainSamples ?
+                relayoutSamples - kRetrainSamples : 0,
+                std::memory_order_relaxed);
+}
+
+// Sets counts to the sum of the sketches. The caller holds the mutex.
+template <typename Key, typename Params>
+void AdaptiveVebTree<Key, Params>::mergeSketches(
+    std::vector<uint64_t>& counts) const {
+  std::fill(counts.begin(), counts.end(), 0);
+  for (auto& entry : sketches) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += entry.second->counts[i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename Key, typename Params>
+bool AdaptiveVebTree<Key, Params>::relayout() const {
+  if (rebuilding.exchange(true)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  // The last rebuild, if any, is done: it clears rebuilding on its way out.
+  if (worker.joinable()) {
+    worker.join();
+  }
+  samples.store(0, std::memory_order_relaxed);
+  worker = std::thread([this]() { rebuild(); });
+  return true;
+}
+
+template <typename Key, typename Params>
+void AdaptiveVebTree<Key, Params>::wait_for_relayout() const {
+  // The rebuild takes the mutex itself, so it can't be joined under it.
+  std::thread running;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    running.swap(worker);
+  }
+  if (running.joinable()) {
+    running.join();
+  }
+}
+
+/* Sums the sketches, takes away the sums as of the start of the profile,
+ * and gives each key the smallest of its counters, which is the usual
+ * count-min estimate of how often it was sampled since then. Keys that
+ * weren't sampled get no weight of their own, and WeightedVebTree's floor
+ * keeps them within reach.
+ */
+template <typename Key, typename Params>
+void AdaptiveVebTree<Key, Params>::rebuild() const {
+  std::vector<uint64_t> counts(kSketchRows * sketchWidth);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    mergeSketches(counts);
+    for (size_t i = 0; i < counts.size(); i++) {
+      uint64_t total = counts[i];
+      counts[i] -= previousCounts[i];
+      previousCounts[i] = total;
+    }
+  }
+  std::vector<double> weights(keys.size());
+  for (size_t k = 0; k < keys.size(); k++) {
+    uint64_t estimate = uint64_t(-1);
+    for (int row = 0; row < kSketchRows; row++) {
+      estimate = std::min(estimate, counts[slot(keys[k], row)]);
+    }
+    weights[k] = double(estimate);
+  }
+
+  std::shared_ptr<const Tree> tree = std::make_shared<const Tree>(keys, weights);
+  double total = 0, depths = 0;
+  for (size_t k = 0; k < keys.size(); k++) {
+    if (weights[k] > 0) {
+      total += weights[k];
+      depths += weights[k] * tree->depth(keys[k]);
+    }
+  }
+  std::atomic_store(&current, tree);
+  version.fetch_add(1, std::memory_order_release);
+  windowDepth.store(0, std::memory_order_relaxed);
+  windowSamples.store(0, std::memory_order_relaxed);
+  baselineDepth.store(total > 0 ? uint64_t(depths / total * kDriftWindow) : 0,
+                      std::memory_order_relaxed);
+  numRelayouts++;
+  rebuilding.store(false);
+}
+
+#endif
@@ -7,8 +7,13 @@
 #include <cmath>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "tree-storage.h"
+
 namespace cotree {
 
 // A helper type used to provide compare, is_present, and absent_value
@@ -29,6 +34,11 @@ namespace cotree {
 struct cotree_params_tag {};
 
 // The Cache-Oblivious B-Tree type, as described by Brodal et al. in 2002.
+//
+// Sets of up to _small_capacity values, as many as fit in a cache line, skip
+// the tree altogether: they're kept sorted in the object itself and searched
+// linearly, so small sets cost no allocations. The first insert past that
+// moves them into a tree.
 template<typename Params>
 class cotree {
 public:
@@ -40,14 +50,19 @@ private:
 	struct tree {
 		typedef typename Params::value_type value_type;
 
-		tree() : _H(0), _BTD(nullptr), _values(nullptr), _n(0) {}
+		tree() : _H(0), _BTD(nullptr), _values(nullptr), _counts(nullptr), _n(0) {}
 
 		// The height of the tree.
 		size_t       _H;
-		// The B, T, and D arrays from brodal2002cache.
+		// The B, T, and D arrays from brodal2002cache, followed by the
+		// largest and smallest number of values allowed in a subtree
+		// rooted at each depth.
 		size_t *     _BTD;
 		// The value array.
 		value_type * _values;
+		// The number of values in each subtree at least _counted_height
+		// high, indexed by the BFS index of its root.
+		uint32_t *   _counts;
 		// The number of values in the dynamic tree.
 		size_t       _n;
 	};
@@ -56,7 +71,7 @@ private:
 	struct cursor {
 	typedef typename Params::value_type value_type;
 	private:
-		const tree& _tree;
+		const tree* _tree;
 		// The position of each ancestor on the path, 1-indexed by depth.
 		size_t      _Pos[8 * sizeof(size_t)];
 	public:
@@ -67,19 +82,33 @@ private:
 		unsigned depth;
 
 	public:
-		// Creates a cursor starting at the root.
-		cursor(const tree& tree) : _tree(tree), _Pos{1}, path(1), depth(1) {}
+		// Creates a cursor that isn't in any tree yet.
+		cursor() : _tree(nullptr), _Pos{}, path(1), depth(1) {}
 
 		// Creates a cursor starting at the root.
+		cursor(const tree& tree) : _tree(&tree), _Pos{1}, path(1), depth(1) {}
+
+		// Creates a copy of another cursor.
 		cursor(const cursor& cursor) : _tree(cursor._tree), path(cursor.path), depth(cursor.depth) {
 			for (unsigned i = 0; i < depth; i++) {
 				_Pos[i] = cursor._Pos[i];
 			}
 		}
 
+		// Moves to where another cursor is.
+		cursor& operator=(const cursor& cursor) {
+			_tree = cursor._tree;
+			path = cursor.path;
+			depth = cursor.depth;
+			for (unsigned i = 0; i < depth; i++) {
+				_Pos[i] = cursor._Pos[i];
+			}
+			return *this;
+		}
+
 		// Return a reference to the current value.
 		value_type& cur() const {
-			return _tree._values[_Pos[depth - 1] - 1];
+			return _tree->_values[_Pos[depth - 1] - 1];
 		}
 
 		// Returns true if the current value is present.
@@ -94,7 +123,7 @@ private:
 
 		// Navigate down the left subtree.
 		void left() {
-			assert(depth < _tree._H);
+			assert(depth < _tree->_H);
 			depth++;
 			path <<= 1;
 			calculate();
@@ -102,7 +131,7 @@ private:
 
 		// Navigate down the right subtree.
 		void right() {
-			assert(depth < _tree._H);
+			assert(depth < _tree->_H);
 			depth++;
 			path <<= 1;
 			path |= 1;
@@ -118,14 +147,14 @@ private:
 
 		// Navigate to the first slot in this subtree.
 		void first_slot() {
-			while (depth < _tree._H) {
+			while (depth < _tree->_H) {
 				left();
 			}
 		}
 
 		// Navigate to the immediate successor in the static tree.
 		bool next_slot(size_t max_H) {
-			if (depth < _tree._H) {
+			if (depth < _tree->_H) {
 				right();
 				first_slot();
 			} else {
@@ -143,14 +172,14 @@ private:
 
 		// Navigate to the first slot in this subtree.
 		void last_slot() {
-			while (depth < _tree._H) {
+			while (depth < _tree->_H) {
 				right();
 			}
 		}
 
 		// Navigate to the immediate predecessor in the static tree.
 		bool prev_slot(size_t max_H) {
-			if (depth < _tree._H) {
+			if (depth < _tree->_H) {
 				left();
 				last_slot();
 			} else {
@@ -168,7 +197,7 @@ private:
 
 		// Navigate to the first value in this subtree.
 		void first_value() {
-			while (depth < _tree._H) {
+			while (depth < _tree->_H) {
 				left();
 				if (!is_present()) {
 					up();
@@ -179,7 +208,7 @@ private:
 
 		// Navigate to the immediate successor in the dynamic tree.
 		bool next_value(size_t max_H) {
-			if (depth < _tree._H) {
+			if (depth < _tree->_H) {
 				right();
 				if (!is_present()) {
 					up();
@@ -202,7 +231,7 @@ private:
 
 		// Navigate to the last value in this subtree.
 		void last_value() {
-			while (depth < _tree._H) {
+			while (depth < _tree->_H) {
 				right();
 				if (!is_present()) {
 					up();
@@ -213,7 +242,7 @@ private:
 
 		// Navigate to the immediate predecessor in the dynamic tree.
 		bool prev_value(size_t max_H) {
-			if (depth < _tree._H) {
+			if (depth < _tree->_H) {
 				left();
 				if (!is_present()) {
 					up();
@@ -237,7 +266,7 @@ private:
 	private:
 		// Calculate the position of the cursor.
 		void calculate() {
-			size_t * BTD = _tree._BTD + 3 * (depth - 2);
+			size_t * BTD = _tree->_BTD + 3 * (depth - 2);
 			_Pos[depth - 1] = _Pos[BTD[2] - 1] + BTD[1] + (path & BTD[1]) * BTD[0];
 		}
 	};
@@ -247,13 +276,86 @@ private:
 	static constexpr double _gamma1 = 0.35;
 	static constexpr double _gammaH = 0.3;
 
+	static const size_t _small_capacity = 64 / sizeof(value_type);
+
+	// Subtrees shorter than this are counted by walking them, which takes
+	// no more than a few cache lines; taller ones keep a counter.
+	static const unsigned _counted_height = 4;
+
+	// insert_sorted rebuilds a subtree outright once the part of the batch
+	// bound for it is at least 1/_rebuild_ratio of what it already holds;
+	// sparser parts are pushed further down instead.
+	static const size_t _rebuild_ratio = 2;
+
+	// During an incremental resize, each operation initializes this many
+	// slots of the new array for every value it would copy. Filling is far
+	// cheaper than copying, so the new array can be prepared in the last
+	// few inserts before the old one fills up.
+	static const size_t _prepare_ratio = 64;
+
+	// Once every value is copied, each operation replays this many of the
+	// changes logged behind the copy, so the log runs out even though each
+	// operation may add to it.
+	static const size_t _replay_step = 2;
+
 private:
-	// The tree.
+	// The tree. _tree._H is 0 while the values are in _small instead.
 	tree _tree;
+	// How the value arrays are allocated.
+	StoragePolicy _storage;
+	// The values of a small set, in order; the slots past _tree._n are absent.
+	typename std::aligned_storage<(_small_capacity ? _small_capacity : 1) * sizeof(value_type),
+	                              alignof(value_type)>::type _small;
+
+	// An incremental resize. First the array of a tree one level taller is
+	// filled with absent values; then this tree's values are copied into
+	// it in order, a few per operation, and laid out just as distribute
+	// would lay them out. This tree stays whole and answers every query
+	// meanwhile. Changes to values the copy has already passed are logged
+	// and replayed into the new tree once the copy is done, and when that
+	// has caught up the two trade places.
+	struct resize_state {
+		resize_state() : last(Params::absent_value()) {}
+
+		// The new tree.
+		tree       other;
+		// Whether the values are being copied yet.
+		bool       copying;
+		// While preparing, how many of the new tree's value slots and then
+		// counters have been initialized.
+		size_t     progress;
+		// The last value copied, or absent before the first.
+		value_type last;
+		// The number of values in this tree past last.
+		size_t     remaining;
+		// The number of values copied so far.
+		size_t     copied;
+		// Whether every value has been copied.
+		bool       copied_all;
+		// The subtree of the new tree that the next value goes into, and
+		// for each subtree on its path, by depth: how many values had been
+		// copied when the copy got there, how many values it gets, and how
+		// many of those go to its left.
+		cursor     fill;
+		size_t     start[8 * sizeof(size_t) + 1];
+		size_t     share[8 * sizeof(size_t) + 1];
+		size_t     left_share[8 * sizeof(size_t) + 1];
+		// Values inserted (true) or removed (false) behind the copy, and
+		// how many of those changes the new tree has been given.
+		std::vector<std::pair<value_type, bool>> log;
+		size_t     replayed;
+	};
+	std::unique_ptr<resize_state> _resize;
+	// How many slots of the old array each operation moves during an
+	// incremental resize, or 0 to resize all at once.
+	size_t _resize_step;
 
 public:
-	// Construct an empty CO B-Tree.
-	cotree() : _tree() {}
+	// Construct an empty CO B-Tree, whose value arrays will be allocated
+	// according to the given storage policy.
+	explicit cotree(StoragePolicy storage = StoragePolicy()) : _tree(), _storage(storage), _resize_step(0) {
+		std::uninitialized_fill_n(small_values(), _small_capacity, Params::absent_value());
+	}
 
 	// Construct a CO B-Tree from a given random-access iterator range.
 	template<typename Iterator,
@@ -262,91 +364,304 @@ public:
 	                                 typename std::iterator_traits<Iterator>::iterator_category
 	                                >::value
 	                                           >::type>
-	cotree(Iterator begin, Iterator end) : _tree() {
-		_tree._H = height(end - begin);
-		resize(_tree._H);
-		_tree._n = end - begin;
-		if (_tree._n > 0) {
-			cursor c(_tree);
-			distribute(c, _tree._n, begin);
+	cotree(Iterator begin, Iterator end, StoragePolicy storage = StoragePolicy())
+		: _tree(), _storage(storage), _resize_step(0) {
+		std::uninitialized_fill_n(small_values(), _small_capacity, Params::absent_value());
+		size_t n = end - begin;
+		if (n <= _small_capacity) {
+			std::copy(begin, end, small_values());
+			_tree._n = n;
+			return;
 		}
+		_tree._H = height(n);
+		resize(_tree._H);
+		_tree._n = n;
+		cursor c(_tree);
+		distribute(c, _tree._n, begin);
 	}
 
 	// Construct a CO B-Tree from a sorted vector of values.
-	cotree(const std::vector<value_type>& values) : cotree(values.begin(), values.end()) {}
+	cotree(const std::vector<value_type>& values, StoragePolicy storage = StoragePolicy())
+		: cotree(values.begin(), values.end(), storage) {}
 
 	// The destructor.
 	~cotree() {
-		delete[] _tree._BTD;
-		delete[] _tree._values;
+		if (_resize) {
+			discard_resize();
+		}
+		free_tree(_tree);
+		value_type * small = small_values();
+		for (size_t i = 0; i < _small_capacity; i++) {
+			small[i].~value_type();
+		}
 	}
 
 	// Insert the value into the tree.
 	bool insert(const value_type& value) {
 		assert(Params::is_present(value));
-		size_t new_H = height(_tree._n + 1);
-		if (new_H > _tree._H) {
-			resize(new_H);
-		}
-		assert(_tree._H > 0);
-		cursor c(_tree);
-		int comp;
-		while (true) {
-			if (!c.is_present()) {
-				c.cur() = value;
+		if (_tree._H == 0) {
+			value_type * small = small_values();
+			size_t i = small_position(value);
+			if (i < _tree._n && Params::compare(value, small[i]) == 0) {
+				return false;
+			}
+			if (_tree._n < _small_capacity) {
+				std::move_backward(small + i, small + _tree._n, small + _tree._n + 1);
+				small[i] = value;
 				_tree._n++;
 				return true;
 			}
-			comp = c.compare(value);
-			if (comp == 0) {
-				return false;
+			leave_small(height(_tree._n + 1));
+		}
+		if (_tree._n + 1 > max_count(1)) {
+			if (_resize) {
+				complete_resize();
 			}
-			if (c.depth == _tree._H) {
-				break;
+			if (_tree._n + 1 > max_count(1)) {
+				resize(height(_tree._n + 1));
 			}
-			if (comp < 0) {
-				c.left();
-			} else {
-				c.right();
+		}
+		assert(_tree._H > 0);
+		cursor c(_tree);
+		bool added = insert(c, value);
+		if (added) {
+			log_change(value, true);
+		}
+		advance_resize();
+		return added;
+	}
+
+	// Insert the sorted values in [begin, end) into the tree, returning how
+	// many were not already there. The tree is sized once for the whole
+	// batch, and each subtree it touches is redistributed at most once.
+	template<typename Iterator,
+	         typename = typename std::enable_if<
+	                 std::is_base_of<std::forward_iterator_tag,
+	                                 typename std::iterator_traits<Iterator>::iterator_category
+	                                >::value
+	                                           >::type>
+	size_t insert_sorted(Iterator begin, Iterator end) {
+		size_t k = std::distance(begin, end);
+		if (k == 0) {
+			return 0;
+		}
+		if (_tree._H == 0) {
+			// Size the tree by the values the batch adds rather than by its
+			// length, which counts the ones we already have.
+			k = count_new(begin, end);
+			if (_tree._n + k <= _small_capacity) {
+				size_t added = 0;
+				for (; begin != end; ++begin) {
+					added += insert(*begin);
+				}
+				return added;
 			}
+			leave_small(height(_tree._n + k));
 		}
-		// Find the rebalance point, compact the elements, and then redistribute them.
-		value_type local_value = value;
-		size_t count = find_rebalance_point(c);
-		cursor values = compact(c, local_value);
-		_tree._n++;
-		distribute(c, count, values, c.depth);
-		return true;
+		if (_resize) {
+			discard_resize();
+		}
+		if (_tree._n + k > max_count(1)) {
+			// The batch's length counts repeats and values we already
+			// have, so it only says the tree might outgrow its array.
+			k = count_new(begin, end);
+			if (_tree._n + k > max_count(1)) {
+				return resize(height(_tree._n + k), begin, end);
+			}
+		}
+		cursor c(_tree);
+		return insert_sorted(c, begin, end);
 	}
 
 	// Remove the value from the tree.
 	bool remove(const value_type& value) {
-		// TODO
-		return false;
+		if (_tree._H == 0) {
+			value_type * small = small_values();
+			size_t i = small_position(value);
+			if (i == _tree._n || Params::compare(value, small[i]) != 0) {
+				return false;
+			}
+			std::move(small + i + 1, small + _tree._n, small + i);
+			_tree._n--;
+			small[_tree._n] = Params::absent_value();
+			return true;
+		}
+		cursor c(_tree);
+		if (!descend_to(c, _tree._H, value)) {
+			advance_resize();
+			return false;
+		}
+		remove_at(c);
+
+		// The root is held to gamma1, as insert holds it to tau1; waiting
+		// for gammaH would leave every delete in between rebalancing the
+		// whole tree.
+		if (_tree._n < min_count(1)) {
+			shrink();
+		}
+		log_change(value, false);
+		advance_resize();
+		return true;
 	}
 
 	// Returns true if the tree contains the given value.
 	bool contains(const value_type& value) const {
-		if (_tree._n == 0) {
-			return false;
+		if (_tree._H == 0) {
+			size_t i = small_position(value);
+			return i < _tree._n && Params::compare(value, small_values()[i]) == 0;
 		}
-		cursor c(_tree);
-		assert(c.is_present());
-		while (c.is_present()) {
-			int comp = c.compare(value);
-			if (comp == 0) {
-				return true;
-			}
-			if (c.depth == _tree._H) {
-				break;
+		return contains(_tree, value);
+	}
+
+	// Switch incremental resizing on or off. With a step of 0, the default,
+	// the insert that outgrows the value array moves every value into a
+	// bigger one before it returns. Otherwise the bigger array is built
+	// while the old one fills up, each insert and remove doing a bounded
+	// share of the work: first initializing _prepare_ratio * step of its
+	// slots, then copying step values into it in order, then replaying
+	// _replay_step of the changes made behind the copy. The old array
+	// answers every query until the new one has caught up and takes over.
+	// Steps under 2 are rounded up to 2, so that the copy outpaces the
+	// values inserted past it. Switching it off drops any resize under way.
+	void set_incremental_resize(size_t step) {
+		if (step == 0 && _resize) {
+			discard_resize();
+		}
+		_resize_step = step == 0 ? 0 : std::max<size_t>(step, 2);
+	}
+
+	// Returns true while values are being copied into a bigger array.
+	bool resizing() const {
+		return _resize && _resize->copying;
+	}
+
+	// Finish copying values into the bigger array now, and switch to it.
+	void finish_resize() {
+		if (resizing()) {
+			complete_resize();
+		}
+	}
+
+	// Returns the number of values in the tree.
+	size_t size() const {
+		return _tree._n;
+	}
+
+	// A bidirectional iterator over a cotree's values in sorted order. For a
+	// small set it keeps an index into the small array; otherwise a cursor
+	// into the tree, which it moves with next_value and prev_value.
+	class const_iterator {
+	public:
+		typedef std::bidirectional_iterator_tag iterator_category;
+		typedef typename Params::value_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const value_type * pointer;
+		typedef const value_type& reference;
+
+		const_iterator() : _owner(nullptr), _index(0), _end(true) {}
+
+		reference operator*() const {
+			return _owner->_tree._H == 0 ? _owner->small_values()[_index] : _c.cur();
+		}
+		pointer operator->() const {
+			return &**this;
+		}
+
+		const_iterator& operator++() {
+			if (_owner->_tree._H == 0) {
+				_end = ++_index == _owner->_tree._n;
+			} else {
+				_end = !_c.next_value(1);
 			}
-			if (comp < 0) {
-				c.left();
+			return *this;
+		}
+		const_iterator operator++(int) {
+			const_iterator old = *this;
+			++*this;
+			return old;
+		}
+		const_iterator& operator--() {
+			if (_owner->_tree._H == 0) {
+				_index--;
+			} else if (_end) {
+				_c = cursor(_owner->_tree);
+				_c.last_value();
 			} else {
-				c.right();
+				_c.prev_value(1);
 			}
+			_end = false;
+			return *this;
 		}
-		return false;
+		const_iterator operator--(int) {
+			const_iterator old = *this;
+			--*this;
+			return old;
+		}
+
+		bool operator==(const const_iterator& other) const {
+			return _end == other._end &&
+			       (_end || (_index == other._index && _c.path == other._c.path && _c.depth == other._c.depth));
+		}
+		bool operator!=(const const_iterator& other) const {
+			return !(*this == other);
+		}
+
+	private:
+		friend class cotree;
+
+		const_iterator(const cotree * owner, const cursor& c, size_t index, bool end)
+			: _owner(owner), _c(c), _index(index), _end(end) {}
+
+		const cotree * _owner;
+		// Where the value is, for a tree.
+		cursor         _c;
+		// Where the value is, for a small set.
+		size_t         _index;
+		// Whether this is past the last value.
+		bool           _end;
+	};
+	typedef const_iterator iterator;
+
+	// Iterators over the values in sorted order. Stepping to a neighbouring
+	// value takes amortized constant time, but each iterator carries the
+	// positions of a whole root path and is a few hundred bytes. Inserting
+	// or removing a value invalidates them all.
+	const_iterator begin() const {
+		if (_tree._H == 0 || !Params::is_present(_tree._values[0])) {
+			return const_iterator(this, cursor(), 0, _tree._n == 0);
+		}
+		cursor c(_tree);
+		c.first_value();
+		return const_iterator(this, c, 0, false);
+	}
+	const_iterator end() const {
+		return const_iterator(this, cursor(), _tree._H == 0 ? _tree._n : 0, true);
+	}
+
+	// Ordered queries. Each returns end() if there is no such value:
+	//   find:        the value equal to value.
+	//   lower_bound: the smallest value not less than value.
+	//   upper_bound: the smallest value greater than value.
+	//   predecessor: the largest value less than value.
+	//   successor:   the smallest value greater than value.
+	const_iterator find(const value_type& value) const {
+		const_iterator it = lower_bound(value);
+		if (it != end() && Params::compare(value, *it) != 0) {
+			return end();
+		}
+		return it;
+	}
+	const_iterator lower_bound(const value_type& value) const {
+		return search(value, -1, -1);
+	}
+	const_iterator upper_bound(const value_type& value) const {
+		return search(value, 1, -1);
+	}
+	const_iterator predecessor(const value_type& value) const {
+		return search(value, -1, 1);
+	}
+	const_iterator successor(const value_type& value) const {
+		return upper_bound(value);
 	}
 
 private:
@@ -370,7 +685,13 @@ public: /* DEBUG */
 	}
 
 	void print_inorder() const {
-		if (_tree._n) {
+		if (_tree._H == 0) {
+			std::cout << "  small: ";
+			for (size_t i = 0; i < _tree._n; i++) {
+				std::cout << small_values()[i] << " ";
+			}
+			std::cout << std::endl;
+		} else if (_tree._n) {
 			cursor c(_tree);
 			std::cout << "  inorder: ";
 			c.first_value();
@@ -388,6 +709,10 @@ public: /* DEBUG */
 	}
 
 	void check_invariants() const {
+		if (_tree._H == 0) {
+			assert(_tree._n <= _small_capacity);
+			return;
+		}
 		assert(_tree._n < 2 || _gammaH * ((1 << _tree._H) - 1) <= _tree._n);
 		assert(_tree._n <= _tau1 * ((1 << _tree._H) - 1));
 		assert(((1 << _tree._H) - 1) == (1 << _tree._H) - 1);
@@ -404,15 +729,601 @@ public: /* DEBUG */
 		assert(_gammaH < _gamma1);
 		assert(_gamma(1) == _gamma1);
 		assert(_gamma1 < _tau1);
+
+		if (_tree._n > 0 && counted_depth() > 0) {
+			check_counts(cursor(_tree));
+		}
+	}
+
+	// Check the counter of every counted subtree against a walk of it.
+	void check_counts(cursor c) const {
+		assert(_tree._counts[c.path] == count_values(c));
+		if (c.depth < counted_depth()) {
+			c.left();
+			check_counts(c);
+			c.up();
+			c.right();
+			check_counts(c);
+		}
 	}
 
 private:
+	value_type * small_values() {
+		return reinterpret_cast<value_type *>(&_small);
+	}
+	const value_type * small_values() const {
+		return reinterpret_cast<const value_type *>(&_small);
+	}
+
+	// Walk down toward value, treating a value equal to the current one as
+	// lying on the side given by tie (-1 for left, 1 for right), and return
+	// the last value the walk turned toward side from, or end() if none.
+	const_iterator search(const value_type& value, int tie, int side) const {
+		if (_tree._H == 0) {
+			const value_type * small = small_values();
+			size_t i = 0;
+			while (i < _tree._n) {
+				int comp = Params::compare(value, small[i]);
+				if ((comp == 0 ? tie : comp) < 0) {
+					break;
+				}
+				i++;
+			}
+			if (side > 0) {
+				return i == 0 ? end() : const_iterator(this, cursor(), i - 1, false);
+			}
+			return const_iterator(this, cursor(), i, i == _tree._n);
+		}
+		cursor c(_tree);
+		unsigned found = 0;
+		while (c.is_present()) {
+			int comp = c.compare(value);
+			if (comp == 0) {
+				comp = tie;
+			}
+			if ((comp < 0) == (side < 0)) {
+				found = c.depth;
+			}
+			if (c.depth == _tree._H) {
+				break;
+			}
+			if (comp < 0) {
+				c.left();
+			} else {
+				c.right();
+			}
+		}
+		if (found == 0) {
+			return end();
+		}
+		while (c.depth > found) {
+			c.up();
+		}
+		return const_iterator(this, c, 0, false);
+	}
+
+	// Walk the cursor down toward value in a tree of height H, returning
+	// whether it stopped at value.
+	static bool descend_to(cursor& c, size_t H, const value_type& value) {
+		while (c.is_present()) {
+			int comp = c.compare(value);
+			if (comp == 0) {
+				return true;
+			}
+			if (c.depth == H) {
+				break;
+			}
+			if (comp < 0) {
+				c.left();
+			} else {
+				c.right();
+			}
+		}
+		return false;
+	}
+
+	// Returns true if the given tree, which isn't small, holds the value.
+	static bool contains(const tree& t, const value_type& value) {
+		cursor c(t);
+		return descend_to(c, t._H, value);
+	}
+
+	// Empty the slot at the cursor, in a tree of height H. The value moves
+	// down, swapping with its in-order neighbour within its subtree, until
+	// there is nothing below it; then its slot can simply be emptied. The
+	// cursor is left at the emptied slot.
+	static void sink(cursor& c, size_t H) {
+		while (c.depth < H) {
+			value_type& hole = c.cur();
+			c.right();
+			if (c.is_present()) {
+				c.first_value();
+			} else {
+				c.up();
+				c.left();
+				if (!c.is_present()) {
+					c.up();
+					break;
+				}
+				c.last_value();
+			}
+			std::swap(hole, c.cur());
+		}
+		c.cur() = Params::absent_value();
+	}
+
+	// Remove the value at the cursor, and rebalance the subtree that left
+	// too sparse unless it's the whole tree, which is the caller's to deal
+	// with.
+	void remove_at(cursor& c) {
+		sink(c, _tree._H);
+		_tree._n--;
+		add_to_counts(c.path, c.depth, -1);
+		if (_tree._n >= min_count(1) && c.depth > 1 && find_sparse_point(c)) {
+			value_type none = Params::absent_value();
+			size_t count = this->count(c);
+			cursor values = compact(c, none);
+			clear_counts(c);
+			distribute(c, count, values, c.depth);
+		}
+	}
+
+	// Move the cursor, at the root of a tree of height H, to the smallest
+	// value greater than the given one. Returns false if there is none.
+	static bool seek_past(cursor& c, size_t H, const value_type& value) {
+		unsigned above = 0;
+		while (c.is_present()) {
+			int comp = c.compare(value);
+			if (comp < 0) {
+				above = c.depth;
+			}
+			if (c.depth == H) {
+				break;
+			}
+			if (comp < 0) {
+				c.left();
+			} else {
+				c.right();
+			}
+		}
+		if (above == 0) {
+			return false;
+		}
+		while (c.depth > above) {
+			c.up();
+		}
+		return true;
+	}
+
+	// Returns the number of counters a tree of height H keeps.
+	static size_t count_slots(size_t H) {
+		return H >= _counted_height ? size_t(1) << (H + 1 - _counted_height) : 0;
+	}
+
+	// Do the next share of an incremental resize, first starting one if
+	// the tree is close enough to full that it will just finish in time.
+	void advance_resize() {
+		if (_resize_step == 0 || _tree._H == 0) {
+			return;
+		}
+		if (!_resize) {
+			size_t H = _tree._H + 1;
+			size_t N = (size_t(1) << H) - 1;
+			// Preparing the array; copying the values, while each operation
+			// may add one past the copy; and then replaying at most one
+			// change for each operation of the copy.
+			size_t ops = (N + count_slots(H)) / (_prepare_ratio * _resize_step) +
+			             2 * (_tree._n / (_resize_step - 1)) + 1;
+			if (_tree._n + ops < max_count(1)) {
+				return;
+			}
+			begin_resize();
+		}
+		resize_state& r = *_resize;
+		bool kept = true;
+		if (!r.copying) {
+			if (prepare(_prepare_ratio * _resize_step)) {
+				start_copy();
+			}
+		} else if (!r.copied_all) {
+			kept = copy(_resize_step);
+		} else {
+			// Every operation logs a change first, so the trade has to
+			// come in the same step as the replay that catches up.
+			kept = replay(_replay_step);
+			if (kept && r.replayed == r.log.size()) {
+				trade();
+				return;
+			}
+		}
+		if (!kept) {
+			discard_resize();
+		}
+	}
+
+	// Do all that's left of an incremental resize now. It's dropped if the
+	// new tree can't take the values.
+	void complete_resize() {
+		resize_state& r = *_resize;
+		if (!r.copying) {
+			prepare((size_t) -1);
+			start_copy();
+		}
+		if (copy((size_t) -1) && replay((size_t) -1)) {
+			trade();
+		} else {
+			discard_resize();
+		}
+	}
+
+	// Allocate, but don't yet initialize, the arrays of a tree one level
+	// taller than this one.
+	void begin_resize() {
+		_resize.reset(new resize_state());
+		tree& other = _resize->other;
+		other._H = _tree._H + 1;
+		size_t N = (size_t(1) << other._H) - 1;
+		other._values = (value_type *) allocateStorage(N * sizeof(value_type), _storage);
+		size_t counts = count_slots(other._H);
+		other._counts = counts > 0 ? new uint32_t[counts] : nullptr;
+		_resize->copying = false;
+		_resize->progress = 0;
+	}
+
+	// Initialize up to slots more slots of the tree being prepared, and
+	// return whether it's ready.
+	bool prepare(size_t slots) {
+		resize_state& r = *_resize;
+		size_t N = (size_t(1) << r.other._H) - 1;
+		size_t total = N + count_slots(r.other._H);
+		size_t end = r.progress + std::min(slots, total - r.progress);
+		if (r.progress < N) {
+			size_t stop = std::min(N, end);
+			std::uninitialized_fill(r.other._values + r.progress, r.other._values + stop,
+			                        Params::absent_value());
+			r.progress = stop;
+		}
+		if (r.progress < end) {
+			std::fill(r.other._counts + (r.progress - N), r.other._counts + (end - N), 0);
+			r.progress = end;
+		}
+		return r.progress == total;
+	}
+
+	// Start copying the values into the prepared tree. Like the other steps
+	// that work on the new tree, this swaps it in as _tree while it runs,
+	// so the cursor filling it follows _tree.
+	void start_copy() {
+		resize_state& r = *_resize;
+		r.copying = true;
+		r.last = Params::absent_value();
+		r.remaining = _tree._n;
+		r.copied = 0;
+		r.copied_all = false;
+		r.log.reserve(_tree._n / std::max<size_t>(_resize_step, 2) + 1);
+		r.replayed = 0;
+		std::swap(_tree, r.other);
+		precompute_BTD();
+		r.fill = cursor(_tree);
+		plan(r.remaining);
+		std::swap(_tree, r.other);
+	}
+
+	// Returns true if the subtree at the cursor lies along the right edge
+	// of the tree. The values past the copy all go into those, so their
+	// right subtrees take whatever is inserted past it as well.
+	static bool open(const cursor& c) {
+		return c.path == (1u << c.depth) - 1;
+	}
+
+	// Plan how the share values bound for the subtree the copy just got to
+	// are laid out: half of them to the left, as distribute would.
+	void plan(size_t share) {
+		resize_state& r = *_resize;
+		unsigned d = r.fill.depth;
+		r.start[d] = r.copied;
+		r.share[d] = share;
+		r.left_share[d] = std::min(share / 2, (size_t(1) << (_tree._H - d)) - 1);
+	}
+
+	// Put the next value in order into the new tree. Returns false if it
+	// doesn't fit, which only happens once so many values have been
+	// inserted past the copy that they outgrow the tree's right edge.
+	bool place(const value_type& value) {
+		resize_state& r = *_resize;
+		cursor& f = r.fill;
+		while (true) {
+			unsigned d = f.depth;
+			if (f.is_present()) {
+				if (d == _tree._H) {
+					return false;
+				}
+				size_t share = open(f) ? r.remaining + 1 : r.share[d] - (r.copied - r.start[d]);
+				f.right();
+				plan(share);
+			} else if (r.copied - r.start[d] < r.left_share[d]) {
+				f.left();
+				plan(r.left_share[d]);
+			} else {
+				f.cur() = value;
+				_tree._n++;
+				r.copied++;
+				break;
+			}
+		}
+		// Close the subtrees the value completes. After a left subtree
+		// the next value goes in its parent; after a right one the parent
+		// is complete too.
+		while (!open(f) && r.copied - r.start[f.depth] == r.share[f.depth]) {
+			if (f.depth <= counted_depth()) {
+				_tree._counts[f.path] = r.share[f.depth];
+			}
+			bool left = (f.path & 1) == 0;
+			f.up();
+			if (left) {
+				break;
+			}
+		}
+		return true;
+	}
+
+	// Copy up to count more values into the new tree, finishing the copy
+	// if none are left. Returns false if they don't fit.
+	bool copy(size_t count) {
+		resize_state& r = *_resize;
+		if (r.copied_all) {
+			return true;
+		}
+		std::swap(_tree, r.other);
+		bool fits = true;
+		if (r.remaining > 0) {
+			cursor c(r.other);
+			if (Params::is_present(r.last)) {
+				seek_past(c, r.other._H, r.last);
+			} else {
+				c.first_value();
+			}
+			for (size_t i = 1; ; i++) {
+				r.remaining--;
+				fits = place(c.cur());
+				if (!fits || r.remaining == 0 || i == count) {
+					break;
+				}
+				c.next_value(1);
+			}
+			r.last = c.cur();
+		}
+		if (fits && r.remaining == 0) {
+			finish_copy();
+		}
+		std::swap(_tree, r.other);
+		return fits;
+	}
+
+	// End the copy, closing the subtrees still open with what they have.
+	// Values removed past the copy can leave one of them with values to
+	// its left but none in its own slot; the last of those moves up into
+	// it, and so on down from the slot that frees.
+	void finish_copy() {
+		resize_state& r = *_resize;
+		cursor& f = r.fill;
+		while (true) {
+			cursor hole(f);
+			while (!hole.is_present() && hole.depth < _tree._H) {
+				cursor c(hole);
+				c.left();
+				if (!c.is_present()) {
+					break;
+				}
+				c.last_value();
+				std::swap(hole.cur(), c.cur());
+				add_to_counts(hole.path, hole.depth, 1);
+				add_to_counts(c.path, c.depth, -1);
+				hole = c;
+			}
+			if (f.depth <= counted_depth()) {
+				_tree._counts[f.path] = r.copied - r.start[f.depth];
+			}
+			if (f.depth == 1) {
+				break;
+			}
+			f.up();
+		}
+		r.copied_all = true;
+	}
+
+	// Note a value inserted into or removed from the tree while its values
+	// are being copied. A change the copy has passed is logged, to replay
+	// into the new tree; one it hasn't reached changes what's left to copy.
+	void log_change(const value_type& value, bool inserted) {
+		if (!resizing()) {
+			return;
+		}
+		resize_state& r = *_resize;
+		if (r.copied_all || (Params::is_present(r.last) && Params::compare(value, r.last) <= 0)) {
+			r.log.emplace_back(value, inserted);
+		} else if (inserted) {
+			r.remaining++;
+		} else {
+			r.remaining--;
+		}
+	}
+
+	// Make up to count more of the logged changes to the new tree. Returns
+	// false if it fills up first.
+	bool replay(size_t count) {
+		resize_state& r = *_resize;
+		std::swap(_tree, r.other);
+		bool fits = true;
+		size_t end = r.replayed + std::min(count, r.log.size() - r.replayed);
+		for (; r.replayed < end; r.replayed++) {
+			const std::pair<value_type, bool>& change = r.log[r.replayed];
+			cursor c(_tree);
+			if (change.second) {
+				if (_tree._n + 1 > max_count(1)) {
+					fits = false;
+					break;
+				}
+				insert(c, change.first);
+			} else if (descend_to(c, _tree._H, change.first)) {
+				remove_at(c);
+			}
+		}
+		std::swap(_tree, r.other);
+		return fits;
+	}
+
+	// Switch to the new tree, which now holds the same values, and free the
+	// old one; or, if so many values were removed meanwhile that the new
+	// tree would start out too sparse, drop it instead.
+	void trade() {
+		resize_state& r = *_resize;
+		std::swap(_tree, r.other);
+		assert(_tree._n == r.other._n);
+		if (_tree._n < min_count(1)) {
+			std::swap(_tree, r.other);
+			discard_resize();
+			return;
+		}
+		free_tree(r.other);
+		_resize.reset();
+	}
+
+	// Drop an incremental resize where it stands, freeing the new tree.
+	void discard_resize() {
+		resize_state& r = *_resize;
+		if (r.copying) {
+			free_tree(r.other);
+		} else {
+			size_t N = (size_t(1) << r.other._H) - 1;
+			for (size_t i = 0; i < std::min(r.progress, N); i++) {
+				r.other._values[i].~value_type();
+			}
+			freeStorage(r.other._values, N * sizeof(value_type), _storage);
+			delete[] r.other._counts;
+		}
+		_resize.reset();
+	}
+
+	// Returns the index of the first small value not less than value.
+	size_t small_position(const value_type& value) const {
+		const value_type * small = small_values();
+		size_t i = 0;
+		while (i < _tree._n && Params::compare(value, small[i]) > 0) {
+			i++;
+		}
+		return i;
+	}
+
+	// Returns the number of distinct values in the sorted range [begin, end)
+	// that aren't among the small values.
+	template<typename Iterator>
+	size_t count_new_small(Iterator begin, Iterator end) const {
+		const value_type * small = small_values();
+		size_t i = 0;
+		size_t count = 0;
+		for (Iterator last = end; begin != end; last = begin, ++begin) {
+			if (last != end && Params::compare(*last, *begin) == 0) {
+				continue;
+			}
+			while (i < _tree._n && Params::compare(*begin, small[i]) > 0) {
+				i++;
+			}
+			count += i == _tree._n || Params::compare(*begin, small[i]) != 0;
+		}
+		return count;
+	}
+
+	// Returns the number of distinct values in the sorted range [begin, end)
+	// that aren't in the tree.
+	template<typename Iterator>
+	size_t count_new(Iterator begin, Iterator end) const {
+		if (_tree._H == 0) {
+			return count_new_small(begin, end);
+		}
+		size_t count = 0;
+		for (Iterator last = end; begin != end; last = begin, ++begin) {
+			if (last == end || Params::compare(*last, *begin) != 0) {
+				count += !contains(*begin);
+			}
+		}
+		return count;
+	}
+
+	// Move the small values into a new tree of height H.
+	void leave_small(size_t H) {
+		_tree._H = H;
+		_tree._values = allocate_values(H);
+		precompute_BTD();
+		_tree._counts = allocate_counts();
+		if (_tree._n > 0) {
+			value_type * small = small_values();
+			cursor c(_tree);
+			distribute(c, _tree._n, small);
+			std::fill_n(small_values(), _tree._n, Params::absent_value());
+		}
+	}
+
 	// Precompute the BTD arrays.
 	void precompute_BTD() {
-		_tree._BTD = new size_t[3 * _tree._H - 1];
+		_tree._BTD = new size_t[5 * _tree._H - 1];
 		if (_tree._H > 1) {
 			precompute_BTD_rec(1, _tree._H);
 		}
+		// A subtree is too dense once its count passes tau(d) * size, and
+		// too sparse once it falls under gamma(d) * size.
+		size_t * bounds = _tree._BTD + 3 * _tree._H - 1;
+		for (unsigned d = 1; d <= _tree._H; d++) {
+			size_t size = (size_t(1) << (_tree._H - d + 1)) - 1;
+			double tau = _tree._H > 1 ? _tau(d) : _tau1;
+			double gamma = _tree._H > 1 ? _gamma(d) : _gamma1;
+			bounds[2 * (d - 1)] = std::floor(tau * size);
+			bounds[2 * (d - 1) + 1] = std::ceil(gamma * size);
+		}
+	}
+
+	// The most values a subtree rooted at depth d may hold.
+	size_t max_count(unsigned d) const {
+		return _tree._BTD[3 * _tree._H - 1 + 2 * (d - 1)];
+	}
+
+	// The fewest values a subtree rooted at depth d may hold.
+	size_t min_count(unsigned d) const {
+		return _tree._BTD[3 * _tree._H - 1 + 2 * (d - 1) + 1];
+	}
+
+	// The deepest depth whose subtrees keep a counter, or 0 if none do.
+	unsigned counted_depth() const {
+		return _tree._H >= _counted_height ? _tree._H + 1 - _counted_height : 0;
+	}
+
+	// Allocate zeroed counters for a tree of height _tree._H.
+	uint32_t * allocate_counts() const {
+		unsigned d = counted_depth();
+		return d > 0 ? new uint32_t[size_t(1) << d]() : nullptr;
+	}
+
+	// Add delta to the counter of every subtree containing the node at the
+	// given path and depth.
+	void add_to_counts(unsigned path, unsigned depth, int delta) {
+		unsigned d = counted_depth();
+		if (depth > d) {
+			path >>= depth - d;
+			depth = d;
+		}
+		for (; depth > 0; depth--, path >>= 1) {
+			_tree._counts[path] += delta;
+		}
+	}
+
+	// Zero the counters of every subtree under the cursor, itself included,
+	// before the values there are redistributed.
+	void clear_counts(const cursor& c) {
+		size_t first = c.path;
+		for (unsigned d = c.depth; d <= counted_depth(); d++, first <<= 1) {
+			size_t width = size_t(1) << (d - c.depth);
+			std::fill_n(_tree._counts + first, width, 0);
+		}
 	}
 
 	// Precompute the BTD array entries for depths between d_top and
@@ -452,6 +1363,9 @@ private:
 	                                >::value
 	                                           >::type>
 	void distribute(cursor& c, size_t n, Iterator& it) {
+		if (c.depth <= counted_depth()) {
+			_tree._counts[c.path] = n;
+		}
 		size_t n_left = n / 2;
 		size_t n_right = n - n_left - 1;
 		if (n_left > 0) {
@@ -469,6 +1383,9 @@ private:
 
 	// Same thing, but where we're distributing from slots.
 	void distribute(cursor& c, size_t n, cursor& v, size_t H) {
+		if (c.depth <= counted_depth()) {
+			_tree._counts[c.path] = n;
+		}
 		size_t n_left = n / 2;
 		size_t n_right = n - n_left - 1;
 		if (n_left > 0) {
@@ -485,35 +1402,234 @@ private:
 		}
 	}
 
+	// Same thing, but merging the m values compacted at v with the sorted
+	// values in [it, end) and dropping those the tree already holds.
+	template<typename Iterator>
+	void distribute(cursor& c, size_t n, cursor& v, size_t& m, Iterator& it, const Iterator& end, size_t H) {
+		if (c.depth <= counted_depth()) {
+			_tree._counts[c.path] = n;
+		}
+		size_t n_left = n / 2;
+		size_t n_right = n - n_left - 1;
+		if (n_left > 0) {
+			c.left();
+			distribute(c, n_left, v, m, it, end, H);
+			c.up();
+		}
+		if (it != end && (m == 0 || v.compare(*it) < 0)) {
+			c.cur() = *it;
+			skip_equal(it, end);
+		} else {
+			if (it != end && v.compare(*it) == 0) {
+				skip_equal(it, end);
+			}
+			std::swap(c.cur(), v.cur());
+			if (--m > 0) {
+				v.next_slot(H);
+			}
+		}
+		if (n_right > 0) {
+			c.right();
+			distribute(c, n_right, v, m, it, end, H);
+			c.up();
+		}
+	}
+
 	// Resize the tree to a new height.
 	void resize(size_t new_H) {
+		const value_type * none = nullptr;
+		resize(new_H, none, none);
+	}
+
+	// Resize the tree to a new height, merging in the sorted values in
+	// [begin, end) on the way. Returns how many of them were added.
+	template<typename Iterator>
+	size_t resize(size_t new_H, Iterator begin, Iterator end) {
 		tree old_tree = _tree;
 		_tree._H = new_H;
 		if (_tree._H > 0) {
-			size_t N = (1 << _tree._H) - 1;
-			_tree._values = new value_type[N];
-			std::fill_n(_tree._values, N, Params::absent_value()); // TODO
+			_tree._values = allocate_values(_tree._H);
 			precompute_BTD();
+			_tree._counts = allocate_counts();
 		} else {
 			_tree._values = nullptr;
 			_tree._BTD = nullptr;
+			_tree._counts = nullptr;
 		}
 
-		if (_tree._n > 0) {
-			cursor values(old_tree);
+		size_t added = 0;
+		if (_tree._n > 0 || begin != end) {
 			cursor slots(_tree);
-			compact_into(values, slots);
+			if (_tree._n > 0) {
+				cursor values(old_tree);
+				compact_into(values, slots);
+			}
 
 			cursor tree(_tree);
-			distribute(tree, _tree._n, slots, tree.depth);
+			added = merge(tree, slots, _tree._n, begin, end);
+			_tree._n += added;
+		}
+
+		free_tree(old_tree);
+		return added;
+	}
+
+	// Insert the value into the subtree rooted at the cursor, which must
+	// have room for it; then the rebalance point is in that subtree too.
+	bool insert(cursor& c, const value_type& value) {
+		int comp;
+		while (true) {
+			if (!c.is_present()) {
+				c.cur() = value;
+				_tree._n++;
+				add_to_counts(c.path, c.depth, 1);
+				return true;
+			}
+			comp = c.compare(value);
+			if (comp == 0) {
+				return false;
+			}
+			if (c.depth == _tree._H) {
+				break;
+			}
+			if (comp < 0) {
+				c.left();
+			} else {
+				c.right();
+			}
+		}
+		// Find the rebalance point, compact the elements, and then redistribute them.
+		value_type local_value = value;
+		size_t count = find_rebalance_point(c);
+		cursor values = compact(c, local_value);
+		_tree._n++;
+		add_to_counts(c.path >> 1, c.depth - 1, 1);
+		clear_counts(c);
+		distribute(c, count, values, c.depth);
+		return true;
+	}
+
+	// Insert the sorted values in [begin, end) into the subtree rooted at
+	// the cursor, which must be able to take all of them. Pushes each part
+	// of the batch down to a child that can also take it, and rebuilds the
+	// subtree at the cursor only when one can't.
+	template<typename Iterator>
+	size_t insert_sorted(cursor& c, Iterator begin, Iterator end) {
+		if (std::next(begin) == end) {
+			cursor leaf(c);
+			return insert(leaf, *begin);
+		}
+		size_t m = count(c);
+		size_t k = std::distance(begin, end);
+		if (c.is_present() && c.depth < _tree._H && m > _rebuild_ratio * k) {
+			auto less = [](const value_type& a, const value_type& b) {
+				return Params::compare(a, b) < 0;
+			};
+			Iterator mid = std::lower_bound(begin, end, c.cur(), less);
+			Iterator right = std::upper_bound(mid, end, c.cur(), less);
+			size_t n_left = std::distance(begin, mid);
+			size_t n_right = std::distance(right, end);
+			c.left();
+			bool left_fits = n_left == 0 || count(c) + n_left <= max_count(c.depth);
+			c.up();
+			c.right();
+			bool right_fits = n_right == 0 || count(c) + n_right <= max_count(c.depth);
+			c.up();
+			if (left_fits && right_fits) {
+				size_t added = 0;
+				if (n_left > 0) {
+					c.left();
+					added += insert_sorted(c, begin, mid);
+					c.up();
+				}
+				if (n_right > 0) {
+					c.right();
+					added += insert_sorted(c, right, end);
+					c.up();
+				}
+				return added;
+			}
 		}
+		value_type none = Params::absent_value();
+		cursor values = m > 0 ? compact(c, none) : c;
+		clear_counts(c);
+		size_t added = merge(c, values, m, begin, end);
+		_tree._n += added;
+		add_to_counts(c.path >> 1, c.depth - 1, added);
+		return added;
+	}
 
-		delete[] old_tree._values;
-		delete[] old_tree._BTD;
+	// Distribute the m values compacted at v, together with those sorted
+	// values in [begin, end) that aren't among them, into the subtree
+	// rooted at c. Returns how many values came from the batch.
+	template<typename Iterator>
+	size_t merge(cursor& c, cursor v, size_t m, Iterator begin, Iterator end) {
+		size_t H = c.depth;
+		size_t added = 0;
+		cursor w(v);
+		size_t left = m;
+		for (Iterator it = begin; it != end; ) {
+			assert(Params::is_present(*it));
+			while (left > 0 && w.compare(*it) > 0) {
+				if (--left > 0) {
+					w.next_slot(H);
+				}
+			}
+			if (left == 0 || w.compare(*it) != 0) {
+				added++;
+			}
+			skip_equal(it, end);
+		}
+		distribute(c, m + added, v, m, begin, end, H);
+		return added;
+	}
+
+	// Advance the iterator past the current value and any copies of it.
+	template<typename Iterator>
+	static void skip_equal(Iterator& it, const Iterator& end) {
+		Iterator first = it;
+		do {
+			++it;
+		} while (it != end && Params::compare(*it, *first) == 0);
+	}
+
+	// Allocate the value array for a tree of height H, with every slot absent.
+	value_type * allocate_values(size_t H) const {
+		size_t N = (1 << H) - 1;
+		value_type * values = (value_type *) allocateStorage(N * sizeof(value_type), _storage);
+		std::uninitialized_fill_n(values, N, Params::absent_value());
+		return values;
+	}
+
+	// Free the value array, BTD tables and counters of the given tree.
+	void free_tree(tree& t) const {
+		free_values(t);
+		delete[] t._BTD;
+		delete[] t._counts;
+	}
+
+	// Free the value array of the given tree.
+	void free_values(tree& t) const {
+		if (t._values == nullptr) {
+			return;
+		}
+		size_t N = (1 << t._H) - 1;
+		for (size_t i = 0; i < N; i++) {
+			t._values[i].~value_type();
+		}
+		freeStorage(t._values, N * sizeof(value_type), _storage);
 	}
 
 	// Count the number of values in the subtree rooted at the cursor.
-	size_t count(cursor c) {
+	size_t count(const cursor& c) const {
+		if (c.depth <= counted_depth()) {
+			return _tree._counts[c.path];
+		}
+		return count_values(c);
+	}
+
+	// Count the values in the subtree rooted at the cursor by visiting them.
+	size_t count_values(cursor c) const {
 		size_t total = 0;
 		if (c.is_present()) {
 			size_t H = c.depth;
@@ -526,13 +1642,54 @@ private:
 		return total;
 	}
 
+	// Starting from the slot that a value was just removed from, find the
+	// smallest enclosing subtree whose density is at least gamma(d), and
+	// return whether any smaller one was below it, i.e. whether the found
+	// subtree needs rebalancing. The whole tree is always dense enough, or
+	// it would have been shrunk instead.
+	bool find_sparse_point(cursor& c) {
+		bool sparse = false;
+		while (c.depth > 1) {
+			c.up();
+			if (count(c) >= min_count(c.depth)) {
+				return sparse;
+			}
+			sparse = true;
+		}
+		return sparse;
+	}
+
+	// Shrink the tree to the height that its values call for, or back into
+	// the small array if they fit there.
+	void shrink() {
+		if (_resize) {
+			discard_resize();
+		}
+		if (_tree._n > _small_capacity) {
+			resize(height(_tree._n));
+			return;
+		}
+		value_type * small = small_values();
+		if (_tree._n > 0) {
+			cursor c(_tree);
+			c.first_value();
+			size_t i = 0;
+			do {
+				small[i++] = c.cur();
+			} while (c.next_value(1));
+		}
+		free_tree(_tree);
+		_tree._values = nullptr;
+		_tree._BTD = nullptr;
+		_tree._counts = nullptr;
+		_tree._H = 0;
+	}
+
 	// Find the point at which we can rebalance and return the number of
 	// elements in this subtree.
 	size_t find_rebalance_point(cursor& c) {
 		assert(c.depth == _tree._H);
 		size_t nodes = 2; // The current (leaf) node and what will be its child.
-		size_t size;
-		double density;
 		do {
 			// Add the number of values in our sibling to the number of nodes.
 			int path = c.path & 1;
@@ -544,10 +1701,7 @@ private:
 			}
 			nodes += count(c) + 1;
 			c.up();
-			// Recalculate statistics.
-			size = (1 << (_tree._H - c.depth + 1)) - 1;
-			density = (double) nodes / size;
-		} while (density > _tau(c.depth));
+		} while (nodes > max_count(c.depth));
 		return nodes;
 	}
 
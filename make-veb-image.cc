@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#include "vEB-tree.h"
+
+// Streams a binary file of sorted ints into an image with
+// VebTree<int>::build_image, and reports how fast that went and how much
+// memory it took.
+int buildSorted(const string& keysPath, const string& imagePath) {
+  auto start = chrono::steady_clock::now();
+  try {
+    VebTree<int>::build_image(keysPath, imagePath);
+  } catch (const runtime_error& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  struct stat info;
+  stat(keysPath.c_str(), &info);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  cout << "Wrote " << info.st_size / sizeof(int) << " keys to " << imagePath
+       << " at " << info.st_size / 1e6 / seconds << " MB/s, peak RSS "
+       << usage.ru_maxrss / 1024.0 << " MB" << endl;
+  return 0;
+}
+
+// Builds a VebTree<int> from a text file of keys (whitespace separated, in
+// any order, duplicates allowed) and writes it out as an image that
+// VebTree<int>::open_mapped can load. With --sorted, the keys file instead
+// holds raw ints in increasing order, and is streamed into the image without
+// loading it, so it can be bigger than memory.
+int main(int argc, char* argv[]) {
+  bool blocked = argc == 4 && string(argv[1]) == "--blocked";
+  bool sorted = argc == 4 && string(argv[1]) == "--sorted";
+  if (argc != 3 && !blocked && !sorted) {
+    cerr << "usage: " << argv[0] << " [--blocked | --sorted] <keys file> <image file>" << endl;
+    return 1;
+  }
+  string keysPath = argv[argc - 2];
+  string imagePath = argv[argc - 1];
+  if (sorted) {
+    return buildSorted(keysPath, imagePath);
+  }
+
+  ifstream in(keysPath);
+  if (!in) {
+    cerr << keysPath << ": can't open" << endl;
+    return 1;
+  }
+  vector<int> v;
+  int key;
+  while (in >> key) {
+    v.push_back(key);
+  }
+  if (!in.eof()) {
+    cerr << keysPath << ": expected whitespace separated integers" << endl;
+    return 1;
+  }
+  sort(v.begin(), v.end());
+  v.erase(unique(v.begin(), v.end()), v.end());
+  if (!v.empty() && v.back() == numeric_limits<int>::max()) {
+    cerr << keysPath << ": " << v.back() << " is reserved for padding" << endl;
+    return 1;
+  }
+
+  try {
+    VebTree<int> t(v, blocked ? kBlockedVebLayout : kPureVebLayout);
+    t.save(imagePath);
+    VebTree<int>::open_mapped(imagePath, true);
+  } catch (const runtime_error& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  cout << "Wrote " << v.size() << " keys to " << imagePath << endl;
+  return 0;
+}
@@ -27,7 +27,7 @@ int main(int argc, char* argv[]) {
   }
   v.push_back(200000);
   v.push_back(200001);
-  VebTree t(v);
+  VebTree<int> t(v);
   
   btree::btree_set<int, std::less<int>, std::allocator<int>, 64> bts;
   if (!VEB) {
@@ -0,0 +1,269 @@
+#ifndef STATIC_VEB_TREE
+#define STATIC_VEB_TREE
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "tree-storage.h"
+#include "vEB-tree.h"
+
+// A static set of keys in exactly the layout VebTree uses, for a tree whose
+// height is fixed at compile time to 2^Order, so it holds up to
+// 2^(2^Order) - 1 keys: 3 for order 1, 15 for order 2, 255 for order 3 and
+// 65535 for order 4. At those heights every split of the recursion is an
+// exact half, and the size and offset of every top and bottom tree is a
+// compile-time constant, so the search unrolls into straight-line code with
+// no BTD tables and no position stack.
+//
+// The array is the one VebTree would build for the same keys at the same
+// height, so images are interchangeable: save writes an image VebTree can
+// open_mapped, and open_mapped here takes any image of a pure VebTree of
+// height 2^Order, which is what VebTree builds for more than
+// 2^(2^Order - 1) - 1 keys. Fewer keys than that still fit, padded out with
+// Params::sentinel(), but then VebTree would have picked a shorter tree.
+template <typename Key, int Order, typename Params = VebTreeParams<Key> >
+class StaticVebTree {
+  static_assert(Order >= 0 && Order <= 5, "supported orders are 0 to 5");
+
+public:
+  typedef Key key_type;
+
+  static const int kHeight = 1 << Order;
+  static const uint64_t kCapacity = (uint64_t(1) << kHeight) - 1;
+
+  // Builds a tree from n <= kCapacity keys in sorted order, throwing
+  // std::length_error if there are too many. The layout is allocated
+  // according to storage.
+  StaticVebTree(const key_type * keys, size_t n,
+                StoragePolicy storage = StoragePolicy());
+  StaticVebTree(const std::vector<key_type>& keys,
+                StoragePolicy storage = StoragePolicy())
+      : StaticVebTree(keys.data(), keys.size(), storage) {}
+  StaticVebTree(StaticVebTree&& other);
+  ~StaticVebTree();
+
+  bool contains(const key_type& key) const {
+    bool found = false;
+    search(key, found);
+    return found;
+  }
+  // Also sets rank to the number of keys less than key, as in VebTree.
+  bool contains(const key_type& key, size_t& rank) const {
+    bool found = false;
+    rank = std::min<uint64_t>(search(key, found), numKeys);
+    return found;
+  }
+  size_t rank(const key_type& key) const {
+    bool found = false;
+    return std::min<uint64_t>(search(key, found), numKeys);
+  }
+
+  // The number of keys in the tree.
+  size_t size() const { return numKeys; }
+  // The number of bytes the tree takes up, not counting the object itself.
+  size_t memory_bytes() const { return layoutSize() * sizeof(key_type); }
+
+  // Image files in VebTree's format (see VebTree::save and open_mapped).
+  // open_mapped throws std::runtime_error if the image isn't a pure layout
+  // of this height and key type.
+  void save(const std::string& path) const;
+  static StaticVebTree open_mapped(const std::string& path,
+                                   bool verifyChecksum = false);
+
+private:
+  StaticVebTree()
+      : tree(nullptr), numKeys(0), numSegments(0), mapping(nullptr),
+        mappingLength(0) {}
+  StaticVebTree(const StaticVebTree&) = delete;
+  void operator=(const StaticVebTree&) = delete;
+
+  template <int Height>
+  using height = std::integral_constant<int, Height>;
+
+  // The split of a tree of the given height (at least 2): the top tree and
+  // the bottom trees below it, and their sizes.
+  template <int Height>
+  struct Split {
+    static const int kTop = (Height + 1) / 2;
+    static const int kBottom = Height - kTop;
+    static const uint64_t kTopSize = (uint64_t(1) << kTop) - 1;
+    static const uint64_t kBottomSize = (uint64_t(1) << kBottom) - 1;
+  };
+  typedef Split<(kHeight > 1 ? kHeight : 2)> Outer;
+
+  // Returns the number of slots (in order) of the subtree at node that are
+  // less than key, i.e. which of the empty slots below its leaves the search
+  // ends at, and sets found if it passes a key equal to key. This is walk
+  // from VebTree with the recursion done by the compiler: the bottom tree to
+  // continue in is picked by the top tree's answer, at a constant stride.
+  template <int Height>
+  static uint64_t descend(const key_type * node, const key_type& key,
+                          bool& found, height<Height>) {
+    typedef Split<Height> S;
+    uint64_t top = descend(node, key, found, height<S::kTop>());
+    const key_type * bottom = node + S::kTopSize + top * S::kBottomSize;
+    return (top << S::kBottom) | descend(bottom, key, found,
+                                         height<S::kBottom>());
+  }
+  static uint64_t descend(const key_type * node, const key_type& key,
+                          bool& found, height<1>) {
+    bool equal, greater;
+    VebTree<Key, Params>::compareKeys(key, *node, equal, greater);
+    found |= equal;
+    return greater;
+  }
+
+  // The same for the whole tree, where the outermost bottom tree is clamped
+  // to the ones that are stored (just like VebTree::segmentPosition).
+  uint64_t search(const key_type& key, bool& found) const {
+    return search(key, found, std::integral_constant<bool, (kHeight > 1)>());
+  }
+  uint64_t search(const key_type& key, bool& found, std::true_type) const {
+    uint64_t top = descend(tree, key, found, height<Outer::kTop>());
+    const key_type * bottom = tree + Outer::kTopSize +
+        std::min<uint64_t>(top, numSegments - 1) * Outer::kBottomSize;
+    return (top << Outer::kBottom) | descend(bottom, key, found,
+                                             height<Outer::kBottom>());
+  }
+  uint64_t search(const key_type& key, bool& found, std::false_type) const {
+    return descend(tree, key, found, height<1>());
+  }
+
+  // Writes the subtree with in-order values valueAt(0), valueAt(1), ... to
+  // out, storing only its first segments bottom trees (or all of them, if
+  // there aren't that many).
+  template <int Height, typename ValueAt>
+  static void place(key_type * out, ValueAt valueAt, uint64_t segments,
+                    height<Height>) {
+    typedef Split<Height> S;
+    place(out, [&](uint64_t j) { return valueAt(((j + 1) << S::kBottom) - 1); },
+          uint64_t(-1), height<S::kTop>());
+    segments = std::min<uint64_t>(segments, S::kTopSize + 1);
+    for (uint64_t b = 0; b < segments; b++) {
+      place(out + S::kTopSize + b * S::kBottomSize,
+            [&](uint64_t i) { return valueAt((b << S::kBottom) + i); },
+            uint64_t(-1), height<S::kBottom>());
+    }
+  }
+  template <typename ValueAt>
+  static void place(key_type * out, ValueAt valueAt, uint64_t, height<1>) {
+    out[0] = valueAt(0);
+  }
+
+  size_t layoutSize() const {
+    return kHeight == 1 ? 1 : Outer::kTopSize + numSegments * Outer::kBottomSize;
+  }
+  void setSegments(size_t storedKeys) {
+    numSegments = kHeight == 1 ? 0 :
+        std::min<size_t>(Outer::kTopSize + 1,
+                         storedKeys / (Outer::kBottomSize + 1) + 1);
+  }
+
+  key_type * tree;
+  size_t numKeys;
+  // The number of outermost bottom trees that are actually stored.
+  size_t numSegments;
+  // For trees from open_mapped, the image that tree points into.
+  const char * mapping;
+  size_t mappingLength;
+  StoragePolicy storage;
+};
+
+template <typename Key, int Order, typename Params>
+StaticVebTree<Key, Order, Params>::StaticVebTree(const key_type * keys,
+                                                 size_t n,
+                                                 StoragePolicy storage)
+    : tree(nullptr), numKeys(n), numSegments(0), mapping(nullptr),
+      mappingLength(0), storage(storage) {
+  if (n > kCapacity) {
+    throw std::length_error("too many keys for a StaticVebTree of this order");
+  }
+  setSegments(n);
+  size_t slots = layoutSize();
+  tree = (key_type *) allocateStorage(slots * sizeof(key_type), storage);
+  for (size_t i = 0; i < slots; i++) {
+    new (&tree[i]) key_type;
+  }
+  key_type pad = Params::sentinel();
+  place(tree, [&](uint64_t i) { return i < n ? keys[i] : pad; },
+        numSegments, height<kHeight>());
+}
+
+template <typename Key, int Order, typename Params>
+StaticVebTree<Key, Order, Params>::StaticVebTree(StaticVebTree&& other)
+    : tree(other.tree), numKeys(other.numKeys),
+      numSegments(other.numSegments), mapping(other.mapping),
+      mappingLength(other.mappingLength), storage(other.storage) {
+  other.tree = nullptr;
+  other.mapping = nullptr;
+}
+
+template <typename Key, int Order, typename Params>
+StaticVebTree<Key, Order, Params>::~StaticVebTree() {
+  if (mapping != nullptr) {
+    vebUnmapImage(mapping, mappingLength);
+  } else if (tree != nullptr) {
+    size_t slots = layoutSize();
+    for (size_t i = 0; i < slots; i++) {
+      tree[i].~key_type();
+    }
+    freeStorage(tree, slots * sizeof(key_type), storage);
+  }
+}
+
+template <typename Key, int Order, typename Params>
+void StaticVebTree<Key, Order, Params>::save(const std::string& path) const {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "only trivially copyable keys can be saved");
+  VebTreeImageHeader header = VebTreeImageHeader();
+  header.keyType = VebTree<Key, Params>::keyTypeCode();
+  header.keySize = sizeof(key_type);
+  header.layout = kPureVebLayout;
+  header.treeHeight = kHeight;
+  header.topHeight = kHeight == 1 ? 1 : Outer::kTop;
+  header.numKeys = numKeys;
+  header.numSegments = numSegments;
+  header.treeSlots = layoutSize();
+  vebWriteImage(path, header, tree, nullptr);
+}
+
+template <typename Key, int Order, typename Params>
+StaticVebTree<Key, Order, Params>
+StaticVebTree<Key, Order, Params>::open_mapped(const std::string& path,
+                                               bool verifyChecksum) {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "only trivially copyable keys can be mapped");
+  VebTreeImageHeader header;
+  StaticVebTree result;
+  result.mapping = vebMapImage(path, verifyChecksum, header,
+                               result.mappingLength);
+  auto fail = [&](const char * reason) {
+    throw std::runtime_error(path + ": " + reason);
+  };
+  if (header.keyType != VebTree<Key, Params>::keyTypeCode() ||
+      header.keySize != sizeof(key_type)) {
+    fail("image holds a different key type");
+  }
+  if (header.layout != kPureVebLayout || header.numBlocks != 0) {
+    fail("only the pure layout has a static version");
+  }
+  if (header.treeHeight != kHeight || header.numKeys > kCapacity) {
+    fail("image holds a tree of a different height");
+  }
+  result.numKeys = header.numKeys;
+  result.setSegments(result.numKeys);
+  if (header.numSegments != result.numSegments ||
+      header.treeSlots != result.layoutSize()) {
+    fail("tree shape doesn't match the key count");
+  }
+  result.tree = (key_type *) (result.mapping + header.treeOffset);
+  return result;
+}
+
+#endif
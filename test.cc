@@ -3,12 +3,21 @@
 
 #include "cotree.h"
 #include "vEB-tree.h"
+#include "vEB-map.h"
+#include "static-vEB-tree.h"
+#include "weighted-vEB-tree.h"
+#include "adaptive-vEB-tree.h"
 #include <vector>
 #include <list>
 #include <set>
 #include <cassert>
+#include <cstdio>
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
 
 struct IntCOBTreeParams : public cotree::cotree_params_tag {
 	typedef int value_type;
@@ -63,6 +72,998 @@ void test_construction() {
 	}
 }
 
+void test_veb_small() {
+	std::vector<int> empty;
+	VebTree<int> empty_tree(empty);
+	assert(empty_tree.size() == 0);
+	assert(!empty_tree.contains(0));
+	// The sentinel matches the padding, but isn't a key.
+	const int sentinel = std::numeric_limits<int>::max();
+	assert(!empty_tree.contains(sentinel));
+	assert(empty_tree.lower_bound(0) == nullptr);
+	std::vector<int> one(1, 7);
+	VebTree<int> one_tree(one);
+	assert(one_tree.contains(7));
+	assert(!one_tree.contains(6));
+	assert(*one_tree.lower_bound(6) == 7);
+	assert(one_tree.predecessor(7) == nullptr);
+	VebTree<int> one_blocked(one, kBlockedVebLayout);
+	assert(one_blocked.contains(7));
+	assert(!one_blocked.contains(8));
+
+	// Trees small enough to be stored inline, and a little bigger, moved
+	// around as a vector of them grows.
+	std::vector<std::vector<int> > keys;
+	std::vector<VebTree<int> > trees;
+	for (unsigned size = 0; size < 40; size++) {
+		keys.push_back(rand_vector(size));
+		trees.push_back(VebTree<int>(keys.back()));
+		assert((trees.back().memory_bytes() == 0) == (size <= 16));
+	}
+	for (unsigned size = 0; size < 40; size++) {
+		const std::vector<int>& v = keys[size];
+		int end = v.empty() ? 2 : v.back() + 2;
+		for (int i = -1; i < end; i++) {
+			assert(trees[size].contains(i) == std::binary_search(v.begin(), v.end(), i));
+		}
+		assert(!trees[size].contains(sentinel));
+		size_t rank = 0;
+		for (const int& key : trees[size]) {
+			assert(key == v[rank++]);
+		}
+		assert(rank == size);
+
+		// The ordered queries and batches, which small trees answer
+		// from their sorted keys.
+		std::vector<int> probes;
+		for (int i = -1; i < end; i++) {
+			probes.push_back(i);
+		}
+		std::unique_ptr<bool[]> out(new bool[probes.size()]);
+		std::vector<size_t> ranks(probes.size());
+		trees[size].contains_sorted_batch(probes.data(), probes.size(),
+		                                  out.get(), ranks.data());
+		for (size_t j = 0; j < probes.size(); j++) {
+			int i = probes[j];
+			std::vector<int>::const_iterator lower =
+				std::lower_bound(v.begin(), v.end(), i);
+			std::vector<int>::const_iterator upper =
+				std::upper_bound(v.begin(), v.end(), i);
+			assert(trees[size].rank(i) == size_t(lower - v.begin()));
+			assert(ranks[j] == size_t(lower - v.begin()));
+			assert(out[j] == (lower != upper));
+			const int * key = trees[size].lower_bound(i);
+			assert(key == nullptr ? lower == v.end() : *key == *lower);
+			key = trees[size].upper_bound(i);
+			assert(key == nullptr ? upper == v.end() : *key == *upper);
+			key = trees[size].predecessor(i);
+			assert(key == nullptr ? lower == v.begin() : *key == lower[-1]);
+			assert(trees[size].count_range(i, i + 5) ==
+			       size_t(std::upper_bound(v.begin(), v.end(), i + 5) - lower));
+		}
+		for (size_t i = 0; i < size; i++) {
+			assert(*trees[size].select(i) == v[i]);
+		}
+		assert(trees[size].select(size) == nullptr);
+	}
+	VebTree<int> assigned(keys[20]);
+	assigned = std::move(trees[5]);
+	assert(assigned.size() == 5 && assigned.contains(keys[5][4]));
+}
+
+void test_veb_recursive() {
+	for (unsigned size = 2; size < 1384; size++) {
+		std::vector<int> v = rand_vector(size);
+		VebTree<int> tree(v);
+		int end = v[size - 1] + 2;
+		for (int i = -1; i < end; i++) {
+			assert(tree.contains(i) == tree.containsRecursive(i));
+		}
+		assert(!tree.containsRecursive(std::numeric_limits<int>::max()));
+	}
+}
+
+void test_veb_key_types() {
+	std::vector<uint64_t> ids;
+	std::vector<std::pair<uint64_t, uint64_t> > pairs;
+	uint64_t base = (uint64_t) 1 << 40;
+	for (unsigned size = 2; size < 300; size++) {
+		ids.clear();
+		pairs.clear();
+		for (unsigned i = 0; i < size; i++) {
+			ids.push_back(base + 3 * i);
+			pairs.push_back(std::make_pair(base + i / 4, (uint64_t) 2 * (i % 4)));
+		}
+		VebTree<uint64_t> id_tree(ids);
+		VebTree<std::pair<uint64_t, uint64_t> > pair_tree(pairs);
+		for (unsigned i = 0; i < 3 * size; i++) {
+			assert(id_tree.contains(base + i) == (i % 3 == 0));
+		}
+		assert(!id_tree.contains(0));
+		for (unsigned i = 0; i < size; i++) {
+			assert(pair_tree.contains(pairs[i]));
+			assert(!pair_tree.contains(std::make_pair(pairs[i].first, pairs[i].second + 1)));
+		}
+	}
+}
+
+// Checks that a query result matches the expected iterator into v.
+void check_bound(const int * result, std::vector<int>::const_iterator expected,
+                 const std::vector<int>& v) {
+	if (expected == v.end()) {
+		assert(result == nullptr);
+	} else {
+		assert(result != nullptr && *result == *expected);
+	}
+}
+
+void test_veb_ordered() {
+	for (unsigned size = 2; size < 1384; size++) {
+		std::vector<int> v = rand_vector(size);
+		VebTree<int> tree(v);
+		int end = v[size - 1] + 2;
+		for (int i = -1; i < end; i++) {
+			auto lower = std::lower_bound(v.begin(), v.end(), i);
+			auto upper = std::upper_bound(v.begin(), v.end(), i);
+			check_bound(tree.lower_bound(i), lower, v);
+			check_bound(tree.upper_bound(i), upper, v);
+			check_bound(tree.successor(i), upper, v);
+			if (lower == v.begin()) {
+				assert(tree.predecessor(i) == nullptr);
+			} else {
+				check_bound(tree.predecessor(i), lower - 1, v);
+			}
+		}
+	}
+}
+
+void test_veb_batch() {
+	for (unsigned size = 2; size < 1384; size += 7) {
+		std::vector<int> v = rand_vector(size);
+		VebTree<int> tree(v);
+		std::vector<int> keys;
+		for (int i = -1; i < v[size - 1] + 2; i++) {
+			keys.push_back(i);
+		}
+		std::random_shuffle(keys.begin(), keys.end());
+		bool * out = new bool[keys.size()];
+		tree.contains_batch(keys.data(), keys.size(), out);
+		for (size_t i = 0; i < keys.size(); i++) {
+			assert(out[i] == tree.contains(keys[i]));
+		}
+		delete[] out;
+	}
+}
+
+// Checks a blocked tree of the given key type against the sorted keys in v,
+// both through contains and contains_batch.
+template<class K>
+void check_blocked(const std::vector<int>& v) {
+	std::vector<K> keys(v.begin(), v.end());
+	VebTree<K> tree(keys, kBlockedVebLayout);
+	std::vector<K> queries;
+	for (int i = 0; i < v.back() + 2; i++) {
+		queries.push_back(K(i));
+	}
+	bool * out = new bool[queries.size()];
+	tree.contains_batch(queries.data(), queries.size(), out);
+	for (size_t i = 0; i < queries.size(); i++) {
+		bool present = std::binary_search(keys.begin(), keys.end(), queries[i]);
+		assert(tree.contains(queries[i]) == present);
+		assert(out[i] == present);
+	}
+	delete[] out;
+}
+
+void test_veb_blocked() {
+	for (unsigned size = 2; size < 1384; size += 3) {
+		std::vector<int> v = rand_vector(size);
+		check_blocked<int>(v);
+		check_blocked<int64_t>(v);
+		check_blocked<uint64_t>(v);
+		check_blocked<double>(v);
+	}
+}
+
+template<class K>
+void check_compressed(const std::vector<int>& v, int scale, int shift) {
+	std::vector<K> keys;
+	for (int key : v) {
+		keys.push_back(K(key) * scale + shift);
+	}
+	VebTree<K> tree(keys, kCompressedVebLayout);
+	std::vector<K> queries;
+	for (K q = keys.front() - 2; q < keys.back() + 2; q++) {
+		queries.push_back(q);
+	}
+	std::unique_ptr<bool[]> out(new bool[queries.size()]);
+	std::vector<size_t> ranks(queries.size());
+	tree.contains_batch(queries.data(), queries.size(), out.get(), ranks.data());
+	for (size_t i = 0; i < queries.size(); i++) {
+		size_t expected = std::lower_bound(keys.begin(), keys.end(), queries[i]) - keys.begin();
+		bool present = expected < keys.size() && keys[expected] == queries[i];
+		size_t rank;
+		assert(tree.contains(queries[i], rank) == present);
+		assert(rank == expected);
+		assert(out[i] == present && ranks[i] == expected);
+	}
+}
+
+void test_veb_compressed() {
+	for (unsigned size = 1; size < 1384; size += 7) {
+		std::vector<int> v = rand_vector(size);
+		check_compressed<int>(v, 1, 0);
+		check_compressed<int>(v, 1, -5000);
+		// Gaps of up to 2000 overflow most blocks.
+		check_compressed<int>(v, 100, -50000);
+		check_compressed<int64_t>(v, 1, -5000);
+		check_compressed<uint64_t>(v, 1, 0);
+	}
+	std::vector<int> v = rand_vector(100000);
+	assert(VebTree<int>(v, kCompressedVebLayout).memory_bytes() * 3 <
+	       VebTree<int>(v, kBlockedVebLayout).memory_bytes() * 2);
+	bool threw = false;
+	try {
+		VebTree<double>(std::vector<double>(v.begin(), v.end()), kCompressedVebLayout);
+	} catch (const std::invalid_argument&) {
+		threw = true;
+	}
+	assert(threw);
+}
+
+void test_veb_parallel_build() {
+	std::vector<int> v = rand_vector(300000);
+	VebTree<int> serial(v, kPureVebLayout, 1);
+	VebTree<int> parallel(v, kPureVebLayout, 4);
+	VebTree<int> blocked(v, kBlockedVebLayout, 4);
+	for (int i = 0; i < v.back() + 2; i++) {
+		bool present = std::binary_search(v.begin(), v.end(), i);
+		assert(serial.contains(i) == present);
+		assert(parallel.contains(i) == present);
+		assert(blocked.contains(i) == present);
+	}
+}
+
+template<class A, class B>
+void check_same_keys(const A& a, const B& b, const std::vector<int>& v) {
+	for (int i = -1; i < v.back() + 2; i++) {
+		assert(a.contains(i) == b.contains(i));
+	}
+}
+
+void test_veb_mapped() {
+	const char * path = "veb-test.img";
+	std::vector<int> v = rand_vector(5000);
+	for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+		VebTree<int> t(v, layout);
+		t.save(path);
+		VebTree<int> mapped = VebTree<int>::open_mapped(path, true);
+		assert(mapped.size() == v.size());
+		check_same_keys(t, mapped, v);
+		// Moving a mapped tree hands over the mapping.
+		VebTree<int> moved(std::move(mapped));
+		check_same_keys(t, moved, v);
+	}
+	std::vector<int> one(1, 7);
+	VebTree<int>(one).save(path);
+	assert(VebTree<int>::open_mapped(path).contains(7));
+
+	// Images only open as the key type they were written with.
+	VebTree<int>(v).save(path);
+	bool threw = false;
+	try {
+		VebTree<int64_t>::open_mapped(path);
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	assert(threw);
+
+	// Corrupt the last key: the header still checks out, the checksum doesn't.
+	FILE * file = fopen(path, "r+b");
+	fseek(file, -1, SEEK_END);
+	fputc(0x55, file);
+	fclose(file);
+	VebTree<int>::open_mapped(path);
+	threw = false;
+	try {
+		VebTree<int>::open_mapped(path, true);
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	assert(threw);
+	std::remove(path);
+}
+
+void test_veb_rank() {
+	std::vector<int> v = rand_vector(3000);
+	for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+		VebTree<int> t(v, layout);
+		std::vector<int> queries;
+		for (int i = -1; i < v.back() + 2; i++) {
+			queries.push_back(i);
+		}
+		std::vector<size_t> ranks(queries.size());
+		std::unique_ptr<bool[]> found(new bool[queries.size()]);
+		t.contains_batch(queries.data(), queries.size(), found.get(), ranks.data());
+		for (size_t i = 0; i < queries.size(); i++) {
+			size_t expected = std::lower_bound(v.begin(), v.end(), queries[i]) - v.begin();
+			size_t rank;
+			assert(t.contains(queries[i], rank) == found[i]);
+			assert(rank == expected);
+			assert(ranks[i] == expected);
+		}
+	}
+}
+
+// Checks contains and rank against v for every key from lo to hi, with the
+// jump table built at a range of sizes.
+template<class K>
+void check_jump_table(const std::vector<K>& v, K lo, K hi) {
+	for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+		VebTree<K> t(v, layout);
+		for (int bits : {1, 3, 8, 12, 20, 64, 0}) {
+			t.build_jump_table(bits);
+			for (K key = lo; ; key++) {
+				size_t expected = std::lower_bound(v.begin(), v.end(), key) - v.begin();
+				bool present = expected < v.size() && v[expected] == key;
+				size_t rank;
+				assert(t.contains(key) == present);
+				assert(t.contains(key, rank) == present);
+				assert(rank == expected);
+				if (key == hi) {
+					break;
+				}
+			}
+		}
+	}
+}
+
+void test_veb_jump_table() {
+	std::vector<int> v = rand_vector(20000);
+	check_jump_table(v, -1, v.back() + 1);
+
+	// Skewed keys: a dense run, then a sparse tail, all negative.
+	std::vector<int64_t> skewed;
+	for (int64_t i = 0; i < 5000; i++) {
+		skewed.push_back(i < 4000 ? i - 100000 : (i - 4000) * (i - 4000) * 7 - 90000);
+	}
+	check_jump_table<int64_t>(skewed, -100002, skewed.back() + 2);
+	check_jump_table<int64_t>(std::vector<int64_t>(1, 5), 0, 10);
+
+	// Keys near the top of the range, just below the padding.
+	std::vector<uint64_t> high;
+	for (uint64_t i = 0; i < 3000; i++) {
+		high.push_back(std::numeric_limits<uint64_t>::max() - 3 * (3000 - i));
+	}
+	check_jump_table<uint64_t>(high, high[0] - 2, std::numeric_limits<uint64_t>::max() - 1);
+
+	// Keys spanning the whole range, which every bucket count has to
+	// shift down.
+	std::vector<int64_t> wide;
+	for (int64_t i = 0; i < 3000; i++) {
+		wide.push_back(std::numeric_limits<int64_t>::min() + 1 + i * 3074457345618258ll);
+	}
+	wide.push_back(std::numeric_limits<int64_t>::max() - 1);
+	for (int bits : {8, 20}) {
+		VebTree<int64_t> t(wide);
+		t.build_jump_table(bits);
+		for (size_t i = 0; i < wide.size(); i++) {
+			size_t rank;
+			assert(t.contains(wide[i], rank) && rank == i);
+			assert(!t.contains(wide[i] - 1, rank) && rank == i);
+		}
+	}
+
+	bool threw = false;
+	try {
+		VebTree<int>(v, kCompressedVebLayout).build_jump_table(8);
+	} catch (const std::invalid_argument&) {
+		threw = true;
+	}
+	assert(threw);
+}
+
+void test_veb_sorted_batch() {
+	std::vector<int> v = rand_vector(5000);
+	for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout, kCompressedVebLayout}) {
+		VebTree<int> t(v, layout);
+		// Every key, a sparse sample with repeats, and nothing at all.
+		for (int step : {1, 37, 1000}) {
+			std::vector<int> queries;
+			for (int i = -3; i < v.back() + 3; i += step) {
+				queries.push_back(i);
+				if (i % 7 == 0) {
+					queries.push_back(i);
+				}
+			}
+			std::vector<size_t> ranks(queries.size());
+			std::unique_ptr<bool[]> found(new bool[queries.size()]);
+			t.contains_sorted_batch(queries.data(), queries.size(), found.get(), ranks.data());
+			for (size_t i = 0; i < queries.size(); i++) {
+				size_t rank;
+				assert(t.contains(queries[i], rank) == found[i]);
+				assert(rank == ranks[i]);
+			}
+			t.contains_sorted_batch(queries.data(), queries.size(), found.get());
+		}
+		t.contains_sorted_batch(nullptr, 0, nullptr);
+	}
+}
+
+void test_veb_order_statistics() {
+	std::vector<int> v = rand_vector(3000);
+	for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+		VebTree<int> t(v, layout);
+		for (size_t i = 0; i < v.size(); i++) {
+			assert(t.select(i) != nullptr && *t.select(i) == v[i]);
+			assert(t.rank(v[i]) == i);
+		}
+		assert(t.select(v.size()) == nullptr);
+		for (int a = -1; a < v.back() + 2; a += 7) {
+			for (int b = a - 3; b < v.back() + 2; b += 331) {
+				size_t expected = a > b ? 0 :
+					std::upper_bound(v.begin(), v.end(), b) - std::lower_bound(v.begin(), v.end(), a);
+				assert(t.count_range(a, b) == expected);
+			}
+		}
+	}
+	const int sentinel = std::numeric_limits<int>::max();
+	for (size_t n : {0, 1, 2, 3, 4, 7, 8, 20, 100}) {
+		std::vector<int> small(n);
+		for (size_t i = 0; i < n; i++) {
+			small[i] = 2 * i;
+		}
+		VebTree<int> t(small);
+		for (size_t i = 0; i < n; i++) {
+			assert(*t.select(i) == int(2 * i));
+		}
+		assert(t.select(n) == nullptr);
+		assert(t.count_range(-5, 1000) == n);
+		// Ranges up to the sentinel end at the last key, not the padding.
+		assert(t.count_range(0, sentinel) == n);
+		assert(t.count_range(sentinel, sentinel) == 0);
+		if (n > 0) {
+			VebTree<int> blocked(small, kBlockedVebLayout);
+			assert(blocked.count_range(0, sentinel) == n);
+		}
+	}
+}
+
+void test_veb_iterator() {
+	for (size_t n : {0, 1, 2, 3, 15, 16, 17, 100, 3000}) {
+		std::vector<int> v = rand_vector(n);
+		for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+			VebTree<int> t(v, layout);
+			assert(std::equal(v.begin(), v.end(), t.begin()));
+			assert(size_t(std::distance(t.begin(), t.end())) == n);
+			std::vector<int> backward;
+			for (auto itr = t.end(); itr != t.begin(); ) {
+				backward.push_back(*--itr);
+			}
+			assert(std::equal(v.rbegin(), v.rend(), backward.begin()));
+			// Step back and forth from the middle.
+			if (n > 2) {
+				auto itr = t.iterator_at(n / 2);
+				assert(*itr == v[n / 2]);
+				assert(*--itr == v[n / 2 - 1]);
+				assert(*++itr == v[n / 2]);
+				assert(*++itr == v[n / 2 + 1]);
+			}
+			if (n == 0) {
+				continue;
+			}
+			for (int lo = -1; lo < v.back() + 2; lo += 13) {
+				for (int hi = lo - 1; hi < v.back() + 2; hi += 97) {
+					std::vector<int> seen;
+					t.for_each_in_range(lo, hi, [&](int key) { seen.push_back(key); });
+					auto first = std::lower_bound(v.begin(), v.end(), lo);
+					auto last = std::upper_bound(v.begin(), v.end(), hi);
+					assert(seen == std::vector<int>(first, std::max(first, last)));
+				}
+			}
+			// A scan to the end of the set stops at the last key.
+			std::vector<int> seen;
+			t.for_each_in_range(0, std::numeric_limits<int>::max(), [&](int key) { seen.push_back(key); });
+			assert(seen == v);
+		}
+	}
+}
+
+void test_storage() {
+	std::vector<int> v = rand_vector(100000);
+	for (StorageBacking backing : {kAlignedStorage, kTransparentHugePageStorage, kHugetlbStorage}) {
+		for (bool prefault : {false, true}) {
+			StoragePolicy storage(backing, prefault);
+			try {
+				VebTree<int> pure(v, kPureVebLayout, 0, storage);
+				VebTree<int> blocked(v, kBlockedVebLayout, 0, storage);
+				cotree::cotree<IntCOBTreeParams> co(v, storage);
+				for (int i = 0; i < v.back() + 2; i++) {
+					bool present = std::binary_search(v.begin(), v.end(), i);
+					assert(pure.contains(i) == present);
+					assert(blocked.contains(i) == present);
+					assert(co.contains(i) == present);
+				}
+				// Growing the cotree reallocates with the same policy.
+				for (int i = 0; i < 100000; i++) {
+					co.insert(v.back() + 1 + i);
+				}
+				assert(co.contains(v.back() + 100000));
+			} catch (const std::bad_alloc&) {
+				// There may be no hugetlbfs pages to be had.
+				assert(backing == kHugetlbStorage);
+			}
+		}
+	}
+}
+
+void test_veb_map() {
+	std::vector<int> v = rand_vector(3000);
+	std::vector<std::string> names;
+	for (int key : v) {
+		names.push_back(std::to_string(key));
+	}
+	for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+		VebMap<int, std::string> m(v, names, layout);
+		assert(m.size() == v.size());
+		std::vector<int> queries;
+		for (int i = -1; i < v.back() + 2; i++) {
+			queries.push_back(i);
+		}
+		std::vector<const std::string *> values(queries.size());
+		m.find_batch(queries.data(), queries.size(), values.data());
+		for (size_t i = 0; i < queries.size(); i++) {
+			const std::string * value = m.find(queries[i]);
+			if (std::binary_search(v.begin(), v.end(), queries[i])) {
+				assert(value != nullptr && *value == std::to_string(queries[i]));
+			} else {
+				assert(value == nullptr);
+			}
+			assert(values[i] == value);
+		}
+		*m.find(v[0]) = "first";
+		assert(*m.find(v[0]) == "first");
+
+		// The sentinel matches the padding of a tree with room to spare,
+		// but there's no value for it.
+		const int sentinel = std::numeric_limits<int>::max();
+		std::vector<int> four(v.begin(), v.begin() + 4);
+		VebMap<int, std::string> small(four, std::vector<std::string>(names.begin(), names.begin() + 4), layout);
+		assert(small.find(sentinel) == nullptr);
+		const std::string * found = &names[0];
+		small.find_batch(&sentinel, 1, &found);
+		assert(found == nullptr);
+		size_t rank;
+		VebTree<int> keys(four, layout);
+		assert(!keys.contains(sentinel, rank) && rank == 4);
+		bool present = true;
+		keys.contains_sorted_batch(&sentinel, 1, &present, &rank);
+		assert(!present && rank == 4);
+	}
+
+	bool threw = false;
+	try {
+		VebMap<int, std::string>(v, std::vector<std::string>(names.begin(), names.end() - 1));
+	} catch (const std::invalid_argument&) {
+		threw = true;
+	}
+	assert(threw);
+}
+
+std::string read_file(const char * path) {
+	std::string bytes;
+	FILE * file = fopen(path, "rb");
+	for (int c; (c = fgetc(file)) != EOF; ) {
+		bytes.push_back(c);
+	}
+	fclose(file);
+	return bytes;
+}
+
+void write_keys(const char * path, const std::vector<int>& keys) {
+	FILE * file = fopen(path, "wb");
+	if (!keys.empty()) {
+		fwrite(keys.data(), sizeof(int), keys.size(), file);
+	}
+	fclose(file);
+}
+
+void test_veb_build_image() {
+	const char * keysPath = "veb-test.keys";
+	const char * path = "veb-test.img";
+	const char * builtPath = "built-veb-test.img";
+	for (size_t n : {0, 1, 2, 3, 4, 7, 8, 100, 1000, 5000, 70000, 300000}) {
+		std::vector<int> v = rand_vector(n);
+		write_keys(keysPath, v);
+		VebTree<int>::build_image(keysPath, builtPath);
+		VebTree<int>(v).save(path);
+		assert(read_file(builtPath) == read_file(path));
+		VebTree<int>::open_mapped(builtPath, true);
+	}
+
+	std::vector<int> v = rand_vector(1000);
+	std::swap(v[500], v[501]);
+	write_keys(keysPath, v);
+	bool threw = false;
+	try {
+		VebTree<int>::build_image(keysPath, builtPath);
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	assert(threw);
+	std::remove(keysPath);
+	std::remove(path);
+	std::remove(builtPath);
+}
+
+template<int Order>
+void check_static_veb(size_t n) {
+	const char * path = "veb-test.img";
+	const char * staticPath = "static-veb-test.img";
+	std::vector<int> v = rand_vector(n);
+	StaticVebTree<int, Order> s(v);
+	VebTree<int> t(v);
+	assert(s.size() == n);
+	int last = v.empty() ? 0 : v.back();
+	for (int i = -1; i < last + 2; i++) {
+		size_t rank, staticRank;
+		assert(s.contains(i, staticRank) == t.contains(i, rank));
+		assert(staticRank == rank);
+	}
+	// Either tree reads the other's images when the heights agree, and
+	// then the images are byte for byte the same.
+	s.save(staticPath);
+	VebTree<int> mapped = VebTree<int>::open_mapped(staticPath, true);
+	check_same_keys(t, mapped, v.empty() ? std::vector<int>(1, 0) : v);
+	if (n > (size_t(1) << (StaticVebTree<int, Order>::kHeight - 1)) - 1) {
+		t.save(path);
+		assert(read_file(path) == read_file(staticPath));
+		StaticVebTree<int, Order> staticMapped =
+			StaticVebTree<int, Order>::open_mapped(path, true);
+		check_same_keys(t, staticMapped, v);
+	}
+	std::remove(path);
+	std::remove(staticPath);
+}
+
+void test_static_veb() {
+	for (size_t n : {0, 1}) {
+		check_static_veb<0>(n);
+	}
+	for (size_t n = 0; n <= 15; n++) {
+		check_static_veb<1>(std::min<size_t>(n, 3));
+		check_static_veb<2>(n);
+	}
+	for (size_t n : {1, 100, 127, 128, 200, 254, 255}) {
+		check_static_veb<3>(n);
+	}
+	for (size_t n : {300, 32767, 32768, 50000, 65535}) {
+		check_static_veb<4>(n);
+	}
+
+	// A tree of a different height doesn't open.
+	VebTree<int>(rand_vector(1000)).save("veb-test.img");
+	bool threw = false;
+	try {
+		StaticVebTree<int, 3>::open_mapped("veb-test.img");
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	assert(threw);
+	std::remove("veb-test.img");
+}
+
+void test_weighted_veb() {
+	for (size_t size : {0, 1, 2, 3, 10, 1000, 20000}) {
+		std::vector<int> v = rand_vector(size);
+		// Zipf-like weights in a random order, with some keys never looked up.
+		std::vector<double> weights(size);
+		for (size_t i = 0; i < size; i++) {
+			weights[i] = i % 5 == 0 ? 0 : 1.0 / (1 + i);
+		}
+		std::random_shuffle(weights.begin(), weights.end());
+		WeightedVebTree<int> t(v, weights);
+		assert(t.size() == size);
+		int bound = 2;
+		while ((size_t(1) << bound) < 16 * size) {
+			bound++;
+		}
+		assert(t.height() <= 2 * bound);
+		int last = v.empty() ? 0 : v.back();
+		for (int i = -1; i < last + 2; i++) {
+			assert(t.contains(i) == std::binary_search(v.begin(), v.end(), i));
+		}
+	}
+
+	// Equal weights give a balanced tree.
+	std::vector<int> v = rand_vector(1023);
+	WeightedVebTree<int> balanced(v, std::vector<double>(v.size(), 1.0));
+	assert(balanced.height() == 10);
+	WeightedVebTree<int> moved(std::move(balanced));
+	assert(moved.contains(v[500]));
+}
+
+void test_adaptive_veb() {
+	std::vector<int> v = rand_vector(5000);
+	int last = v.back();
+	{
+		AdaptiveVebTree<int> t(v, 0, 1);
+		assert(t.size() == v.size());
+		for (int i = -1; i < last + 2; i++) {
+			assert(t.contains(i) == std::binary_search(v.begin(), v.end(), i));
+		}
+		// Hammer a few keys, then relay out by hand; with relayoutSamples at
+		// 0 nothing else replaces the tree.
+		for (int round = 0; round < 1000; round++) {
+			for (size_t i = 0; i < 10; i++) {
+				assert(t.contains(v[i * 31]));
+			}
+		}
+		assert(t.relayouts() == 0);
+		assert(t.relayout());
+		t.wait_for_relayout();
+		assert(t.relayouts() == 1);
+		for (int i = -1; i < last + 2; i++) {
+			assert(t.contains(i) == std::binary_search(v.begin(), v.end(), i));
+		}
+	}
+
+	// Several threads looking up keys while the tree relays itself out.
+	AdaptiveVebTree<int> t(v, 500, 4, 1 << 10);
+	std::vector<std::thread> threads;
+	for (int thread = 0; thread < 4; thread++) {
+		threads.emplace_back([&t, &v, last, thread]() {
+			for (int round = 0; round < 20; round++) {
+				for (int i = -1; i < last + 2; i += 1 + thread) {
+					assert(t.contains(i) == std::binary_search(v.begin(), v.end(), i));
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	t.wait_for_relayout();
+	assert(t.relayouts() > 0);
+}
+
+void test_cotree_small() {
+	typedef cotree::cotree<IntCOBTreeParams> Tree;
+	for (unsigned size = 0; size < 40; size++) {
+		std::vector<int> v = rand_vector(size);
+		Tree built(v);
+		Tree ascending;
+		Tree descending;
+		Tree shuffled;
+		std::vector<int> order(v);
+		std::random_shuffle(order.begin(), order.end());
+		for (size_t i = 0; i < size; i++) {
+			assert(ascending.insert(v[i]));
+			assert(descending.insert(v[size - 1 - i]));
+			assert(shuffled.insert(order[i]));
+			assert(!shuffled.insert(order[i]));
+		}
+		int end = v.empty() ? 2 : v.back() + 2;
+		for (int i = 0; i < end; i++) {
+			bool present = std::binary_search(v.begin(), v.end(), i);
+			assert(built.contains(i) == present);
+			assert(ascending.contains(i) == present);
+			assert(descending.contains(i) == present);
+			assert(shuffled.contains(i) == present);
+		}
+		shuffled.check_invariants();
+	}
+}
+
+void test_cotree_removal() {
+	typedef cotree::cotree<IntCOBTreeParams> Tree;
+	std::set<int> set;
+	Tree tree;
+	size_t size = 3000;
+	// Grow, churn, then drain to empty, so the tree shrinks all the way back
+	// into the small array.
+	for (int phase = 0; phase < 3; phase++) {
+		for (unsigned i = 0; i < 4 * size; i++) {
+			int value = rand() % size;
+			bool insert = phase == 0 ? rand() % 4 != 1 : phase == 1 ? rand() % 2 == 1 : rand() % 4 == 1;
+			if (insert) {
+				assert(tree.insert(value) == set.insert(value).second);
+			} else {
+				assert(tree.remove(value) == (set.erase(value) == 1));
+			}
+			if (i % 97 == 0) {
+				tree.check_invariants();
+				for (int j = 0; j < int(size) + 2; j++) {
+					assert(tree.contains(j) == (set.count(j) == 1));
+				}
+			}
+		}
+	}
+	for (int value : std::vector<int>(set.begin(), set.end())) {
+		assert(tree.remove(value));
+		assert(!tree.remove(value));
+		assert(!tree.contains(value));
+	}
+	tree.check_invariants();
+	assert(tree.insert(7) && tree.contains(7));
+}
+
+void test_cotree_insert_sorted() {
+	typedef cotree::cotree<IntCOBTreeParams> Tree;
+	std::set<int> set;
+	Tree tree;
+	size_t range = 20000;
+	// Batches of every size, sorted, with repeats and values the tree
+	// already has, so they go through the small array, the per-subtree
+	// merges, and resizes.
+	for (size_t batch_size : {1, 5, 12, 40, 3, 300, 2000, 7, 100, 5000, 60, 1, 8000}) {
+		std::vector<int> batch;
+		for (size_t i = 0; i < batch_size; i++) {
+			batch.push_back(rand() % range);
+		}
+		std::sort(batch.begin(), batch.end());
+		size_t expected = set.size();
+		set.insert(batch.begin(), batch.end());
+		expected = set.size() - expected;
+		assert(tree.insert_sorted(batch.begin(), batch.end()) == expected);
+		tree.check_invariants();
+		for (int j = 0; j <= int(range); j++) {
+			assert(tree.contains(j) == (set.count(j) == 1));
+		}
+		// Removing a few keeps the tree from only ever growing.
+		for (size_t i = 0; i < batch_size / 4; i++) {
+			int value = rand() % range;
+			assert(tree.remove(value) == (set.erase(value) == 1));
+		}
+	}
+	// A batch of nothing but values the tree already has.
+	std::vector<int> all(set.begin(), set.end());
+	assert(tree.insert_sorted(all.begin(), all.end()) == 0);
+	tree.check_invariants();
+	// And one long enough to outgrow the tree, but mostly repeats of
+	// values it has.
+	std::vector<int> repeats;
+	for (int value : all) {
+		repeats.insert(repeats.end(), 4, value);
+	}
+	repeats.push_back(int(range) + 1);
+	assert(tree.insert_sorted(repeats.begin(), repeats.end()) == 1);
+	assert(tree.size() == all.size() + 1);
+	tree.check_invariants();
+
+	// A small set given a long batch that's mostly values it already has
+	// is sized by the values it ends up with, not by the batch.
+	for (size_t fresh : {0, 3, 10}) {
+		Tree small;
+		std::vector<int> batch;
+		for (int i = 0; i < 10; i++) {
+			small.insert(5 * i);
+			for (int j = 0; j < 5; j++) {
+				batch.push_back(5 * i);
+			}
+		}
+		for (size_t i = 0; i < fresh; i++) {
+			batch.push_back(1000 + int(i));
+		}
+		assert(small.insert_sorted(batch.begin(), batch.end()) == fresh);
+		assert(small.size() == 10 + fresh);
+		small.check_invariants();
+		for (int i = 0; i < 50; i++) {
+			assert(small.contains(i) == (i % 5 == 0));
+		}
+	}
+}
+
+// Checks iteration both ways against set, and the ordered queries for
+// every probe from lo to hi.
+template<class Tree>
+void check_cotree_ordered(const Tree& tree, const std::set<int>& set, int lo, int hi) {
+	assert(std::equal(tree.begin(), tree.end(), set.begin()));
+	assert(size_t(std::distance(tree.begin(), tree.end())) == set.size());
+	std::vector<int> backward;
+	for (auto it = tree.end(); it != tree.begin(); ) {
+		backward.push_back(*--it);
+	}
+	assert(std::equal(backward.begin(), backward.end(), set.rbegin()));
+
+	for (int probe = lo; probe <= hi; probe++) {
+		auto lower = set.lower_bound(probe);
+		auto upper = set.upper_bound(probe);
+		assert((tree.lower_bound(probe) == tree.end()) == (lower == set.end()));
+		assert(lower == set.end() || *tree.lower_bound(probe) == *lower);
+		assert((tree.upper_bound(probe) == tree.end()) == (upper == set.end()));
+		assert(upper == set.end() || *tree.upper_bound(probe) == *upper);
+		assert(tree.successor(probe) == tree.upper_bound(probe));
+		auto found = tree.find(probe);
+		assert((found != tree.end()) == (set.count(probe) == 1));
+		assert(found == tree.end() || *found == probe);
+		auto pred = tree.predecessor(probe);
+		assert((pred == tree.end()) == (lower == set.begin()));
+		assert(pred == tree.end() || *pred == *std::prev(lower));
+		if (pred != tree.end()) {
+			assert(++pred == tree.lower_bound(probe));
+		}
+	}
+}
+
+void test_cotree_ordered() {
+	typedef cotree::cotree<IntCOBTreeParams> Tree;
+	// Small sets, trees, and a tree emptied by removals.
+	for (size_t size : {0, 1, 5, 16, 17, 300, 5000}) {
+		std::set<int> set;
+		Tree tree;
+		for (size_t i = 0; i < size; i++) {
+			int value = 2 * (rand() % (size * 4));
+			assert(tree.insert(value) == set.insert(value).second);
+		}
+		assert(tree.size() == set.size());
+		check_cotree_ordered(tree, set, -1, int(size * 8) + 2);
+
+		for (int value : std::vector<int>(set.begin(), set.end())) {
+			assert(tree.remove(value));
+		}
+		assert(tree.begin() == tree.end());
+		assert(tree.lower_bound(0) == tree.end());
+		assert(tree.predecessor(size * 8) == tree.end());
+	}
+}
+
+void test_cotree_incremental_resize() {
+	typedef cotree::cotree<IntCOBTreeParams> Tree;
+	for (size_t step : {1, 3, 16}) {
+		std::set<int> set;
+		Tree tree;
+		tree.set_incremental_resize(step);
+		size_t range = 40000;
+		bool resized = false;
+		unsigned checked_resizing = 0;
+		// Mostly inserts, so the tree grows through several resizes, with
+		// removes on both sides of the copy while values are copied.
+		for (unsigned i = 0; i < 60000; i++) {
+			int value = rand() % range;
+			if (rand() % 4 != 1) {
+				assert(tree.insert(value) == set.insert(value).second);
+			} else {
+				assert(tree.remove(value) == (set.erase(value) == 1));
+			}
+			resized = resized || tree.resizing();
+			assert(tree.size() == set.size());
+			if (i % 1009 == 0) {
+				tree.check_invariants();
+				for (int j = 0; j <= int(range); j++) {
+					assert(tree.contains(j) == (set.count(j) == 1));
+				}
+			}
+			// Iteration and the ordered queries while values are being
+			// copied into the bigger array.
+			if (tree.resizing() && i % 211 == 0) {
+				check_cotree_ordered(tree, set, -1, int(range) + 1);
+				checked_resizing++;
+			}
+			if (i % 20011 == 0) {
+				tree.finish_resize();
+				assert(!tree.resizing());
+				assert(std::equal(tree.begin(), tree.end(), set.begin()));
+			}
+		}
+		assert(resized && checked_resizing > 0);
+		tree.finish_resize();
+		tree.check_invariants();
+		assert(std::equal(tree.begin(), tree.end(), set.begin()));
+
+		// Switching back to all-at-once resizing drops any copy under way,
+		// and so does draining the tree.
+		tree.set_incremental_resize(0);
+		assert(!tree.resizing());
+		tree.set_incremental_resize(step);
+		for (int value : std::vector<int>(set.begin(), set.end())) {
+			assert(tree.remove(value));
+		}
+		assert(tree.size() == 0 && !tree.contains(1));
+		tree.check_invariants();
+	}
+}
+
 template<class T>
 void test_insertion() {
 	std::set<int> set;
@@ -91,16 +1092,116 @@ void test_correctness() {
 	test_construction<cotree>();
 	std::cout << " done" << std::endl;
 
+	std::cout << "Testing cotree small sets..." << std::flush;
+	test_cotree_small();
+	std::cout << " done" << std::endl;
+
 	std::cout << "Testing cotree insertion..." << std::flush;
 	test_insertion<cotree>();
 	std::cout << " done" << std::endl;
 	
+	std::cout << "Testing cotree removal..." << std::flush;
+	test_cotree_removal();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing cotree sorted batch insertion..." << std::flush;
+	test_cotree_insert_sorted();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing cotree ordered queries..." << std::flush;
+	test_cotree_ordered();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing cotree incremental resize..." << std::flush;
+	test_cotree_incremental_resize();
+	std::cout << " done" << std::endl;
+
 	std::cout << "Testing VebTree sanity..." << std::flush;
-	test_sanity<VebTree>();
+	test_sanity<VebTree<int> >();
 	std::cout << " done" << std::endl;
 	
 	std::cout << "Testing VebTree construction..." << std::flush;
-	test_construction<VebTree>();
+	test_construction<VebTree<int> >();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree small sizes..." << std::flush;
+	test_veb_small();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree recursive lookup..." << std::flush;
+	test_veb_recursive();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree ordered queries..." << std::flush;
+	test_veb_ordered();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree batched lookup..." << std::flush;
+	test_veb_batch();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree blocked layout..." << std::flush;
+	test_veb_blocked();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree compressed layout..." << std::flush;
+	test_veb_compressed();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree parallel construction..." << std::flush;
+	test_veb_parallel_build();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree key types..." << std::flush;
+	test_veb_key_types();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree ranks..." << std::flush;
+	test_veb_rank();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree sorted batches..." << std::flush;
+	test_veb_sorted_batch();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree jump tables..." << std::flush;
+	test_veb_jump_table();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree order statistics..." << std::flush;
+	test_veb_order_statistics();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree iterators..." << std::flush;
+	test_veb_iterator();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing storage backings..." << std::flush;
+	test_storage();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebMap..." << std::flush;
+	test_veb_map();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree images..." << std::flush;
+	test_veb_mapped();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing VebTree image builder..." << std::flush;
+	test_veb_build_image();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing WeightedVebTree..." << std::flush;
+	test_weighted_veb();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing AdaptiveVebTree..." << std::flush;
+	test_adaptive_veb();
+	std::cout << " done" << std::endl;
+
+	std::cout << "Testing StaticVebTree..." << std::flush;
+	test_static_veb();
 	std::cout << " done" << std::endl;
 
 }
@@ -0,0 +1,58 @@
+#include "BtreeSetTree.h"
+#include <algorithm>
+#include <iterator>
+using namespace std;
+
+BtreeSetTree::BtreeSetTree(const std::vector<double>& weights) {
+  for (size_t i = 0; i < weights.size(); i++) {
+    elems.insert(int(i));
+  }
+}
+
+BtreeSetTree::~BtreeSetTree() {
+  // btree_set frees its own nodes.
+}
+
+bool BtreeSetTree::contains(int key) const {
+  return elems.find(key) != elems.end();
+}
+
+bool BtreeSetTree::insert(int key) {
+  return elems.insert(key).second;
+}
+
+size_t BtreeSetTree::insertSorted(const std::vector<int>& keys) {
+  size_t before = elems.size();
+  elems.insert(keys.begin(), keys.end());
+  return elems.size() - before;
+}
+
+bool BtreeSetTree::remove(int key) {
+  return elems.erase(key) == 1;
+}
+
+int BtreeSetTree::rank(int key) const {
+  return std::distance(elems.begin(), elems.lower_bound(key));
+}
+
+int BtreeSetTree::select(int rank) const {
+  if (rank < 0 || rank >= elems.size()) {
+    return -1;
+  }
+  auto itr = elems.begin();
+  std::advance(itr, rank);
+  return *itr;
+}
+
+int BtreeSetTree::countRange(int a, int b) const {
+  return std::distance(elems.lower_bound(std::min(a, b)),
+                       elems.upper_bound(std::max(a, b)));
+}
+
+int64_t BtreeSetTree::sumRange(int lo, int hi) const {
+  int64_t sum = 0;
+  for (auto itr = elems.lower_bound(lo); itr != elems.end() && *itr <= hi; ++itr) {
+    sum += *itr;
+  }
+  return sum;
+}
@@ -0,0 +1,63 @@
+#ifndef BtreeSetTree_Included
+#define BtreeSetTree_Included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "btree_set.h"
+
+/**
+ * A BST type backed by Google's cpp-btree btree_set, with 64-byte nodes, as a
+ * cache-aware comparison point for the cache-oblivious trees.
+ */
+class BtreeSetTree {
+public:
+  /**
+   * Constructs a btree_set holding the elements 0, 1, 2, ...,
+   * weights.size() - 1. Like std::set, it ignores the weights.
+   */
+  BtreeSetTree(const std::vector<double>& weights);
+
+  ~BtreeSetTree();
+
+  /**
+   * Returns whether the given key is present in the tree.
+   */
+  bool contains(int key) const;
+
+  /**
+   * Inserts the given key, returning whether it was absent.
+   */
+  bool insert(int key);
+
+  /**
+   * Inserts a sorted batch of keys, returning how many were absent.
+   */
+  size_t insertSorted(const std::vector<int>& keys);
+
+  /**
+   * Removes the given key, returning whether it was present.
+   */
+  bool remove(int key);
+
+  /**
+   * Order statistics, as in StdSetTree. btree_set keeps no rank information
+   * either, so these walk the set and take linear time.
+   */
+  int rank(int key) const;
+  int select(int rank) const;
+  int countRange(int a, int b) const;
+
+  /**
+   * Returns the sum of the keys in [lo, hi], walking the set in order.
+   */
+  int64_t sumRange(int lo, int hi) const;
+
+private:
+  btree::btree_set<int, std::less<int>, std::allocator<int>, 64> elems;
+
+  BtreeSetTree(BtreeSetTree const &) = delete;
+  void operator=(BtreeSetTree const &) = delete;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include "CotreeTree.h"
+using namespace std;
+
+static std::vector<int> keysFor(const std::vector<double>& weights) {
+  std::vector<int> keys(weights.size());
+  for (size_t i = 0; i < weights.size(); i++) {
+    keys[i] = int(i);
+  }
+  return keys;
+}
+
+CotreeTree::CotreeTree(const std::vector<double>& weights) : tree(keysFor(weights)) {
+}
+
+CotreeTree::~CotreeTree() {
+  // The cotree frees its own arrays.
+}
+
+bool CotreeTree::contains(int key) const {
+  return tree.contains(key);
+}
+
+bool CotreeTree::insert(int key) {
+  return tree.insert(key);
+}
+
+size_t CotreeTree::insertSorted(const std::vector<int>& keys) {
+  return tree.insert_sorted(keys.begin(), keys.end());
+}
+
+bool CotreeTree::remove(int key) {
+  return tree.remove(key);
+}
+
+int64_t CotreeTree::sumRange(int lo, int hi) const {
+  int64_t sum = 0;
+  auto end = tree.end();
+  for (auto itr = tree.lower_bound(lo); itr != end && *itr <= hi; ++itr) {
+    sum += *itr;
+  }
+  return sum;
+}
+
+void CotreeTree::setIncrementalResize(size_t step) {
+  tree.set_incremental_resize(step);
+}
+
+IncrementalCotreeTree::IncrementalCotreeTree(const std::vector<double>& weights) : CotreeTree(weights) {
+  setIncrementalResize(16);
+}
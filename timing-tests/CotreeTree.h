@@ -0,0 +1,93 @@
+#ifndef CotreeTree_Included
+#define CotreeTree_Included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "../cotree.h"
+
+/**
+ * cotree parameters for int keys, using -1 to mark empty slots.
+ */
+struct IntCotreeParams : public cotree::cotree_params_tag {
+  typedef int value_type;
+  static int compare(int a, int b) {
+    return (a > b) - (a < b);
+  }
+  static bool is_present(int a) {
+    return a != absent_value();
+  }
+  static int absent_value() {
+    return -1;
+  }
+};
+
+typedef cotree::cotree<IntCotreeParams> IntCotree;
+
+/**
+ * A BST type backed by the cache-oblivious B-tree in cotree.h.
+ */
+class CotreeTree {
+public:
+  /**
+   * Constructs a cotree holding the elements 0, 1, 2, ...,
+   * weights.size() - 1. Like std::set, it ignores the weights.
+   */
+  CotreeTree(const std::vector<double>& weights);
+
+  ~CotreeTree();
+
+  /**
+   * Returns whether the given key is present in the tree.
+   */
+  bool contains(int key) const;
+
+  /**
+   * Inserts the given key, returning whether it was absent.
+   */
+  bool insert(int key);
+
+  /**
+   * Inserts a sorted batch of keys, returning how many were absent.
+   */
+  size_t insertSorted(const std::vector<int>& keys);
+
+  /**
+   * Removes the given key, returning whether it was present.
+   */
+  bool remove(int key);
+
+  /**
+   * Returns the sum of the keys in [lo, hi], walking the tree's iterators
+   * from lower_bound(lo).
+   */
+  int64_t sumRange(int lo, int hi) const;
+
+protected:
+  /**
+   * Has the tree grow incrementally, copying about step values per
+   * operation, rather than all at once. See cotree::set_incremental_resize.
+   */
+  void setIncrementalResize(size_t step);
+
+private:
+  IntCotree tree; // The actual data structure
+
+  CotreeTree(CotreeTree const &) = delete;
+  void operator=(CotreeTree const &) = delete;
+};
+
+/**
+ * A CotreeTree that resizes incrementally, so that no one insert pays for
+ * rebuilding the whole array.
+ */
+class IncrementalCotreeTree : public CotreeTree {
+public:
+  /**
+   * Constructs a cotree holding the elements 0, 1, 2, ...,
+   * weights.size() - 1, moving 16 slots per operation while it resizes.
+   */
+  IncrementalCotreeTree(const std::vector<double>& weights);
+};
+
+#endif
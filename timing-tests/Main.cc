@@ -1,9 +1,14 @@
+#include <cstring>
 #include <iostream>
+#include <string>
 #include <stddef.h>
 #include "../timing-tests/vEB-tree-wrapper.h"
+#include "../static-vEB-tree.h"
 #include "Timing.h"
 #include "StdSetTree.h"
 #include "HashTable.h"
+#include "BtreeSetTree.h"
+#include "CotreeTree.h"
 
 /* Constant controlling how many elements we'll put into each BST when
  * doing time trials.
@@ -18,9 +23,103 @@ const size_t kNumLookups = 1 << 18;
 /* For the "working set" test case, the number of working sets. */
 const size_t kNumWorkingSets = kTreeSize >> 6;
 
-int main() {
+/* For the batched lookup test case, the number of keys looked up per call. */
+const size_t kBatchSize = 256;
+
+/* Reports the average latency of uniformly random lookups on trees whose
+ * arrays are allocated with each of the given storage backings, at sizes
+ * where the TLB starts to matter. Backings that can't allocate the tree
+ * (e.g. hugetlb with no pages reserved) are reported as unavailable. The
+ * cotree is skipped at the largest size, where building it takes longer than
+ * everything else put together.
+ */
+void reportStorageLatency(const std::vector<StorageBacking>& backings, bool prefault) {
+  for (int logSize : {20, 23, 26}) {
+    size_t count = size_t(1) << logSize;
+    std::cout << "Lookup Latency on 2^" << logSize << " Elements" << (prefault ? " (prefaulted)" : "") << ":" << std::endl;
+    for (StorageBacking backing : backings) {
+      StoragePolicy storage(backing, prefault);
+      double latencies[] = {
+        timeLookupLatency<VebTree<int> >(count, kNumLookups, kPureVebLayout, 0u, storage),
+        timeLookupLatency<VebTree<int> >(count, kNumLookups, kBlockedVebLayout, 0u, storage),
+        logSize > 23 ? -2 : timeLookupLatency<IntCotree>(count, kNumLookups, storage),
+      };
+      const char * names[] = {"VebTree", "VebTree (blocked)", "cotree"};
+      for (int i = 0; i < 3; i++) {
+        std::string label = std::string(names[i]) + ", " + storageName(backing) + ":";
+        std::cout << "  " << label << std::string(30 - std::min<size_t>(label.size(), 29), ' ');
+        if (latencies[i] == -1) {
+          std::cout << "unavailable" << std::endl;
+        } else if (latencies[i] >= 0) {
+          std::cout << latencies[i] << " ns" << std::endl;
+        } else {
+          std::cout << "skipped" << std::endl;
+        }
+      }
+    }
+    std::cout << std::endl;
+  }
+}
+
+/* Compares the unrolled search of StaticVebTree<int, Order> with VebTree's
+ * on a full tree of the height StaticVebTree fixes, 2^(2^Order) - 1 keys.
+ */
+template <int Order>
+void reportStaticLatency() {
+  size_t count = StaticVebTree<int, Order>::kCapacity;
+  size_t numLookups = kNumLookups * 16;
+  std::cout << "Unrolled Search, Order " << Order << " (" << count << " Elements):" << std::endl;
+  std::cout << "  VebTree:                  " << timeLookupLatency<VebTree<int> >(count, numLookups) << " ns" << std::endl;
+  std::cout << "  StaticVebTree:            " << timeLookupLatency<StaticVebTree<int, Order> >(count, numLookups) << " ns" << std::endl;
+  std::cout << std::endl;
+}
+
+/* Usage: run-timing-tests [--storage=<backing>[,<backing>...]] [--prefault]
+ *
+ * With no flags, runs the full suite. --storage instead reports lookup
+ * latency with each listed backing (aligned, thp, hugetlb or all), and
+ * --prefault faults the arrays in before the lookups start.
+ */
+int main(int argc, char * argv[]) {
+  std::vector<StorageBacking> backings;
+  bool prefault = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--prefault") == 0) {
+      prefault = true;
+    } else if (std::strncmp(argv[i], "--storage=", 10) == 0) {
+      std::string list = std::string(argv[i] + 10) + ",";
+      for (size_t start = 0, comma; (comma = list.find(',', start)) != std::string::npos; start = comma + 1) {
+        std::string name = list.substr(start, comma - start);
+        bool known = false;
+        for (StorageBacking backing : {kAlignedStorage, kTransparentHugePageStorage, kHugetlbStorage}) {
+          if (name == storageName(backing) || name == "all") {
+            backings.push_back(backing);
+            known = true;
+          }
+        }
+        if (!known) {
+          std::cerr << "unknown storage backing " << name << std::endl;
+          return 1;
+        }
+      }
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--storage=aligned,thp,hugetlb|all] [--prefault]" << std::endl;
+      return 1;
+    }
+  }
+  if (prefault && backings.empty()) {
+    backings = {kAlignedStorage, kTransparentHugePageStorage, kHugetlbStorage};
+  }
+  if (!backings.empty()) {
+    reportStorageLatency(backings, prefault);
+    return 0;
+  }
+
   std::cout << "Correctness Tests" << std::endl;
   std::cout << "  VebTreeWrapper:           " << (checkCorrectness<VebTreeWrapper>(kTreeSize, kNumLookups) ? "pass" : "fail") << std::endl;
+  std::cout << "  VebTree (recursive):      " << (checkCorrectness<VebTreeRecursiveWrapper>(kTreeSize, kNumLookups) ? "pass" : "fail") << std::endl;
+  std::cout << "  VebTree (blocked):        " << (checkCorrectness<VebTreeBlockedWrapper>(kTreeSize, kNumLookups) ? "pass" : "fail") << std::endl;
+  std::cout << "  cotree:                   " << (checkCorrectness<CotreeTree>(kTreeSize, kNumLookups) ? "pass" : "fail") << std::endl;
   std::cout << "  std::set:           " << (checkCorrectness<StdSetTree>(kTreeSize, kNumLookups) ? "pass" : "fail") << std::endl;
   std::cout << "  std::unordered_set: " << (checkCorrectness<HashTable>(kTreeSize, kNumLookups) ? "pass" : "fail") << std::endl;
   std::cout << std::endl;
@@ -43,20 +142,250 @@ int main() {
   std::cout << "  std::unordered_set: " << timeWorkingSets<HashTable>(kNumWorkingSets, kNumWorkingSets, kNumLookups) << " ms" << std::endl;
   std::cout << std::endl;
 
+  // Four phases of 2^23 lookups, each with its own hot set of 2^10 keys.
+  std::cout << "Access Elements in Shifting Working Sets:" << std::endl;
+  std::cout << "  VebTreeWrapper:           " << timeShiftingWorkingSets<VebTreeWrapper>(kTreeSize, 1 << 10, 4, kNumLookups << 5) << " ms" << std::endl;
+  std::cout << "  VebTree (adaptive):       " << timeShiftingWorkingSets<VebTreeAdaptiveWrapper>(kTreeSize, 1 << 10, 4, kNumLookups << 5) << " ms" << std::endl;
+  std::cout << "  btree_set:          " << timeShiftingWorkingSets<BtreeSetTree>(kTreeSize, 1 << 10, 4, kNumLookups << 5) << " ms" << std::endl;
+  std::cout << std::endl;
+
   auto uniform = std::uniform_int_distribution<int>(0, kTreeSize-1);
   std::cout << "Access Elements Uniformly at Random:" << std::endl;
   std::cout << "  VebTreeWrapper:           " << timeDistribution<VebTreeWrapper>(uniform, kNumLookups) << " ms" << std::endl;
+  std::cout << "  VebTree (recursive):      " << timeDistribution<VebTreeRecursiveWrapper>(uniform, kNumLookups) << " ms" << std::endl;
+  std::cout << "  VebTree (blocked):        " << timeDistribution<VebTreeBlockedWrapper>(uniform, kNumLookups) << " ms" << std::endl;
+  std::cout << "  VebMap find:              " << timeDistribution<VebMapWrapper>(uniform, kNumLookups) << " ms" << std::endl;
   std::cout << "  std::set:           " << timeDistribution<StdSetTree>(uniform, kNumLookups) << " ms" << std::endl;
   std::cout << "  std::unordered_set: " << timeDistribution<HashTable>(uniform, kNumLookups) << " ms" << std::endl;
   std::cout << std::endl;
 
+  std::cout << "Ordered Queries Uniformly at Random:" << std::endl;
+  std::cout << "  VebTreeWrapper predecessor:  " << timeOrderedQueries<VebTreeWrapper>(uniform, kNumLookups, &VebTreeWrapper::predecessor) << " ms" << std::endl;
+  std::cout << "  std::set predecessor:        " << timeOrderedQueries<StdSetTree>(uniform, kNumLookups, &StdSetTree::predecessor) << " ms" << std::endl;
+  std::cout << "  VebTreeWrapper successor:    " << timeOrderedQueries<VebTreeWrapper>(uniform, kNumLookups, &VebTreeWrapper::successor) << " ms" << std::endl;
+  std::cout << "  std::set successor:          " << timeOrderedQueries<StdSetTree>(uniform, kNumLookups, &StdSetTree::successor) << " ms" << std::endl;
+  std::cout << "  VebTreeWrapper lower_bound:  " << timeOrderedQueries<VebTreeWrapper>(uniform, kNumLookups, &VebTreeWrapper::lowerBound) << " ms" << std::endl;
+  std::cout << "  std::set lower_bound:        " << timeOrderedQueries<StdSetTree>(uniform, kNumLookups, &StdSetTree::lowerBound) << " ms" << std::endl;
+  std::cout << "  VebTreeWrapper upper_bound:  " << timeOrderedQueries<VebTreeWrapper>(uniform, kNumLookups, &VebTreeWrapper::upperBound) << " ms" << std::endl;
+  std::cout << "  std::set upper_bound:        " << timeOrderedQueries<StdSetTree>(uniform, kNumLookups, &StdSetTree::upperBound) << " ms" << std::endl;
+  std::cout << std::endl;
+
+  // std::set and btree_set answer these by walking the set, so they get far
+  // fewer queries; the times are per query.
+  const size_t kNumScans = kNumLookups >> 10;
+  std::cout << "Order Statistics Uniformly at Random:" << std::endl;
+  std::cout << "  VebTreeWrapper rank:         " << timeOrderStatistic<VebTreeWrapper>(kTreeSize, kNumLookups, &VebTreeWrapper::rank) << " ns" << std::endl;
+  std::cout << "  std::set rank:               " << timeOrderStatistic<StdSetTree>(kTreeSize, kNumScans, &StdSetTree::rank) << " ns" << std::endl;
+  std::cout << "  btree_set rank:              " << timeOrderStatistic<BtreeSetTree>(kTreeSize, kNumScans, &BtreeSetTree::rank) << " ns" << std::endl;
+  std::cout << "  VebTreeWrapper select:       " << timeOrderStatistic<VebTreeWrapper>(kTreeSize, kNumLookups, &VebTreeWrapper::select) << " ns" << std::endl;
+  std::cout << "  std::set select:             " << timeOrderStatistic<StdSetTree>(kTreeSize, kNumScans, &StdSetTree::select) << " ns" << std::endl;
+  std::cout << "  btree_set select:            " << timeOrderStatistic<BtreeSetTree>(kTreeSize, kNumScans, &BtreeSetTree::select) << " ns" << std::endl;
+  std::cout << "  VebTreeWrapper count_range:  " << timeOrderStatistic<VebTreeWrapper>(kTreeSize, kNumLookups, &VebTreeWrapper::countRange) << " ns" << std::endl;
+  std::cout << "  std::set count_range:        " << timeOrderStatistic<StdSetTree>(kTreeSize, kNumScans, &StdSetTree::countRange) << " ns" << std::endl;
+  std::cout << "  btree_set count_range:       " << timeOrderStatistic<BtreeSetTree>(kTreeSize, kNumScans, &BtreeSetTree::countRange) << " ns" << std::endl;
+  std::cout << std::endl;
+
+  for (size_t scanLength : {16, 256, 65536}) {
+    size_t numScans = (kNumLookups << 4) / scanLength;
+    std::cout << "Range Scans of " << scanLength << " Keys:" << std::endl;
+    std::cout << "  VebTreeWrapper for_each:     " << timeRangeScans<VebTreeWrapper>(kTreeSize, numScans, scanLength, &VebTreeWrapper::sumRange) << " M keys/s" << std::endl;
+    std::cout << "  VebTreeWrapper iterator:     " << timeRangeScans<VebTreeWrapper>(kTreeSize, numScans, scanLength, &VebTreeWrapper::sumRangeIterator) << " M keys/s" << std::endl;
+    std::cout << "  VebTree (blocked) for_each:  " << timeRangeScans<VebTreeBlockedWrapper>(kTreeSize, numScans, scanLength, &VebTreeBlockedWrapper::sumRange) << " M keys/s" << std::endl;
+    std::cout << "  cotree:                      " << timeRangeScans<CotreeTree>(kTreeSize, numScans, scanLength, &CotreeTree::sumRange) << " M keys/s" << std::endl;
+    std::cout << "  std::set:                    " << timeRangeScans<StdSetTree>(kTreeSize, numScans, scanLength, &StdSetTree::sumRange) << " M keys/s" << std::endl;
+    std::cout << "  btree_set:                   " << timeRangeScans<BtreeSetTree>(kTreeSize, numScans, scanLength, &BtreeSetTree::sumRange) << " M keys/s" << std::endl;
+    std::cout << std::endl;
+  }
+
   // Some Zipfian distributed tests
   for (double z: {0.5, 0.75, 1.0, 1.2, 1.3}) {
     auto distribution_z = zipfian(kTreeSize, z);
     std::cout << "Access Elements According to a Zipf(" << z << ") Distribution:" << std::endl;
     std::cout << "  VebTreeWrapper:           " << timeDistribution<VebTreeWrapper>(distribution_z, kNumLookups) << " ms" << std::endl;
+    std::cout << "  VebTree (recursive):      " << timeDistribution<VebTreeRecursiveWrapper>(distribution_z, kNumLookups) << " ms" << std::endl;
+    std::cout << "  VebTree (blocked):        " << timeDistribution<VebTreeBlockedWrapper>(distribution_z, kNumLookups) << " ms" << std::endl;
+    std::cout << "  VebTree (weighted):       " << timeDistribution<VebTreeWeightedWrapper>(distribution_z, kNumLookups) << " ms" << std::endl;
     std::cout << "  std::set:           " << timeDistribution<StdSetTree>(distribution_z, kNumLookups) << " ms" << std::endl;
     std::cout << "  std::unordered_set: " << timeDistribution<HashTable>(distribution_z, kNumLookups) << " ms" << std::endl;
     std::cout << std::endl;
   }
+
+  for (int logSize : {20, 22, 24, 26}) {
+    auto throughput = timeBatchedLookups<VebTreeWrapper>(size_t(1) << logSize, kNumLookups << 2, kBatchSize);
+    auto blocked = timeBatchedLookups<VebTreeBlockedWrapper>(size_t(1) << logSize, kNumLookups << 2, kBatchSize);
+    auto map = timeBatchedLookups<VebMapWrapper>(size_t(1) << logSize, kNumLookups << 2, kBatchSize);
+    std::cout << "Batched Lookups on 2^" << logSize << " Elements:" << std::endl;
+    std::cout << "  VebTreeWrapper single:    " << throughput.first << " M lookups/s" << std::endl;
+    std::cout << "  VebTreeWrapper batched:   " << throughput.second << " M lookups/s" << std::endl;
+    std::cout << "  VebTree (blocked) single: " << blocked.first << " M lookups/s" << std::endl;
+    std::cout << "  VebTree (blocked) batched: " << blocked.second << " M lookups/s" << std::endl;
+    std::cout << "  VebMap single find:       " << map.first << " M lookups/s" << std::endl;
+    std::cout << "  VebMap batched find:      " << map.second << " M lookups/s" << std::endl;
+    std::cout << std::endl;
+  }
+
+  // Sorted batches of increasing density on 2^22 keys, from one query per
+  // 4096 keys up to as many queries as keys.
+  for (int logDensity : {-12, -8, -4, -2, 0}) {
+    size_t count = size_t(1) << 22;
+    size_t batchSize = count >> -logDensity;
+    std::cout << "Sorted Batches of 2^" << 22 + logDensity << " Lookups on 2^22 Elements:" << std::endl;
+    for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+      auto result = timeSortedBatch<VebTree<int> >(count, batchSize, layout);
+      std::string name = layout == kPureVebLayout ? "VebTree" : "VebTree (blocked)";
+      double throughputs[] = {result.single, result.batched, result.sorted};
+      const char * methods[] = {" single:", " batched:", " sorted batch:"};
+      for (int i = 0; i < 3; i++) {
+        std::string label = name + methods[i];
+        std::cout << "  " << label << std::string(32 - std::min<size_t>(label.size(), 31), ' ') << throughputs[i] << " M lookups/s" << std::endl;
+      }
+      if (layout == kPureVebLayout) {
+        std::cout << "  Merge with sorted keys:         " << result.merge << " M lookups/s" << std::endl;
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  for (int logSize : {20, 22, 24, 26}) {
+    size_t count = size_t(1) << logSize;
+    std::cout << "Construction of 2^" << logSize << " Elements:" << std::endl;
+    std::cout << "  VebTree, 1 thread:        " << timeConstruction<VebTree<int> >(count, kPureVebLayout, 1u) << " ns/key" << std::endl;
+    std::cout << "  VebTree, all threads:     " << timeConstruction<VebTree<int> >(count, kPureVebLayout, 0u) << " ns/key" << std::endl;
+    std::cout << "  VebTree (blocked), 1 thread:    " << timeConstruction<VebTree<int> >(count, kBlockedVebLayout, 1u) << " ns/key" << std::endl;
+    std::cout << "  VebTree (blocked), all threads: " << timeConstruction<VebTree<int> >(count, kBlockedVebLayout, 0u) << " ns/key" << std::endl;
+    std::cout << std::endl;
+  }
+
+  // Compressed leaf blocks, on keys whose gaps are uniformly random between 1
+  // and maxGap.
+  for (int logSize : {20, 22}) {
+    for (int maxGap : {1, 32, 512}) {
+      std::default_random_engine engine;
+      engine.seed(kRandomSeed);
+      auto gap = std::uniform_int_distribution<int>(1, maxGap);
+      std::vector<int> keys(size_t(1) << logSize);
+      for (size_t i = 1; i < keys.size(); i++) {
+        keys[i] = keys[i - 1] + gap(engine);
+      }
+      std::cout << "Compressed Blocks on 2^" << logSize << " Elements, Gaps of 1 to " << maxGap << ":" << std::endl;
+      VebLayout layouts[] = {kPureVebLayout, kBlockedVebLayout, kCompressedVebLayout};
+      const char * names[] = {"VebTree:             ", "VebTree (blocked):   ", "VebTree (compressed):"};
+      for (int i = 0; i < 3; i++) {
+        auto result = timeLatencyAndBytes<VebTree<int> >(keys, kNumLookups, layouts[i]);
+        std::cout << "  " << names[i] << " " << result.first << " ns, " << result.second << " bytes/key" << std::endl;
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  // Jump tables of different sizes, on 2^22 keys spread uniformly over
+  // [0, 2^30) and on as many drawn from a lognormal distribution, which
+  // crowds most of them into a small part of the range.
+  for (bool skewed : {false, true}) {
+    std::default_random_engine engine;
+    engine.seed(kRandomSeed);
+    auto uniform = std::uniform_int_distribution<int>(0, (1 << 30) - 1);
+    auto lognormal = std::lognormal_distribution<double>(0.0, 2.0);
+    std::vector<int> keys;
+    while (keys.size() < (size_t(1) << 22)) {
+      while (keys.size() < (size_t(1) << 23)) {
+        keys.push_back(skewed ? int(std::min(lognormal(engine) * (1 << 16), 1e9)) : uniform(engine));
+      }
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+    keys.resize(size_t(1) << 22);
+    std::cout << "Jump Tables on 2^22 " << (skewed ? "Skewed" : "Uniform") << " Keys:" << std::endl;
+    for (VebLayout layout : {kPureVebLayout, kBlockedVebLayout}) {
+      for (int bits : {0, 8, 12, 16, 20}) {
+        auto result = timeLatencyAndBytes<VebTreeJumpWrapper>(keys, kNumLookups, layout, bits);
+        std::string label = std::string(layout == kPureVebLayout ? "VebTree" : "VebTree (blocked)") + ", " + std::to_string(bits) + " bits:";
+        std::cout << "  " << label << std::string(30 - std::min<size_t>(label.size(), 29), ' ') << result.first << " ns, " << result.second << " bytes/key" << std::endl;
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  // Building images from sorted key files, streamed or loaded all at once.
+  // The build's peak RSS includes the pages it inherits from this process
+  // and touches, but not the rest of this process's memory.
+  for (int logSize : {22, 26}) {
+    size_t count = size_t(1) << logSize;
+    auto streamed = timeImageBuild<VebTree<int> >("veb-tree-timing.keys", "veb-tree-timing.img", count, true);
+    auto loaded = timeImageBuild<VebTree<int> >("veb-tree-timing.keys", "veb-tree-timing.img", count, false);
+    std::cout << "Image Builds from 2^" << logSize << " Sorted Keys (" << count * sizeof(int) / 1e6 << " MB):" << std::endl;
+    std::cout << "  VebTree::build_image:     " << streamed.first << " MB/s, peak RSS " << streamed.second << " MB" << std::endl;
+    std::cout << "  VebTree + save:           " << loaded.first << " MB/s, peak RSS " << loaded.second << " MB" << std::endl;
+    std::cout << std::endl;
+  }
+
+  reportStaticLatency<2>();
+  reportStaticLatency<3>();
+  reportStaticLatency<4>();
+
+  // Many small sets side by side, as in per-user sets of a few keys. Up to
+  // 16 keys fit inline in a VebTree<int> or a cotree of ints.
+  for (size_t setSize : {1, 4, 16, 32, 64}) {
+    const size_t kNumSets = 1 << 17;
+    std::cout << "2^17 Sets of " << setSize << " Elements:" << std::endl;
+    auto veb = timeSmallSets<VebTreeWrapper>(kNumSets, setSize, kNumLookups);
+    std::cout << "  VebTreeWrapper:           " << veb.bytesPerSet << " bytes/set, " << veb.lookupNs << " ns" << std::endl;
+    auto cotree = timeSmallSets<CotreeTree>(kNumSets, setSize, kNumLookups);
+    std::cout << "  cotree:                   " << cotree.bytesPerSet << " bytes/set, " << cotree.lookupNs << " ns" << std::endl;
+    auto btree = timeSmallSets<BtreeSetTree>(kNumSets, setSize, kNumLookups);
+    std::cout << "  btree_set:                " << btree.bytesPerSet << " bytes/set, " << btree.lookupNs << " ns" << std::endl;
+    std::cout << std::endl;
+  }
+
+  for (int logSize : {16, 20}) {
+    size_t count = size_t(1) << logSize;
+    std::cout << "Inserting 2^" << logSize << " Elements in Random Order:" << std::endl;
+    std::cout << "  cotree:                   " << timeInserts<CotreeTree>(count) << " ns/insert" << std::endl;
+    std::cout << "  btree_set:                " << timeInserts<BtreeSetTree>(count) << " ns/insert" << std::endl;
+    std::cout << std::endl;
+  }
+
+  // The synchronous cotree rebuilds its whole array whenever it outgrows it;
+  // the incremental one spreads that over the inserts that follow.
+  for (int logSize : {20, 22}) {
+    size_t count = size_t(1) << logSize;
+    std::cout << "Insert Latency (p50 / p99 / p99.9 / p99.99 / max ns), 2^" << logSize << " Elements:" << std::endl;
+    auto report = [](const char* name, InsertLatency latency) {
+      std::cout << name << latency.p50 << " / " << latency.p99 << " / " << latency.p999 << " / "
+                << latency.p9999 << " / " << latency.max << std::endl;
+    };
+    report("  cotree:                   ", timeInsertLatency<CotreeTree>(count));
+    report("  cotree (incremental):     ", timeInsertLatency<IncrementalCotreeTree>(count));
+    report("  btree_set:                ", timeInsertLatency<BtreeSetTree>(count));
+    std::cout << std::endl;
+  }
+
+  for (size_t batchSize : {10000, 100000, 1000000}) {
+    const size_t kCount = 1 << 20;
+    std::cout << "Sorted Batches of " << batchSize << " Keys into 2^20 Elements:" << std::endl;
+    std::cout << "  cotree insert:            " << timeBatchInserts<CotreeTree>(kCount, batchSize, false) << " M keys/s" << std::endl;
+    std::cout << "  cotree insert_sorted:     " << timeBatchInserts<CotreeTree>(kCount, batchSize, true) << " M keys/s" << std::endl;
+    std::cout << "  btree_set range insert:   " << timeBatchInserts<BtreeSetTree>(kCount, batchSize, true) << " M keys/s" << std::endl;
+    std::cout << std::endl;
+  }
+
+  for (int logSize : {16, 20}) {
+    size_t count = size_t(1) << logSize;
+    std::cout << "Removing All 2^" << logSize << " Elements in Random Order:" << std::endl;
+    std::cout << "  cotree:                   " << timeDeletes<CotreeTree>(count) << " ns/delete" << std::endl;
+    std::cout << "  btree_set:                " << timeDeletes<BtreeSetTree>(count) << " ns/delete" << std::endl;
+    std::cout << std::endl;
+  }
+
+  for (int logSize : {20, 24}) {
+    size_t count = size_t(1) << logSize;
+    auto pure = timeMappedLookups<VebTree<int> >("veb-tree-timing.img", count, kNumLookups);
+    auto blocked = timeMappedLookups<VebTree<int> >("veb-tree-timing.img", count, kNumLookups, kBlockedVebLayout);
+    std::cout << "Memory-Mapped Open and Lookups on 2^" << logSize << " Elements:" << std::endl;
+    std::cout << "  VebTree cold:             " << pure.first << " ms" << std::endl;
+    std::cout << "  VebTree warm:             " << pure.second << " ms" << std::endl;
+    std::cout << "  VebTree (blocked) cold:   " << blocked.first << " ms" << std::endl;
+    std::cout << "  VebTree (blocked) warm:   " << blocked.second << " ms" << std::endl;
+    std::cout << std::endl;
+  }
 }
@@ -1,4 +1,6 @@
 #include "StdSetTree.h"
+#include <algorithm>
+#include <iterator>
 using namespace std;
 
 /* The constructor here is given the access probabilities of the numbers 0, 1,
@@ -24,3 +26,46 @@ StdSetTree::~StdSetTree() {
 bool StdSetTree::contains(int key) const {
   return elems.find(key) != elems.end();
 }
+
+int StdSetTree::predecessor(int key) const {
+  auto itr = elems.lower_bound(key);
+  return itr == elems.begin() ? -1 : *--itr;
+}
+
+int StdSetTree::successor(int key) const {
+  return upperBound(key);
+}
+
+int StdSetTree::lowerBound(int key) const {
+  auto itr = elems.lower_bound(key);
+  return itr == elems.end() ? -1 : *itr;
+}
+
+int StdSetTree::upperBound(int key) const {
+  auto itr = elems.upper_bound(key);
+  return itr == elems.end() ? -1 : *itr;
+}
+
+int StdSetTree::rank(int key) const {
+  return std::distance(elems.begin(), elems.lower_bound(key));
+}
+
+int StdSetTree::select(int rank) const {
+  if (rank < 0 || size_t(rank) >= elems.size()) {
+    return -1;
+  }
+  return *std::next(elems.begin(), rank);
+}
+
+int StdSetTree::countRange(int a, int b) const {
+  return std::distance(elems.lower_bound(std::min(a, b)),
+                       elems.upper_bound(std::max(a, b)));
+}
+
+int64_t StdSetTree::sumRange(int lo, int hi) const {
+  int64_t sum = 0;
+  for (auto itr = elems.lower_bound(lo); itr != elems.end() && *itr <= hi; ++itr) {
+    sum += *itr;
+  }
+  return sum;
+}
@@ -3,6 +3,7 @@
 
 #include <set>
 #include <stddef.h>
+#include <stdint.h>
 #include <vector>
 
 /**
@@ -38,6 +39,32 @@ public:
    */
   bool contains(int key) const;
 
+  /**
+   * Ordered queries: the largest key less than the given key, the smallest
+   * key greater than it, and the smallest key that is greater than or equal
+   * to (lowerBound) or strictly greater than (upperBound) it. Each returns -1
+   * if there is no such key.
+   */
+  int predecessor(int key) const;
+  int successor(int key) const;
+  int lowerBound(int key) const;
+  int upperBound(int key) const;
+
+  /**
+   * Order statistics: the number of keys less than the given key, the key
+   * with the given rank (-1 if there is none), and the number of keys between
+   * a and b inclusive, taken in either order. std::set has no rank
+   * information, so these walk the set and take linear time.
+   */
+  int rank(int key) const;
+  int select(int rank) const;
+  int countRange(int a, int b) const;
+
+  /**
+   * Returns the sum of the keys in [lo, hi], walking the set in order.
+   */
+  int64_t sumRange(int lo, int hi) const;
+
 private:
   std::set<int> elems; // The actual elements
 
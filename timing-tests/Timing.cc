@@ -1,5 +1,10 @@
 #include "Timing.h"
 #include <algorithm>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 /**
  * Returns a random number generator that generates data according to a Zipfian
@@ -19,3 +24,54 @@ std::discrete_distribution<int> zipfian(size_t count, double z) {
   std::random_shuffle(weights.begin(), weights.end());
   return std::discrete_distribution<int>(weights.begin(), weights.end());
 }
+
+/**
+ * Flushes the given file to disk and asks the kernel to drop it from the page
+ * cache, so the next process to read it has to go to disk. Returns whether
+ * the kernel accepted the request.
+ */
+bool evictFromPageCache(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool evicted = fdatasync(fd) == 0 &&
+                 posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+  close(fd);
+  return evicted;
+}
+
+/**
+ * Forks, runs the function in the child and reads the child's peak RSS out
+ * of its resource usage once it exits. ru_maxrss is in kilobytes on Linux.
+ */
+double peakRssInChild(const std::function<void()>& function) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    return -1;
+  }
+  if (pid == 0) {
+    try {
+      function();
+    } catch (...) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return -1;
+  }
+  return usage.ru_maxrss / 1024.0;
+}
+
+/**
+ * mallinfo2 counts the bytes in chunks handed out from the arenas in uordblks
+ * and those in chunks mapped on their own in hblkhd.
+ */
+size_t heapBytesInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
@@ -5,12 +5,21 @@
 #ifndef Timing_Included
 #define Timing_Included
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <new>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 #include <cmath>
+#include <cstdio>
 #include <stddef.h>
+#include <stdint.h>
 
 /* The random seed used throughout the run. */
 static const size_t kRandomSeed = 137;
@@ -23,6 +32,25 @@ static const size_t kRandomSeed = 137;
  */
 std::discrete_distribution<int> zipfian(size_t count, double z);
 
+/**
+ * Flushes the given file and drops it from the page cache, so that the next
+ * read of it goes to disk. Returns whether that worked.
+ */
+bool evictFromPageCache(const std::string& path);
+
+/**
+ * Runs function in a child process and waits for it, returning the child's
+ * peak resident set size in megabytes, or -1 if it couldn't be run or
+ * failed.
+ */
+double peakRssInChild(const std::function<void()>& function);
+
+/**
+ * Returns the number of bytes of heap memory currently handed out by malloc,
+ * counting each allocation's bookkeeping and padding.
+ */
+size_t heapBytesInUse();
+
 /**
  * Given a probability distribution and a list of the underlying probabilities,
  * runs a time trial to determine how quickly the indicated number of lookups
@@ -75,6 +103,433 @@ double timeDistribution(std::uniform_int_distribution<int>& gen,
 }
 
 
+/**
+ * Given a BST type, a uniform distribution and one of the BST's ordered query
+ * member functions (predecessor, successor, lowerBound or upperBound), times
+ * how quickly the indicated number of those queries can be answered.
+ */
+template <typename BST>
+double timeOrderedQueries(std::uniform_int_distribution<int>& gen,
+                          size_t numLookups,
+                          int (BST::*query)(int) const) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+
+  auto probabilities = std::vector<double>(gen.max() + 1, 1.0 / (1 + gen.max()));
+  BST tree{probabilities};
+
+  std::chrono::high_resolution_clock::duration total = std::chrono::high_resolution_clock::duration::zero();
+
+  for (size_t i = 0; i < numLookups; i++) {
+    auto key = gen(engine);
+    auto start = std::chrono::high_resolution_clock::now();
+    (tree.*query)(key);
+    auto end = std::chrono::high_resolution_clock::now();
+    total += end - start;
+  }
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(total).count() / 1.0e6;
+}
+
+/**
+ * Given a BST type, a number of elements and a function query(tree, a, b),
+ * times numQueries calls of query with a and b drawn uniformly at random from
+ * 0, 1, 2, ..., count - 1, and returns the average time per call in
+ * nanoseconds. The whole loop is timed, since the slowest structures spend
+ * milliseconds per query.
+ */
+template <typename BST, typename Query>
+double timeQueriesPerCall(size_t count, size_t numQueries, Query query) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<int>(0, count - 1);
+
+  std::vector<double> probabilities(count, 1.0 / count);
+  BST tree{probabilities};
+
+  std::vector<std::pair<int, int> > args(numQueries);
+  for (size_t i = 0; i < numQueries; i++) {
+    args[i].first = gen(engine);
+    args[i].second = gen(engine);
+  }
+
+  long long sum = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < numQueries; i++) {
+    sum += query(tree, args[i].first, args[i].second);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile long long sink = sum;
+  (void) sink;
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / double(numQueries);
+}
+
+/**
+ * Given a BST type and one of its order statistic member functions (rank,
+ * select or countRange), times numQueries uniformly random calls of it on a
+ * tree of count elements, in nanoseconds per call.
+ */
+template <typename BST>
+double timeOrderStatistic(size_t count, size_t numQueries,
+                          int (BST::*query)(int) const) {
+  return timeQueriesPerCall<BST>(count, numQueries, [=](const BST& tree, int a, int) {
+    return (tree.*query)(a);
+  });
+}
+
+template <typename BST>
+double timeOrderStatistic(size_t count, size_t numQueries,
+                          int (BST::*query)(int, int) const) {
+  return timeQueriesPerCall<BST>(count, numQueries, [=](const BST& tree, int a, int b) {
+    return (tree.*query)(a, b);
+  });
+}
+
+/**
+ * Given a BST type, a number of elements, a scan length and a range scan
+ * member function such as sumRange(lo, hi), performs numScans scans of
+ * scanLength consecutive keys starting at uniformly random keys, and returns
+ * the throughput in millions of keys per second.
+ */
+template <typename BST>
+double timeRangeScans(size_t count, size_t numScans, size_t scanLength,
+                      int64_t (BST::*scan)(int, int) const) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<int>(0, count - scanLength);
+
+  std::vector<double> probabilities(count, 1.0 / count);
+  BST tree{probabilities};
+
+  std::vector<int> starts(numScans);
+  for (size_t i = 0; i < numScans; i++) {
+    starts[i] = gen(engine);
+  }
+
+  int64_t sum = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < numScans; i++) {
+    sum += (tree.*scan)(starts[i], starts[i] + scanLength - 1);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile int64_t sink = sum;
+  (void) sink;
+
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  return numScans * scanLength * 1.0e3 / ns;
+}
+
+/**
+ * Given a BST type that supports containsBatch, a number of elements and a
+ * batch size, performs numLookups uniformly random lookups twice: once with
+ * a loop of single contains calls and once in batches of batchSize. Returns
+ * the throughput of each, in millions of lookups per second, as a pair of
+ * (single, batched). Whole loops are timed rather than each call, since a
+ * batch is only meaningful as a unit.
+ */
+template <typename BST>
+std::pair<double, double> timeBatchedLookups(size_t count, size_t numLookups,
+                                             size_t batchSize) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<int>(0, count - 1);
+
+  std::vector<double> probabilities(count, 1.0 / count);
+  BST tree{probabilities};
+
+  std::vector<int> keys(numLookups);
+  for (size_t i = 0; i < numLookups; i++) {
+    keys[i] = gen(engine);
+  }
+  std::unique_ptr<bool[]> out(new bool[numLookups]);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < numLookups; i++) {
+    out[i] = tree.contains(keys[i]);
+  }
+  auto middle = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < numLookups; i += batchSize) {
+    tree.containsBatch(&keys[i], std::min(batchSize, numLookups - i), &out[i]);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  double single = std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count();
+  double batched = std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count();
+  return std::make_pair(numLookups * 1.0e3 / single, numLookups * 1.0e3 / batched);
+}
+
+/* Throughputs, in millions of lookups per second, of the ways to look up a
+ * sorted batch of keys. merge is a plain merge of the batch with the sorted
+ * key array, for reference.
+ */
+struct SortedBatchThroughput {
+  double single;
+  double batched;
+  double sorted;
+  double merge;
+};
+
+/**
+ * Given a tree type with contains_batch and contains_sorted_batch (such as
+ * VebTree<int>) built from a sorted std::vector<int> (with any extra
+ * constructor arguments in args), builds one holding the even numbers
+ * 0, 2, ..., 2 * (count - 1) and looks up a sorted batch of batchSize keys
+ * drawn uniformly from [0, 2 * count), so about half of them are present:
+ * one at a time, with contains_batch, with contains_sorted_batch, and by
+ * merging. The denser the batch, the more of its search paths overlap.
+ */
+template <typename Tree, typename... Args>
+SortedBatchThroughput timeSortedBatch(size_t count, size_t batchSize,
+                                      Args... args) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<int>(0, 2 * count - 1);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(2 * i);
+  }
+  Tree tree(keys, args...);
+  std::vector<int> batch(batchSize);
+  for (size_t i = 0; i < batchSize; i++) {
+    batch[i] = gen(engine);
+  }
+  std::sort(batch.begin(), batch.end());
+  std::unique_ptr<bool[]> out(new bool[batchSize]);
+
+  // Small batches are repeated to get a measurable amount of work.
+  size_t rounds = std::max<size_t>(1, (size_t(1) << 22) / batchSize);
+  double times[4];
+  for (int method = 0; method < 4; method++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+      if (method == 0) {
+        for (size_t i = 0; i < batchSize; i++) {
+          out[i] = tree.contains(batch[i]);
+        }
+      } else if (method == 1) {
+        tree.contains_batch(batch.data(), batchSize, out.get());
+      } else if (method == 2) {
+        tree.contains_sorted_batch(batch.data(), batchSize, out.get());
+      } else {
+        size_t j = 0;
+        for (size_t i = 0; i < batchSize; i++) {
+          while (j < count && keys[j] < batch[i]) {
+            j++;
+          }
+          out[i] = j < count && keys[j] == batch[i];
+        }
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    volatile bool sink = out[batchSize / 2];
+    (void) sink;
+    times[method] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  }
+  double lookups = double(rounds) * batchSize * 1.0e3;
+  return SortedBatchThroughput{lookups / times[0], lookups / times[1],
+                               lookups / times[2], lookups / times[3]};
+}
+
+/**
+ * Given a BST type that can be built from a sorted std::vector<int>, reports
+ * the time required to build one holding 0, 1, 2, ..., count - 1, in
+ * nanoseconds per key. Any extra arguments are passed along to the
+ * constructor. The key list itself is built before the clock starts.
+ */
+template <typename BST, typename... Args>
+double timeConstruction(size_t count, Args... args) {
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(i);
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  BST tree(keys, args...);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / double(count);
+}
+
+/**
+ * Given a tree type with save and open_mapped (such as VebTree<int>), an image
+ * path and a number of elements, saves a tree holding 0, 1, 2, ..., count - 1
+ * to path and then times opening it with open_mapped and performing
+ * numLookups uniformly random lookups, twice: first with the image evicted
+ * from the page cache, then again with it cached. Returns (cold, warm) in
+ * milliseconds, or -1 for cold if the image couldn't be evicted.
+ */
+template <typename Tree, typename... Args>
+std::pair<double, double> timeMappedLookups(const std::string& path,
+                                            size_t count, size_t numLookups,
+                                            Args... args) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<int>(0, count - 1);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(i);
+  }
+  Tree(keys, args...).save(path);
+  for (size_t i = 0; i < numLookups; i++) {
+    keys[i % count] = gen(engine);
+  }
+
+  double times[2];
+  for (int warm = 0; warm < 2; warm++) {
+    if (!warm && !evictFromPageCache(path)) {
+      times[warm] = -1;
+      continue;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    Tree tree = Tree::open_mapped(path);
+    size_t found = 0;
+    for (size_t i = 0; i < numLookups; i++) {
+      found += tree.contains(keys[i % count]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    times[warm] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1.0e6;
+  }
+  std::remove(path.c_str());
+  return std::make_pair(times[0], times[1]);
+}
+
+/**
+ * Given a tree type with build_image and save (such as VebTree<int>), writes
+ * count sorted keys to keysPath as raw ints and builds an image of them at
+ * imagePath, either streaming them with build_image or by reading them all
+ * in and saving a tree built from them. Returns the build's throughput in
+ * megabytes of keys per second and its peak RSS in megabytes, or -1 for both
+ * if the keys couldn't be written or the build failed. The build runs in a
+ * child process, so that the peak RSS is the build's alone.
+ */
+template <typename Tree>
+std::pair<double, double> timeImageBuild(const std::string& keysPath,
+                                         const std::string& imagePath,
+                                         size_t count, bool streamed) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gap = std::uniform_int_distribution<int>(1, 16);
+  FILE * file = fopen(keysPath.c_str(), "wb");
+  if (file == nullptr) {
+    return std::make_pair(-1.0, -1.0);
+  }
+  std::vector<int> chunk(1 << 16);
+  int key = 0;
+  bool written = true;
+  for (size_t done = 0; written && done < count; done += chunk.size()) {
+    size_t n = std::min(chunk.size(), count - done);
+    for (size_t i = 0; i < n; i++) {
+      key += gap(engine);
+      chunk[i] = key;
+    }
+    written = fwrite(chunk.data(), sizeof(int), n, file) == n;
+  }
+  if (fclose(file) != 0 || !written) {
+    std::remove(keysPath.c_str());
+    return std::make_pair(-1.0, -1.0);
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  double peakRss = peakRssInChild([&]() {
+    if (streamed) {
+      Tree::build_image(keysPath, imagePath);
+      return;
+    }
+    std::vector<int> keys(count);
+    FILE * file = fopen(keysPath.c_str(), "rb");
+    if (file == nullptr) {
+      throw std::runtime_error(keysPath + ": couldn't open the keys");
+    }
+    size_t read = fread(keys.data(), sizeof(int), count, file);
+    fclose(file);
+    keys.resize(read);
+    Tree(keys).save(imagePath);
+  });
+  auto end = std::chrono::high_resolution_clock::now();
+  std::remove(keysPath.c_str());
+  std::remove(imagePath.c_str());
+  if (peakRss < 0) {
+    return std::make_pair(-1.0, -1.0);
+  }
+
+  double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1.0e9;
+  return std::make_pair(count * sizeof(int) / 1.0e6 / seconds, peakRss);
+}
+
+/**
+ * Given a tree type that can be built from a sorted std::vector<int> (with
+ * any extra constructor arguments in args), builds one holding 0, 1, 2, ...,
+ * count - 1 and returns the average latency of numLookups uniformly random
+ * lookups in nanoseconds, or -1 if the tree couldn't be allocated.
+ */
+template <typename Tree, typename... Args>
+double timeLookupLatency(size_t count, size_t numLookups, Args... args) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<int>(0, count - 1);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(i);
+  }
+  std::unique_ptr<Tree> tree;
+  try {
+    tree.reset(new Tree(keys, args...));
+  } catch (const std::bad_alloc&) {
+    return -1;
+  }
+  for (size_t i = 0; i < numLookups; i++) {
+    keys[i % count] = gen(engine);
+  }
+
+  size_t found = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < numLookups; i++) {
+    found += tree->contains(keys[i % count]);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = found;
+  (void) sink;
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / double(numLookups);
+}
+
+/**
+ * Given a tree type with memory_bytes (such as VebTree<int>) and a sorted
+ * list of keys, builds a tree holding them (with any extra constructor
+ * arguments in args) and returns the average latency of numLookups lookups of
+ * uniformly random keys from the list, in nanoseconds, along with the tree's
+ * size in bytes per key.
+ */
+template <typename Tree, typename... Args>
+std::pair<double, double> timeLatencyAndBytes(const std::vector<int>& keys,
+                                              size_t numLookups, Args... args) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto gen = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+
+  Tree tree(keys, args...);
+  std::vector<int> lookups(numLookups);
+  for (size_t i = 0; i < numLookups; i++) {
+    lookups[i] = keys[gen(engine)];
+  }
+
+  size_t found = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < numLookups; i++) {
+    found += tree.contains(lookups[i]);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = found;
+  (void) sink;
+
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  return std::make_pair(ns / numLookups, double(tree.memory_bytes()) / keys.size());
+}
+
 /**
  * Given a BST type and a number of elements, reports the time required to
  * visit every element of that BST in sequence, either front-to-back or
@@ -151,6 +606,260 @@ double timeWorkingSets(size_t numElems, size_t numSets, size_t numLookups) {
 }
 
 
+/**
+ * Times lookups against a working set that moves: in each of numPhases
+ * phases, nine lookups in ten go to a hot set of hotSize keys scattered at
+ * random over the tree, and the rest to any key; each phase picks a new hot
+ * set. Unlike timeWorkingSets this times the whole run rather than each
+ * lookup, so anything the tree does in the background on the same cores
+ * shows up in the total.
+ */
+template <typename BST>
+double timeShiftingWorkingSets(size_t numElems, size_t hotSize, size_t numPhases, size_t lookupsPerPhase) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto any = std::uniform_int_distribution<int>(0, numElems - 1);
+  auto hot = std::uniform_int_distribution<int>(0, hotSize - 1);
+  auto coin = std::uniform_int_distribution<int>(0, 9);
+
+  std::vector<int> queries;
+  queries.reserve(numPhases * lookupsPerPhase);
+  for (size_t phase = 0; phase < numPhases; phase++) {
+    std::vector<int> hotSet(hotSize);
+    for (int& key : hotSet) {
+      key = any(engine);
+    }
+    for (size_t i = 0; i < lookupsPerPhase; i++) {
+      queries.push_back(coin(engine) == 0 ? any(engine) : hotSet[hot(engine)]);
+    }
+  }
+
+  std::vector<double> probabilities(numElems, 1.0 / numElems);
+  BST tree{probabilities};
+
+  size_t found = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int key : queries) {
+    found += tree.contains(key);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = found;
+  (void) sink;
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1.0e6;
+}
+
+/* The cost of keeping many small sets: the memory each one takes, in bytes,
+ * and the average latency of a lookup in a random one, in nanoseconds.
+ */
+struct SmallSetCost {
+  double bytesPerSet;
+  double lookupNs;
+};
+
+/**
+ * Builds numSets trees of setSize elements each and times numLookups
+ * lookups, each in a random one of the trees, for a key that is present half
+ * the time. The memory is how much the heap grows while building them, which
+ * counts the trees themselves and what the allocator adds to each of their
+ * allocations.
+ */
+template <typename BST>
+SmallSetCost timeSmallSets(size_t numSets, size_t setSize, size_t numLookups) {
+  std::vector<double> probabilities(setSize, 1.0 / setSize);
+  auto build = [&](std::deque<BST>& sets, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      sets.emplace_back(probabilities);
+    }
+  };
+
+  SmallSetCost cost;
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+  auto whichSet = std::uniform_int_distribution<size_t>(0, numSets - 1);
+  auto whichKey = std::uniform_int_distribution<int>(0, 2 * setSize - 1);
+  std::vector<std::pair<size_t, int> > lookups(numLookups);
+  for (auto& lookup : lookups) {
+    lookup = std::make_pair(whichSet(engine), whichKey(engine));
+  }
+
+  size_t before = heapBytesInUse();
+  std::deque<BST> sets;
+  build(sets, numSets);
+  cost.bytesPerSet = double(heapBytesInUse() - before) / numSets;
+
+  size_t found = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto& lookup : lookups) {
+    found += sets[lookup.first].contains(lookup.second);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = found;
+  (void) sink;
+
+  cost.lookupNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / double(numLookups);
+  return cost;
+}
+
+/**
+ * Given a BST type that supports insert and a number of elements, inserts
+ * that many distinct keys in random order into an empty tree, returning the
+ * average cost of an insertion in nanoseconds, rebalances and resizes
+ * included.
+ */
+template <typename BST>
+double timeInserts(size_t count) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), engine);
+
+  BST tree{std::vector<double>()};
+
+  size_t inserted = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int key : keys) {
+    inserted += tree.insert(key);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = inserted;
+  (void) sink;
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / double(count);
+}
+
+/* The distribution of single-insert latencies, in nanoseconds: the median,
+ * the 99th, 99.9th and 99.99th percentiles, and the worst.
+ */
+struct InsertLatency {
+  double p50;
+  double p99;
+  double p999;
+  double p9999;
+  double max;
+};
+
+/**
+ * Given a BST type that supports insert and a number of elements, inserts
+ * that many distinct keys in random order into an empty tree, timing each
+ * insert on its own. The tail is where a tree that rebuilds itself all at
+ * once pays for it.
+ */
+template <typename BST>
+InsertLatency timeInsertLatency(size_t count) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), engine);
+
+  BST tree{std::vector<double>()};
+  std::vector<double> latencies(count);
+
+  size_t inserted = 0;
+  for (size_t i = 0; i < count; i++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    inserted += tree.insert(keys[i]);
+    auto end = std::chrono::high_resolution_clock::now();
+    latencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  }
+  volatile size_t sink = inserted;
+  (void) sink;
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min(count - 1, size_t(p * count))];
+  };
+  return { percentile(0.5), percentile(0.99), percentile(0.999), percentile(0.9999), latencies.back() };
+}
+
+/**
+ * Given a BST type that supports insertSorted, builds a tree holding the
+ * even keys 0, 2, ..., 2 * (count - 1) and then ingests the odd keys in
+ * between as sorted batches of batchSize random keys each, returning the
+ * throughput in millions of keys per second. If bulk is false, each batch
+ * goes in one insert at a time instead.
+ */
+template <typename BST>
+double timeBatchInserts(size_t count, size_t batchSize, bool bulk) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(2 * i + 1);
+  }
+  std::shuffle(keys.begin(), keys.end(), engine);
+  std::vector<std::vector<int> > batches;
+  for (size_t i = 0; i < count; i += batchSize) {
+    batches.emplace_back(keys.begin() + i, keys.begin() + std::min(count, i + batchSize));
+    std::sort(batches.back().begin(), batches.back().end());
+  }
+
+  BST tree{std::vector<double>()};
+  std::vector<int> evens(count);
+  for (size_t i = 0; i < count; i++) {
+    evens[i] = int(2 * i);
+  }
+  tree.insertSorted(evens);
+
+  size_t inserted = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto& batch : batches) {
+    if (bulk) {
+      inserted += tree.insertSorted(batch);
+    } else {
+      for (int key : batch) {
+        inserted += tree.insert(key);
+      }
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = inserted;
+  (void) sink;
+
+  return count / (std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1.0e3);
+}
+
+/**
+ * Given a BST type that supports remove and a number of elements, builds a
+ * tree of that many elements and removes all of them in random order,
+ * returning the average cost of a removal in nanoseconds. Since the tree
+ * drains to empty, this includes every rebalance and shrink along the way.
+ */
+template <typename BST>
+double timeDeletes(size_t count) {
+  std::default_random_engine engine;
+  engine.seed(kRandomSeed);
+
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = int(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), engine);
+
+  std::vector<double> probabilities(count, 1.0 / count);
+  BST tree{probabilities};
+
+  size_t removed = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int key : keys) {
+    removed += tree.remove(key);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  volatile size_t sink = removed;
+  (void) sink;
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / double(count);
+}
+
 /**
  * Runs some basic correctness checks to ensure that the tree works correctly.
  * This involves looking up all the expected elements and a few that aren't
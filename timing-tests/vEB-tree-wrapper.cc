@@ -1,12 +1,16 @@
 #include "vEB-tree-wrapper.h"
 using namespace std;
 
-VebTreeWrapper::VebTreeWrapper(const std::vector<double>& weights) : tree(std::vector<int>(2)) {
+// The keys 0, 1, 2, ..., weights.size() - 1 that every wrapper stores.
+static std::vector<int> keysFor(const std::vector<double>& weights) {
 	std::vector<int> v;
 	for (size_t i = 0; i < weights.size(); i++) {
 		v.push_back(i);
 	}
-	tree = VebTree(v);
+	return v;
+}
+
+VebTreeWrapper::VebTreeWrapper(const std::vector<double>& weights) : tree(keysFor(weights)) {
 }
 
 VebTreeWrapper::~VebTreeWrapper() {
@@ -17,3 +21,148 @@ bool VebTreeWrapper::contains(int key) const {
 	return tree.contains(key);
 }
 
+void VebTreeWrapper::containsBatch(const int * keys, size_t n, bool * out) const {
+	tree.contains_batch(keys, n, out);
+}
+
+// Turns a pointer returned by one of the tree's ordered queries into a key.
+static int keyOrNone(const int * key) {
+	return key == nullptr ? -1 : *key;
+}
+
+int VebTreeWrapper::predecessor(int key) const {
+	return keyOrNone(tree.predecessor(key));
+}
+
+int VebTreeWrapper::successor(int key) const {
+	return keyOrNone(tree.successor(key));
+}
+
+int VebTreeWrapper::lowerBound(int key) const {
+	return keyOrNone(tree.lower_bound(key));
+}
+
+int VebTreeWrapper::upperBound(int key) const {
+	return keyOrNone(tree.upper_bound(key));
+}
+
+int VebTreeWrapper::rank(int key) const {
+	return tree.rank(key);
+}
+
+int VebTreeWrapper::select(int rank) const {
+	return keyOrNone(tree.select(rank));
+}
+
+int VebTreeWrapper::countRange(int a, int b) const {
+	return tree.count_range(std::min(a, b), std::max(a, b));
+}
+
+int64_t VebTreeWrapper::sumRange(int lo, int hi) const {
+	int64_t sum = 0;
+	tree.for_each_in_range(lo, hi, [&](int key) { sum += key; });
+	return sum;
+}
+
+int64_t VebTreeWrapper::sumRangeIterator(int lo, int hi) const {
+	int64_t sum = 0;
+	for (auto itr = tree.iterator_at(tree.rank(lo)); itr != tree.end() && *itr <= hi; ++itr) {
+		sum += *itr;
+	}
+	return sum;
+}
+
+VebTreeRecursiveWrapper::VebTreeRecursiveWrapper(const std::vector<double>& weights) : tree(keysFor(weights)) {
+}
+
+VebTreeRecursiveWrapper::~VebTreeRecursiveWrapper() {
+	// noop
+}
+
+bool VebTreeRecursiveWrapper::contains(int key) const {
+	return tree.containsRecursive(key);
+}
+
+VebTreeBlockedWrapper::VebTreeBlockedWrapper(const std::vector<double>& weights) : tree(keysFor(weights), kBlockedVebLayout) {
+}
+
+VebTreeBlockedWrapper::~VebTreeBlockedWrapper() {
+	// noop
+}
+
+bool VebTreeBlockedWrapper::contains(int key) const {
+	return tree.contains(key);
+}
+
+void VebTreeBlockedWrapper::containsBatch(const int * keys, size_t n, bool * out) const {
+	tree.contains_batch(keys, n, out);
+}
+
+int64_t VebTreeBlockedWrapper::sumRange(int lo, int hi) const {
+	int64_t sum = 0;
+	tree.for_each_in_range(lo, hi, [&](int key) { sum += key; });
+	return sum;
+}
+
+VebMapWrapper::VebMapWrapper(const std::vector<double>& weights)
+		: map(keysFor(weights), std::vector<int64_t>(weights.size(), 1)) {
+}
+
+VebMapWrapper::~VebMapWrapper() {
+	// noop
+}
+
+bool VebMapWrapper::contains(int key) const {
+	const int64_t * value = map.find(key);
+	return value != nullptr && *value != 0;
+}
+
+void VebMapWrapper::containsBatch(const int * keys, size_t n, bool * out) const {
+	const size_t kChunk = 256;
+	const int64_t * values[kChunk];
+	for (size_t start = 0; start < n; start += kChunk) {
+		size_t chunk = std::min(kChunk, n - start);
+		map.find_batch(keys + start, chunk, values);
+		for (size_t i = 0; i < chunk; i++) {
+			out[start + i] = values[i] != nullptr && *values[i] != 0;
+		}
+	}
+}
+
+VebTreeWeightedWrapper::VebTreeWeightedWrapper(const std::vector<double>& weights) : tree(keysFor(weights), weights) {
+}
+
+VebTreeWeightedWrapper::~VebTreeWeightedWrapper() {
+	// noop
+}
+
+bool VebTreeWeightedWrapper::contains(int key) const {
+	return tree.contains(key);
+}
+
+VebTreeAdaptiveWrapper::VebTreeAdaptiveWrapper(const std::vector<double>& weights) : tree(keysFor(weights), 1 << 17) {
+}
+
+VebTreeAdaptiveWrapper::~VebTreeAdaptiveWrapper() {
+	// noop
+}
+
+bool VebTreeAdaptiveWrapper::contains(int key) const {
+	return tree.contains(key);
+}
+
+VebTreeJumpWrapper::VebTreeJumpWrapper(const std::vector<int>& keys, VebLayout layout, int bits) : tree(keys, layout) {
+	tree.build_jump_table(bits);
+}
+
+VebTreeJumpWrapper::~VebTreeJumpWrapper() {
+	// noop
+}
+
+bool VebTreeJumpWrapper::contains(int key) const {
+	return tree.contains(key);
+}
+
+size_t VebTreeJumpWrapper::memory_bytes() const {
+	return tree.memory_bytes();
+}
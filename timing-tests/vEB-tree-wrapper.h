@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <../vEB-tree.h>
+#include <../vEB-map.h>
+#include <../weighted-vEB-tree.h>
+#include <../adaptive-vEB-tree.h>
 using namespace std;
 
 class VebTreeWrapper {
@@ -13,7 +16,123 @@ class VebTreeWrapper {
 
 		bool contains(int key) const;
 
+		// Looks up n keys at once, storing whether each is present in out.
+		void containsBatch(const int * keys, size_t n, bool * out) const;
+
+		// Ordered queries, returning -1 if there is no such key.
+		int predecessor(int key) const;
+		int successor(int key) const;
+		int lowerBound(int key) const;
+		int upperBound(int key) const;
+
+		// Order statistics: the number of keys less than key, the key with
+		// the given rank (-1 if there is none), and the number of keys
+		// between a and b inclusive, taken in either order.
+		int rank(int key) const;
+		int select(int rank) const;
+		int countRange(int a, int b) const;
+
+		// Range scans: the sum of the keys in [lo, hi], found with
+		// for_each_in_range or by stepping an iterator.
+		int64_t sumRange(int lo, int hi) const;
+		int64_t sumRangeIterator(int lo, int hi) const;
+
+	private:
+		VebTree<int> tree; // The actual data structure
+};
+
+// Same as VebTreeWrapper, but looks keys up with the original recursive
+// search so the two can be compared.
+class VebTreeRecursiveWrapper {
+	public:
+		VebTreeRecursiveWrapper(const std::vector<double>& weights);
+
+		~VebTreeRecursiveWrapper();
+
+		bool contains(int key) const;
+
+	private:
+		VebTree<int> tree; // The actual data structure
+};
+
+// Same as VebTreeWrapper, but uses the blocked layout, with SIMD searches of
+// the cache-line sized leaf blocks.
+class VebTreeBlockedWrapper {
+	public:
+		VebTreeBlockedWrapper(const std::vector<double>& weights);
+
+		~VebTreeBlockedWrapper();
+
+		bool contains(int key) const;
+
+		// Looks up n keys at once, storing whether each is present in out.
+		void containsBatch(const int * keys, size_t n, bool * out) const;
+
+		// The sum of the keys in [lo, hi], found with for_each_in_range.
+		int64_t sumRange(int lo, int hi) const;
+
+	private:
+		VebTree<int> tree; // The actual data structure
+};
+
+// A VebMap from each key to a value, where contains looks the value up too,
+// to measure the cost of the extra access to the value array.
+class VebMapWrapper {
+	public:
+		VebMapWrapper(const std::vector<double>& weights);
+
+		~VebMapWrapper();
+
+		bool contains(int key) const;
+
+		// Looks up n keys at once, storing whether each is present in out.
+		void containsBatch(const int * keys, size_t n, bool * out) const;
+
+	private:
+		VebMap<int, int64_t> map; // The actual data structure
+};
+
+// A WeightedVebTree built from the access probabilities, so that the keys
+// looked up most often sit near the root.
+class VebTreeWeightedWrapper {
+	public:
+		VebTreeWeightedWrapper(const std::vector<double>& weights);
+
+		~VebTreeWeightedWrapper();
+
+		bool contains(int key) const;
+
+	private:
+		WeightedVebTree<int> tree; // The actual data structure
+};
+
+// An AdaptiveVebTree that starts out balanced and relays itself out in the
+// background after every 2^17 sampled lookups, or when the hot keys move.
+class VebTreeAdaptiveWrapper {
+	public:
+		VebTreeAdaptiveWrapper(const std::vector<double>& weights);
+
+		~VebTreeAdaptiveWrapper();
+
+		bool contains(int key) const;
+
+	private:
+		AdaptiveVebTree<int> tree; // The actual data structure
+};
+
+// A VebTree over a given set of keys with a jump table of 2^bits entries
+// (none if bits is 0), for comparing table sizes.
+class VebTreeJumpWrapper {
+	public:
+		VebTreeJumpWrapper(const std::vector<int>& keys, VebLayout layout, int bits);
+
+		~VebTreeJumpWrapper();
+
+		bool contains(int key) const;
+
+		size_t memory_bytes() const;
+
 	private:
-		VebTree tree; // The actual data structure
+		VebTree<int> tree; // The actual data structure
 };
 #endif
@@ -0,0 +1,106 @@
+#include "tree-storage.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const size_t kCacheLine = 64;
+static const size_t kHugePage = size_t(2) << 20;
+
+static size_t roundUp(size_t bytes, size_t unit) {
+  return (bytes + unit - 1) / unit * unit;
+}
+
+// The size of the mapping behind an allocation of the given size.
+static size_t mappedBytes(size_t bytes) {
+  return roundUp(std::max<size_t>(bytes, 1), kHugePage);
+}
+
+/* mmap only promises page alignment, so for transparent huge pages we map an
+ * extra huge page and trim the mapping to a 2 MiB boundary; otherwise the
+ * first and last partial 2 MiB of the array would stay on small pages.
+ */
+static void * mapTransparentHugePages(size_t bytes) {
+  size_t length = mappedBytes(bytes);
+  void * raw = mmap(nullptr, length + kHugePage, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  uintptr_t start = roundUp((uintptr_t) raw, kHugePage);
+  size_t before = start - (uintptr_t) raw;
+  if (before > 0) {
+    munmap(raw, before);
+  }
+  munmap((char *) start + length, kHugePage - before);
+#ifdef MADV_HUGEPAGE
+  madvise((void *) start, length, MADV_HUGEPAGE);
+#endif
+  return (void *) start;
+}
+
+static void * mapHugetlbPages(size_t bytes) {
+#ifdef MAP_HUGETLB
+  void * memory = mmap(nullptr, mappedBytes(bytes), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (memory != MAP_FAILED) {
+    return memory;
+  }
+#endif
+  throw std::bad_alloc();
+}
+
+// Writes one byte per small page, which is enough to fault in the page (or
+// the huge page) behind it.
+static void prefault(void * memory, size_t bytes) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < bytes; offset += page) {
+    ((volatile char *) memory)[offset] = 0;
+  }
+}
+
+void * allocateStorage(size_t bytes, const StoragePolicy& policy) {
+  void * memory;
+  switch (policy.backing) {
+    case kTransparentHugePageStorage:
+      memory = mapTransparentHugePages(bytes);
+      break;
+    case kHugetlbStorage:
+      memory = mapHugetlbPages(bytes);
+      break;
+    default:
+      if (posix_memalign(&memory, kCacheLine, std::max<size_t>(bytes, 1))) {
+        throw std::bad_alloc();
+      }
+      break;
+  }
+  if (policy.prefault) {
+    prefault(memory, bytes);
+  }
+  return memory;
+}
+
+void freeStorage(void * memory, size_t bytes, const StoragePolicy& policy) {
+  if (memory == nullptr) {
+    return;
+  }
+  if (policy.backing == kAlignedStorage) {
+    free(memory);
+  } else {
+    munmap(memory, mappedBytes(bytes));
+  }
+}
+
+const char * storageName(StorageBacking backing) {
+  switch (backing) {
+    case kTransparentHugePageStorage:
+      return "thp";
+    case kHugetlbStorage:
+      return "hugetlb";
+    default:
+      return "aligned";
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef TREE_STORAGE
+#define TREE_STORAGE
+
+#include <cstddef>
+
+// Where the big arrays of VebTree and cotree live. The default is ordinary
+// heap memory aligned to a cache line. On large trees every root-to-leaf path
+// also costs a TLB miss per level or so, which the huge page backings cut
+// down by mapping the array with 2 MiB pages.
+enum StorageBacking {
+  // posix_memalign'd memory on 64-byte boundaries.
+  kAlignedStorage,
+  // An anonymous mapping on a 2 MiB boundary, marked with
+  // madvise(MADV_HUGEPAGE) so the kernel backs it with transparent huge
+  // pages when it can.
+  kTransparentHugePageStorage,
+  // An explicit MAP_HUGETLB mapping from the hugetlbfs pool. Allocation
+  // fails with std::bad_alloc if the pool doesn't have enough pages.
+  kHugetlbStorage
+};
+
+struct StoragePolicy {
+  StoragePolicy(StorageBacking backing = kAlignedStorage,
+                bool prefault = false)
+      : backing(backing), prefault(prefault) {}
+
+  StorageBacking backing;
+  // Whether to fault every page in up front, so the first lookups to touch
+  // a page don't pay for it.
+  bool prefault;
+};
+
+// Allocates bytes of memory according to policy, throwing std::bad_alloc if
+// it can't. The memory is at least 64-byte aligned, and must be handed back
+// to freeStorage with the same size and policy.
+void * allocateStorage(size_t bytes, const StoragePolicy& policy);
+void freeStorage(void * memory, size_t bytes, const StoragePolicy& policy);
+
+// A short name for the backing, for reports.
+const char * storageName(StorageBacking backing);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef VEB_MAP
+#define VEB_MAP
+
+#include <stdexcept>
+#include <vector>
+
+#include "vEB-tree.h"
+
+// A static map stored as a VebTree of keys plus an array of values in sorted
+// key order. A lookup searches the dense key layout exactly like
+// VebTree::contains, which also yields the key's rank, and then reads the
+// value at that rank, so a hit costs one more memory access than a set
+// lookup and the values don't dilute the keys in cache.
+template <typename Key, typename Value, typename Params = VebTreeParams<Key> >
+class VebMap {
+public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+
+  // Builds a map from keys in sorted order and the values that go with them,
+  // values[i] being the value for keys[i]. The layout and threads arguments
+  // are passed on to VebTree. Throws std::invalid_argument if there isn't
+  // exactly one value per key.
+  VebMap(const std::vector<key_type>& keys, std::vector<mapped_type> values,
+         VebLayout layout = kPureVebLayout, unsigned threads = 0)
+      : tree(keys, layout, threads), values(std::move(values)) {
+    if (tree.size() != this->values.size()) {
+      throw std::invalid_argument("VebMap needs one value per key");
+    }
+  }
+
+  // Returns a pointer to the value for key, or nullptr if key isn't present.
+  const mapped_type * find(const key_type& key) const {
+    size_t rank;
+    return tree.contains(key, rank) ? &values[rank] : nullptr;
+  }
+  mapped_type * find(const key_type& key) {
+    size_t rank;
+    return tree.contains(key, rank) ? &values[rank] : nullptr;
+  }
+
+  // Looks up n keys at once (see VebTree::contains_batch), setting out[i] to
+  // the value for keys[i], or nullptr if it isn't present.
+  void find_batch(const key_type * keys, size_t n,
+                  const mapped_type ** out) const;
+
+  bool contains(const key_type& key) const { return tree.contains(key); }
+
+  // The number of keys in the map.
+  size_t size() const { return values.size(); }
+
+private:
+  VebTree<Key, Params> tree;
+  std::vector<mapped_type> values;
+};
+
+/* Runs the batched key search in chunks, so that the found flags and ranks
+ * can live on the stack, and then picks up the values. The values are
+ * prefetched as they're handed out, since the caller is about to read them.
+ */
+template <typename Key, typename Value, typename Params>
+void VebMap<Key, Value, Params>::find_batch(const key_type * keys, size_t n,
+                                            const mapped_type ** out) const {
+  const size_t kChunk = 256;
+  bool found[kChunk];
+  size_t ranks[kChunk];
+  for (size_t start = 0; start < n; start += kChunk) {
+    size_t chunk = std::min(kChunk, n - start);
+    tree.contains_batch(keys + start, chunk, found, ranks);
+    for (size_t i = 0; i < chunk; i++) {
+      out[start + i] = found[i] ? &values[ranks[i]] : nullptr;
+      __builtin_prefetch(out[start + i]);
+    }
+  }
+}
+
+#endif
@@ -1,223 +1,387 @@
 #include "vEB-tree.h"
-#include "math.h"
-#include <limits.h>
-#include <iostream>
-#include "assert.h"
-using namespace std;
-
-// For quickly converting from order to the size of that perfect tree.
-// Can also be computed as ((1 << (1 << order) ) - 1)
-// Can go the opposite direction with (ceil(log2(ceil(log2(size + 1)))))
-static unsigned orderToSize[] = {1, 3, 15, 255, 65535, 4294967295};
-
-VebTree::VebTree(std::vector<int> keys){
-  //tree = vector<int>(keys.size()); // This will order the vals into a tree
-  if (keys.size() < 2) {
-    cout << "Cannot create a vEB tree of size < 2. Exiting..." << endl;
-    exit(-1);
-  }
-  treeOrder = (int) ceil(log2(ceil(log2(keys.size() + 1))));
-
-  int sizeB = (1 << (1 << (treeOrder -1))) - 1;
-  int nSeg = (keys.size() - 1) / sizeB;
-  numSegments = nSeg;
-  int nTop = keys.size() - (nSeg * sizeB);
-
-  tree = new int[keys.size() - nTop + sizeB];
-  int numDummyValues = sizeB - nTop;
-  for (int i = 0; i < numDummyValues; i++) {
-    keys.push_back(INT_MAX);
-  }
-  vector<int> topElems;
-  int currIndex = sizeB; // Reserve the first block for our top tree
-  int inputIndex = 0;
-  for (int i = 0; i < nSeg; i++) {
-    recursivelyPlace(keys, inputIndex /*i * (sizeB + 1)*/, tree, currIndex, sizeB);
-    currIndex += sizeB;
-    inputIndex += sizeB;
-    if (inputIndex < keys.size()) {
-      topElems.push_back(keys.at(inputIndex));
-       inputIndex++;
-     // tree[i] = keys[((i+1) * (sizeB + 1))-1];
-    }
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VEB_TREE_X86
+#endif
+
+// Most users of the tree store ints, so instantiate that version here once
+// rather than in every translation unit that includes the header.
+template class VebTree<int>;
+
+/* The BTD tables, exactly as cotree::precompute_BTD builds them: a subtree
+ * of height h is split into a top tree of ceil(h / 2) levels and bottom
+ * trees of floor(h / 2) levels. Each table has 3 * (height + 2) entries,
+ * indexed by 3 * depth for 1-based depths, and all of them together come to
+ * under 60 KB, so they're all built at once.
+ */
+static const int kMaxBTDHeight = 64;
+
+static void fillBTD(size_t * BTD, int topDepth, int bottomDepth) {
+  int height = bottomDepth - topDepth + 1;
+  int hTop = (height + 1) / 2;
+  int bottomHalfDepth = topDepth + hTop;
+  int base = 3 * bottomHalfDepth;
+  BTD[base + 0] = (size_t(1) << (height - hTop)) - 1;
+  BTD[base + 1] = (size_t(1) << hTop) - 1;
+  BTD[base + 2] = topDepth;
+  if (topDepth < bottomHalfDepth - 1) {
+    fillBTD(BTD, topDepth, bottomHalfDepth - 1);
+  }
+  if (bottomHalfDepth < bottomDepth) {
+    fillBTD(BTD, bottomHalfDepth, bottomDepth);
   }
-  while (inputIndex < keys.size()) {
-    topElems.push_back(keys.at(inputIndex));
-    inputIndex++;
-  }
-  while(topElems.size() < sizeB) {
-    assert(false);
-    topElems.push_back(INT_MAX);
-  }
-
-  recursivelyPlace(topElems, 0, tree, 0, sizeB);
-  /*int counter = 0;
-  for (int x : tree) {
-    counter++;
-    cout << counter << ":  " << x << endl;
-  }*/
-}
-
-// These are the perfect subtree sizes, up to a large number.
-// Just used for sanity checking.
-bool isPerfectSubTreeSize(int size) {
-  return size == 1 || size == 3 || size == 15 || size == 255 || size == 65535;
-}
-
-void VebTree::recursivelyPlace(vector<int>& sortedInput,
-                                int inputMinIndex,
-                                int* tree,
-                                int treeMinIndex, 
-                                int size) {
-  // NOTE: range is [minIndex, maxIndex), exclusing the maxIndex
-  // We want to take the inputs in this range of the inputs, and store them
-  // in this (other) range in the tree array
-  if (inputMinIndex >= sortedInput.size()) {
-    cout << "RECURSIVE PLACE WAS WEIRD" << endl;
-    assert(false);
-    return;
-  } 
-  if (!isPerfectSubTreeSize(size)) {
-    cout << "Attempted to recursively place a tree of size " << size << endl;
-    exit(1);
-  }
-  if (size == 1) {// Base case! size one is easy
-    tree[treeMinIndex] = sortedInput.at(inputMinIndex);
-    return;
-  }
-  int subTreeSize = sqrt(size + 1) - 1;
-  int numChildren = (size / subTreeSize) - 1;
-  // Reserve the first segment spot for the top tree
-  int currIndex = treeMinIndex + subTreeSize;
-  // Remember the elems for the top tree as we go
-  vector<int> topElems;
-  for (int child = 0; child < numChildren; child++) {
-    recursivelyPlace(sortedInput, inputMinIndex + (child * (subTreeSize + 1)),
-                     tree, currIndex,
-                     subTreeSize);
-    
-    currIndex += subTreeSize;
-    if (child != numChildren - 1) {
-      // Not the last child? Then this next elem belongs in the top
-      topElems.push_back(sortedInput.at(inputMinIndex +
-                                     ((child+1) * (subTreeSize + 1))-1));
+}
+
+const size_t * vebBTDTable(int height) {
+  static const std::vector<std::vector<size_t> > tables = []() {
+    std::vector<std::vector<size_t> > tables(kMaxBTDHeight + 1);
+    for (int h = 1; h <= kMaxBTDHeight; h++) {
+      tables[h].assign(3 * (h + 2), 0);
+      if (h > 1) {
+        fillBTD(tables[h].data(), 1, h);
+      }
     }
+    return tables;
+  }();
+  assert(height >= 1 && height <= kMaxBTDHeight);
+  return tables[height].data();
+}
+
+/* The leaf block kernels. A block is one cache line of keys in sorted order,
+ * so comparing the search key against every slot at once and counting the
+ * slots that are smaller gives the key's position within the block. Padding
+ * slots hold the largest possible key, which is never smaller than the search
+ * key, so they don't need any special casing.
+ *
+ * The AVX2 versions are compiled for AVX2 regardless of the flags the rest of
+ * the program uses, and are only called if the CPU reports AVX2 support. The
+ * loads are unaligned, since a small tree's keys (which are searched the same
+ * way) are only aligned to the key type; on aligned blocks they cost nothing.
+ */
+template <typename T>
+static int searchBlockScalar(const T * block, int slots, T key, bool& found) {
+  int less = 0;
+  found = false;
+  for (int i = 0; i < slots; i++) {
+    found |= block[i] == key;
+    less += block[i] < key;
   }
+  return less;
+}
 
-  // All the bottom trees have been placed. Now add the topElems into the space
-  // we reserved earlier
-  recursivelyPlace(topElems, 0, tree, treeMinIndex, subTreeSize);
+#ifdef VEB_TREE_X86
+__attribute__((target("avx2")))
+static int searchBlock32Avx2(const int32_t * block, int32_t key, bool& found) {
+  __m256i keys = _mm256_set1_epi32(key);
+  __m256i low = _mm256_loadu_si256((const __m256i *) block);
+  __m256i high = _mm256_loadu_si256((const __m256i *) (block + 8));
+  unsigned less =
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(keys, low))) |
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(keys, high))) << 8;
+  unsigned equal =
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(keys, low))) |
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(keys, high)));
+  found = equal != 0;
+  return __builtin_popcount(less);
 }
-  
 
-int VebTree::getPredecessor(int key) {
-  return -1.0; 
+static int searchBlock32Sse2(const int32_t * block, int32_t key, bool& found) {
+  __m128i keys = _mm_set1_epi32(key);
+  unsigned less = 0;
+  unsigned equal = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i slots = _mm_loadu_si128((const __m128i *) (block + 4 * i));
+    less |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(keys, slots))) << (4 * i);
+    equal |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(keys, slots)));
+  }
+  found = equal != 0;
+  return __builtin_popcount(less);
 }
 
+__attribute__((target("avx2")))
+static int searchBlock64Avx2(const int64_t * block, int64_t key, bool& found) {
+  __m256i keys = _mm256_set1_epi64x(key);
+  __m256i low = _mm256_loadu_si256((const __m256i *) block);
+  __m256i high = _mm256_loadu_si256((const __m256i *) (block + 4));
+  unsigned less =
+      _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(keys, low))) |
+      _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(keys, high))) << 4;
+  unsigned equal =
+      _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(keys, low))) |
+      _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(keys, high)));
+  found = equal != 0;
+  return __builtin_popcount(less);
+}
+#endif
 
+int vebSearchBlock32(const int32_t * block, int32_t key, bool& found) {
+#ifdef VEB_TREE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return searchBlock32Avx2(block, key, found);
+  }
+  return searchBlock32Sse2(block, key, found);
+#else
+  return searchBlockScalar(block, 16, key, found);
+#endif
+}
 
-/* This method functionally has 2 return values: The boolean indicates whether
- * or not the key was present in this subtree. If it was present, then the
- * returnAnswer int is updated to be the in-order index of that node in this
- * subtree.
- *
- * If it wasn't found, then returnAnswer is updated to be the index of the
- * subtree that might contain this key.
- *
- * Say you has a subtree of order 1 (just 3 nodes) like this:
- *
- *                  10
- *                /    \
- *               5      15
- *
- * If you searched for 5, it would return true and set the int to 0.
- *
- * If you search for 3, it would return false and set the int to 0 (since 3
- * would be in the leftmost of the 4 subtrees that could be hanngin off this
- * tree.
- *
- * If you search for 12, it would return false and set the int to 2, since it
- * would be in the 3rd subtree hanging off this subtree. (The one to the left
- * of 15).
- *
- * It does this by first recursively checking the top-structure of this tree,
- * (in this example, the order 0 tree that has one node: 10) and returns if 
- * it found it.
- * 
- * If the node wasn't in the top, then it uses the answer from the top query
- * to index into one of the bottom trees (here we have two: the tree with 5
- * and the tree with 15) and search for it there.
- * 
- * If it is found in the bottom tree, then we return true and set the int
- * accordingly (keeping track of the number of nodes in the top and bottom
- * that were smaller than this node).
- *
- * If it wasn't in the bottom tree, then we calculate which subtree it would be
- * in, and return false.
+int vebSearchBlock64(const int64_t * block, int64_t key, bool& found) {
+#ifdef VEB_TREE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return searchBlock64Avx2(block, key, found);
+  }
+#endif
+  return searchBlockScalar(block, 8, key, found);
+}
+
+/* Image files. The checksum is a simple multiply-rotate hash over 8-byte
+ * words, which is plenty to catch truncated or corrupted images and runs at
+ * close to memory speed.
  */
-bool VebTree::containsHelper(int key, int index, int order, int& returnAnswer,
-                             bool isParent) const {
-  //if (index < 0 || index > tree.size()) {
-    //cout << "Hit the weird base case in contains..." << endl;
-    //cout << "Searching for " << key << endl;
-  //  assert(false);
-  //}
-  if (order == 0) {
-    if (key == tree[index]) {
-      // Found the answer. Report that the key was in the 0th child
-      returnAnswer = 0;
-      return true;
-    } else { 
-      // Not found, say if we're in the 0th (left) or 1th (right) subtree
-      if (key < tree[index]) returnAnswer = 0;
-      else                      returnAnswer = 1;
-      return false;
-    }
+static const size_t kImageAlignment = 64;
+
+static uint64_t roundUpToAlignment(uint64_t bytes) {
+  return (bytes + kImageAlignment - 1) / kImageAlignment * kImageAlignment;
+}
+
+static uint64_t imageChecksum(uint64_t hash, const char * data, size_t bytes) {
+  const uint64_t kMultiplier = 0x9E3779B97F4A7C15ull;
+  size_t i = 0;
+  for (; i + 8 <= bytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = ((hash ^ word) * kMultiplier);
+    hash ^= hash >> 29;
   }
-  int topAns;
-  int sizeOfChild = orderToSize[order -1];
-  if (containsHelper(key, index, order - 1, topAns)) {
-    // Found the index in our top structure, report which node it was in
-    int numSmallerChildren = topAns + 1;
-    returnAnswer = topAns + (sizeOfChild * numSmallerChildren);
-    return true;
-  } else {
-    // Not found in the top, ans is the index of the child to check
-    // skip sizeOfChild indices to get past top, then skip sizeOfChild
-    // for each child to skip.
-    int indexOfChild = index + (sizeOfChild *(topAns + 1));
-    if (isParent) {
-      // We have an unusual number of children. Make sure this
-      // one is valid
-      if (topAns >= numSegments) {
-        //TODO: Do I need to set returnAnswer?
-        return false;               
-      }
+  for (; i < bytes; i++) {
+    hash = (hash ^ (unsigned char) data[i]) * kMultiplier;
+  }
+  return hash;
+}
+
+static uint64_t blocksBytes(const VebTreeImageHeader& header) {
+  return header.numBlocks * header.blockSlots * header.keySize;
+}
+
+static void imageError(const std::string& path, const std::string& reason) {
+  throw std::runtime_error(path + ": " + reason);
+}
+
+void vebWriteImage(const std::string& path, VebTreeImageHeader& header,
+                   const void * tree, const void * blocks) {
+  memcpy(header.magic, "VEBTREE", 8);
+  header.version = kVebImageVersion;
+  header.byteOrder = kVebImageByteOrder;
+  uint64_t treeBytes = header.treeSlots * header.keySize;
+  header.treeOffset = roundUpToAlignment(sizeof(header));
+  header.blocksOffset = header.numBlocks == 0 ? 0 :
+      roundUpToAlignment(header.treeOffset + treeBytes);
+  header.checksum = imageChecksum(0, (const char *) tree, treeBytes);
+  header.checksum = imageChecksum(header.checksum, (const char *) blocks,
+                                  blocksBytes(header));
+
+  FILE * file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    imageError(path, strerror(errno));
+  }
+  static const char padding[kImageAlignment] = {};
+  size_t headerPadding = header.treeOffset - sizeof(header);
+  size_t treePadding = header.numBlocks == 0 ? 0 :
+      header.blocksOffset - header.treeOffset - treeBytes;
+  // The pure layout has no blocks, and blocks is null then, which fwrite
+  // mustn't be handed even for no bytes.
+  size_t leafBytes = blocksBytes(header);
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(padding, 1, headerPadding, file) == headerPadding &&
+            fwrite(tree, 1, treeBytes, file) == treeBytes &&
+            fwrite(padding, 1, treePadding, file) == treePadding &&
+            (leafBytes == 0 || fwrite(blocks, 1, leafBytes, file) == leafBytes);
+  if (fclose(file) != 0 || !ok) {
+    imageError(path, "couldn't write the image");
+  }
+}
+
+const char * vebMapImage(const std::string& path, bool verifyChecksum,
+                         VebTreeImageHeader& header, size_t& length) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    imageError(path, strerror(errno));
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    imageError(path, strerror(errno));
+  }
+  length = info.st_size;
+  if (length < sizeof(header)) {
+    close(fd);
+    imageError(path, "too short to be an image");
+  }
+  void * mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    imageError(path, strerror(errno));
+  }
+  const char * base = (const char *) mapping;
+  memcpy(&header, base, sizeof(header));
+
+  const char * reason = nullptr;
+  uint64_t treeBytes = header.treeSlots * header.keySize;
+  if (memcmp(header.magic, "VEBTREE", 8) != 0) {
+    reason = "not a VebTree image";
+  } else if (header.byteOrder != kVebImageByteOrder) {
+    reason = "image was written with a different byte order";
+  } else if (header.version != kVebImageVersion) {
+    reason = "unsupported image version";
+  } else if (header.keySize == 0 || header.treeOffset % kImageAlignment != 0 ||
+             header.blocksOffset % kImageAlignment != 0 ||
+             header.treeOffset < sizeof(header) ||
+             header.treeOffset > length ||
+             treeBytes / header.keySize != header.treeSlots ||
+             treeBytes > length - header.treeOffset ||
+             header.blocksOffset > length ||
+             blocksBytes(header) > length - header.blocksOffset) {
+    reason = "image is truncated or its header is corrupt";
+  } else if (verifyChecksum) {
+    uint64_t checksum = imageChecksum(0, base + header.treeOffset, treeBytes);
+    checksum = imageChecksum(checksum, base + header.blocksOffset,
+                             blocksBytes(header));
+    if (checksum != header.checksum) {
+      reason = "checksum mismatch";
     }
-    int childAns;
-    if (containsHelper(key, indexOfChild, order -1, childAns)) {
-      // Found in the bottom tree, report which node we found it in
-
-      // We have topAns full bottom trees, and topAns nodes in the top struct
-      // that are less than this node.
-      int nodesBeforeThisBottomTree = topAns * (sizeOfChild + 1);
-      returnAnswer = nodesBeforeThisBottomTree + childAns;
-      return true;
-    } else {
-      // Not found, report which subtree (below our current bottom trees)
-      // the key would be in.
-      int subTreesFromOtherBottoms = (sizeOfChild + 1) * topAns;
-      int subTreesFromThisBottom = childAns;
-      returnAnswer = subTreesFromOtherBottoms + subTreesFromThisBottom;
-      return false;
+  }
+  if (reason != nullptr) {
+    munmap(mapping, length);
+    imageError(path, reason);
+  }
+  return base;
+}
+
+void vebUnmapImage(const char * mapping, size_t length) {
+  munmap((void *) mapping, length);
+}
+
+/* The writer lays the file out exactly as vebWriteImage does, with the
+ * header zeroed until finish. The read-back for the checksum goes in chunks
+ * that are a whole number of words, so the hash comes out the same as over
+ * the array in one piece.
+ */
+VebImageWriter::VebImageWriter(const std::string& path,
+                               const VebTreeImageHeader& header)
+    : path(path), header(header) {
+  memcpy(this->header.magic, "VEBTREE", 8);
+  this->header.version = kVebImageVersion;
+  this->header.byteOrder = kVebImageByteOrder;
+  this->header.treeOffset = roundUpToAlignment(sizeof(header));
+  this->header.blocksOffset = 0;
+  this->header.numBlocks = 0;
+  file = fopen(path.c_str(), "w+b");
+  if (file == nullptr) {
+    imageError(path, strerror(errno));
+  }
+  std::vector<char> zeroes(this->header.treeOffset);
+  uint64_t treeBytes = header.treeSlots * header.keySize;
+  if (fwrite(zeroes.data(), 1, zeroes.size(), file) != zeroes.size() ||
+      ftruncate(fileno(file), this->header.treeOffset + treeBytes) != 0) {
+    fclose(file);
+    imageError(path, "couldn't write the image");
+  }
+}
+
+VebImageWriter::~VebImageWriter() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+void VebImageWriter::write(uint64_t offset, const void * data, size_t bytes) {
+  if (fseeko(file, header.treeOffset + offset, SEEK_SET) != 0 ||
+      fwrite(data, 1, bytes, file) != bytes) {
+    imageError(path, "couldn't write the image");
+  }
+}
+
+void VebImageWriter::finish() {
+  const size_t kChunk = size_t(1) << 20;
+  std::vector<char> chunk(kChunk);
+  uint64_t treeBytes = header.treeSlots * header.keySize;
+  uint64_t checksum = 0;
+  bool ok = fflush(file) == 0 &&
+            fseeko(file, header.treeOffset, SEEK_SET) == 0;
+  for (uint64_t done = 0; ok && done < treeBytes; done += kChunk) {
+    size_t bytes = std::min<uint64_t>(kChunk, treeBytes - done);
+    ok = fread(chunk.data(), 1, bytes, file) == bytes;
+    checksum = imageChecksum(checksum, chunk.data(), bytes);
+  }
+  header.checksum = checksum;
+  ok = ok && fseeko(file, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, file) == 1;
+  int closed = fclose(file);
+  file = nullptr;
+  if (!ok || closed != 0) {
+    imageError(path, "couldn't write the image");
+  }
+}
+
+VebKeyFileReader::VebKeyFileReader(const std::string& path, size_t keySize)
+    : path(path), keySize(keySize) {
+  file = fopen(path.c_str(), "rb");
+  struct stat info;
+  if (file == nullptr || fstat(fileno(file), &info) != 0) {
+    if (file != nullptr) {
+      fclose(file);
     }
+    imageError(path, strerror(errno));
+  }
+  if (info.st_size % keySize != 0) {
+    fclose(file);
+    imageError(path, "not a whole number of keys");
+  }
+  numKeys = info.st_size / keySize;
+  setvbuf(file, nullptr, _IOFBF, size_t(1) << 20);
+}
+
+VebKeyFileReader::~VebKeyFileReader() {
+  fclose(file);
+}
+
+size_t VebKeyFileReader::read(void * out, size_t count) {
+  size_t keys = fread(out, keySize, count, file);
+  if (keys < count && ferror(file)) {
+    imageError(path, "couldn't read the keys");
   }
+  return keys;
 }
 
-bool VebTree::contains(int key) const {
-  
-  int dummy;
-  // The true indicates that this is the highest level tree, and so it
-  // has an unusual number of children that must be manually checked.
-  return containsHelper(key, 0, treeOrder, dummy, true);
+/* The compressed leaf block search. Offsets are packed a whole number to a
+ * word, so we can shift them out of each word in turn, and like the other
+ * block kernels this compares against every offset rather than stopping
+ * early.
+ */
+int vebSearchPacked(const VebPackedBlock& block, uint64_t target, bool& found) {
+  uint64_t mask = (uint64_t(1) << block.width) - 1;
+  int less = 0;
+  bool equal = false;
+  int i = 0;
+  for (int word = 0; i < block.count; word++) {
+    uint64_t bits = block.bits[word];
+    for (int j = 0; j < block.perWord && i < block.count; j++, i++) {
+      uint64_t offset = bits & mask;
+      bits >>= block.width;
+      less += offset < target;
+      equal |= offset == target;
+    }
+  }
+  found = equal;
+  return less;
 }
@@ -1,33 +1,2145 @@
 #ifndef VEB_TREE
 #define VEB_TREE
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <thread>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-//TODO: templatize the int keys
-// Keys and Values
+#include "tree-storage.h"
+
+// A helper type used to provide the key type along with compare and sentinel
+// functions, in the same spirit as cotree::cotree_params_tag. A user can
+// specify these functions by doing:
+//
+//   struct MyKeyParams : public VebTreeParamsTag {
+//       typedef MyKey key_type;
+//       static int compare(const MyKey& a, const MyKey& b) {
+//           return a.compare(b);
+//       }
+//       static MyKey sentinel() {
+//           return MyKey::max();
+//       }
+//   };
+//
+// The sentinel pads out the unused slots of the layout, so it must compare
+// greater than every key stored in the tree.
+struct VebTreeParamsTag {};
+
+// The default parameters, which compare keys with operator< and pad with
+// std::numeric_limits<Key>::max().
+template <typename Key, typename Enable = void>
+struct VebTreeParams : public VebTreeParamsTag {
+  typedef Key key_type;
+  static int compare(const Key& a, const Key& b) {
+    return (b < a) - (a < b);
+  }
+  static Key sentinel() {
+    return std::numeric_limits<Key>::max();
+  }
+};
+
+// Arithmetic keys are passed by value and compared directly, so the compiler
+// can turn the comparisons in the search loops into plain flag tests.
+template <typename Key>
+struct VebTreeParams<Key, typename std::enable_if<std::is_arithmetic<Key>::value>::type>
+    : public VebTreeParamsTag {
+  typedef Key key_type;
+  static int compare(Key a, Key b) {
+    return (a > b) - (a < b);
+  }
+  static Key sentinel() {
+    return std::numeric_limits<Key>::max();
+  }
+};
+
+// Pairs (e.g. (timestamp, id)) compare lexicographically and pad with the
+// pair of both maxima.
+template <typename First, typename Second>
+struct VebTreeParams<std::pair<First, Second> > : public VebTreeParamsTag {
+  typedef std::pair<First, Second> key_type;
+  static int compare(const key_type& a, const key_type& b) {
+    int comp = VebTreeParams<First>::compare(a.first, b.first);
+    return comp != 0 ? comp : VebTreeParams<Second>::compare(a.second, b.second);
+  }
+  static key_type sentinel() {
+    return key_type(VebTreeParams<First>::sentinel(),
+                    VebTreeParams<Second>::sentinel());
+  }
+};
+
+
+// How a VebTree arranges its keys in memory.
+enum VebLayout {
+  // Every key is a node of the vEB recursion, all the way down.
+  kPureVebLayout,
+  // The vEB recursion stops at subtrees that fill one cache line. Those leaf
+  // blocks are stored in sorted order, 64-byte aligned, and searched with
+  // SIMD compares where the key type and CPU allow it.
+  kBlockedVebLayout,
+  // Like the blocked layout, but each leaf block stores twice as many keys,
+  // frame-of-reference compressed (see VebPackedBlock). Only for integer keys
+  // under the default params, and only for membership and rank queries.
+  // Building one throws std::length_error if 2^32 or more of its leaf blocks
+  // don't compress.
+  kCompressedVebLayout
+};
+
+// Leaf block search kernels, implemented in vEB-tree.cc. Each takes a
+// 64-byte aligned block of keys in sorted order, returns how many of them
+// are less than key, and sets found if one of them is equal to key. They
+// pick AVX2, SSE2 or scalar code depending on what the CPU supports.
+int vebSearchBlock32(const int32_t * block, int32_t key, bool& found);
+int vebSearchBlock64(const int64_t * block, int64_t key, bool& found);
+
+// A leaf block of the compressed layout: one cache line holding up to 31
+// keys, each stored as its offset from the block's first key in width bits.
+// Offsets are packed low bits first, as many whole ones per 64-bit word as
+// fit, so no offset straddles two words. A block whose keys are too far
+// apart for that instead keeps them in the tree's overflow array, at index
+// overflow, and has width kVebOverflowWidth. The index is 32 bits to keep the
+// block to one cache line, so a tree can have at most 2^32 - 1 such blocks.
+struct alignas(64) VebPackedBlock {
+  uint64_t base;      // The first key, converted to uint64_t.
+  uint8_t width;
+  uint8_t count;      // The number of keys in the block.
+  uint8_t perWord;    // The number of offsets packed into each word.
+  uint8_t unused;
+  uint32_t overflow;
+  uint64_t bits[6];
+};
+
+const uint8_t kVebOverflowWidth = 0xFF;
+
+// Returns the number of offsets in the packed block that are less than
+// target, and sets found if one is equal to it. Implemented in vEB-tree.cc.
+int vebSearchPacked(const VebPackedBlock& block, uint64_t target, bool& found);
+
+// The B, T and D tables (see VebTree::BTD) of a tree of the given height, up
+// to 64. They only depend on the height, so every tree shares the one table
+// per height, built the first time any tree asks. Implemented in vEB-tree.cc.
+const size_t * vebBTDTable(int height);
+
+// The header at the start of an on-disk VebTree image (see VebTree::save).
+// It is followed by the vEB array at treeOffset and, for the blocked layout,
+// the leaf blocks at blocksOffset (otherwise 0), which ends the file. Both
+// offsets are multiples of 64. Every
+// field is in the writer's native byte order.
+struct VebTreeImageHeader {
+  char magic[8];         // "VEBTREE" and a NUL.
+  uint32_t version;      // kVebImageVersion.
+  uint32_t byteOrder;    // kVebImageByteOrder, as the writer stored it.
+  uint32_t keyType;      // 'i', 'u' or 'f' for arithmetic keys, else 'r'.
+  uint32_t keySize;      // sizeof(Key).
+  uint32_t layout;       // A VebLayout.
+  uint32_t blockSlots;   // Key slots per leaf block, if blocked.
+  int32_t treeHeight;    // The order (height) of the vEB array's tree.
+  int32_t topHeight;     // The height of its outermost top tree.
+  uint64_t numKeys;
+  uint64_t numSegments;  // Outermost bottom trees stored.
+  uint64_t treeSlots;    // Keys in the vEB array, padding included.
+  uint64_t numBlocks;
+  uint64_t treeOffset;
+  uint64_t blocksOffset;
+  uint64_t checksum;     // Of the vEB array followed by the blocks.
+};
+
+const uint32_t kVebImageVersion = 1;
+const uint32_t kVebImageByteOrder = 0x01020304;
+
+// Image file helpers, implemented in vEB-tree.cc. vebWriteImage fills in the
+// magic, version, byte order, offsets and checksum of header and writes the
+// image, throwing std::runtime_error if it can't. vebMapImage maps an image
+// read-only, checks everything in the header that doesn't depend on the key
+// type (and the checksum, if asked to), and returns the start of the mapping
+// and its length; it also throws std::runtime_error on failure.
+void vebWriteImage(const std::string& path, VebTreeImageHeader& header,
+                   const void * tree, const void * blocks);
+const char * vebMapImage(const std::string& path, bool verifyChecksum,
+                         VebTreeImageHeader& header, size_t& length);
+void vebUnmapImage(const char * mapping, size_t length);
+
+// Writes the image of a pure layout a piece at a time, for images built
+// without the whole tree in memory (see VebTree::build_image). header holds
+// the tree's shape, as for vebWriteImage. Pieces of the vEB array can be
+// written in any order; finish then reads the array back to checksum it and
+// writes the header. Implemented in vEB-tree.cc, and throws
+// std::runtime_error on failure.
+class VebImageWriter {
+public:
+  VebImageWriter(const std::string& path, const VebTreeImageHeader& header);
+  ~VebImageWriter();
+
+  // Writes bytes of data at the given byte offset into the vEB array.
+  void write(uint64_t offset, const void * data, size_t bytes);
+  void finish();
+
+private:
+  VebImageWriter(const VebImageWriter&) = delete;
+  void operator=(const VebImageWriter&) = delete;
+
+  std::string path;
+  VebTreeImageHeader header;
+  FILE * file;
+};
+
+// Reads a file of raw keys of keySize bytes apiece from front to back.
+// Implemented in vEB-tree.cc, and throws std::runtime_error on failure.
+class VebKeyFileReader {
+public:
+  VebKeyFileReader(const std::string& path, size_t keySize);
+  ~VebKeyFileReader();
+
+  // The number of keys in the file.
+  uint64_t size() const { return numKeys; }
+  // Reads the next count keys (or as many as are left) into out, returning
+  // how many were read.
+  size_t read(void * out, size_t count);
+
+private:
+  VebKeyFileReader(const VebKeyFileReader&) = delete;
+  void operator=(const VebKeyFileReader&) = delete;
+
+  std::string path;
+  size_t keySize;
+  uint64_t numKeys;
+  FILE * file;
+};
+
+template <typename Key, int Order, typename Params>
+class StaticVebTree;
+template <typename Key, typename Params>
+class WeightedVebTree;
+
+// A static set of keys stored in the van Emde Boas layout.
+//
+// The keys are the in-order sequence of a perfect binary search tree of the
+// smallest height that holds them, padded at the end with Params::sentinel().
+// That tree is split into a top tree of ceil(height / 2) levels and bottom
+// trees of the remaining levels, each laid out the same way recursively, just
+// like cotree. Bottom trees that would only hold padding aren't stored, so
+// the padding never takes more than about one bottom tree.
+//
+// A pure tree of no more keys than fit in kInlineBytes (16 int keys, say)
+// skips the layout altogether, like cotree's small sets: the keys are kept
+// sorted inside the object, padded with the sentinel, and searched with the
+// leaf block kernels, with treeHeight set to 0. A small set then costs no
+// allocations, and a lookup is one scan of one cache line.
+template <typename Key, typename Params = VebTreeParams<Key> >
 class VebTree {
 public:
-  VebTree(std::vector<int> keys);
+  typedef Key key_type;
+
+  // Builds a tree from keys in sorted order, in O(n) time and without any
+  // allocations beyond the layout itself. Bottom trees are filled in on up
+  // to threads threads (0 means one per hardware thread); small trees are
+  // always built on the calling thread. The layout (and the leaf blocks) are
+  // allocated according to storage.
+  VebTree(const key_type * keys, size_t n,
+          VebLayout layout = kPureVebLayout, unsigned threads = 0,
+          StoragePolicy storage = StoragePolicy());
+  VebTree(const std::vector<key_type>& keys,
+          VebLayout layout = kPureVebLayout, unsigned threads = 0,
+          StoragePolicy storage = StoragePolicy());
+  VebTree(VebTree&& other);
+  VebTree& operator=(VebTree&& other);
+  ~VebTree();
+
+  bool contains(const key_type& key) const;
+  // Also sets rank to the number of keys in the tree less than key, which is
+  // key's index in sorted order if it is present.
+  bool contains(const key_type& key, size_t& rank) const;
+  // The original doubly-recursive lookup, kept around for comparison.
+  bool containsRecursive(const key_type& key) const;
+  // Looks up n keys at once, setting out[i] to whether keys[i] is present,
+  // and ranks[i] to its rank (as above) if ranks isn't nullptr. Searches are
+  // interleaved so that their cache misses overlap.
+  void contains_batch(const key_type * keys, size_t n, bool * out,
+                      size_t * ranks = nullptr) const;
+  // The same for keys in sorted (non-decreasing) order, sharing the work of
+  // the searches: every node on any key's search path is visited once, and
+  // splits the keys that reach it between its children, so a batch that
+  // covers much of the tree costs about as much as merging it with the
+  // tree's keys. The answers are meaningless if keys isn't sorted.
+  void contains_sorted_batch(const key_type * keys, size_t n, bool * out,
+                             size_t * ranks = nullptr) const;
+
+  // Ordered queries. Each returns a pointer to the matching key inside the
+  // layout, or nullptr if there is no such key. Only the pure layout supports
+  // them:
+  //   predecessor: the largest key strictly less than key.
+  //   successor:   the smallest key strictly greater than key.
+  //   lower_bound: the smallest key greater than or equal to key.
+  //   upper_bound: the smallest key strictly greater than key.
+  const key_type * predecessor(const key_type& key) const;
+  const key_type * successor(const key_type& key) const;
+  const key_type * lower_bound(const key_type& key) const;
+  const key_type * upper_bound(const key_type& key) const;
+
+  // Order statistics. rank and count_range work for every layout; select
+  // doesn't work for the compressed one.
+  //   rank:        the number of keys less than key.
+  //   select:      the key with rank i, or nullptr if i >= size().
+  //   count_range: the number of keys in [a, b].
+  size_t rank(const key_type& key) const;
+  const key_type * select(size_t i) const;
+  size_t count_range(const key_type& a, const key_type& b) const;
 
-  //should return value later
-  bool contains(int key) const;
-  int getPredecessor(int key);
+  class const_iterator;
+  // Iterators over the keys in sorted order, for the pure and blocked
+  // layouts. They walk the layout directly, so stepping to a neighbouring key
+  // takes amortized constant time, but each one carries the positions of a
+  // whole root path and is a few hundred bytes.
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, numKeys); }
+  // An iterator at the key with the given rank, e.g. iterator_at(rank(lo)).
+  const_iterator iterator_at(size_t rank) const {
+    return const_iterator(this, rank);
+  }
+  // Calls fn(key) on every key in [lo, hi], in sorted order (again for the
+  // pure and blocked layouts). This is faster than going through iterators,
+  // since it knows where it will stop.
+  template <typename Function>
+  void for_each_in_range(const key_type& lo, const key_type& hi,
+                         Function fn) const;
+
+  // Builds a table indexed by the top bits of integer keys, 2^bits entries
+  // (or fewer if the keys span fewer values), that sends contains and rank
+  // straight to the outermost bottom tree a key's search continues in,
+  // skipping the outermost top tree, which is about half the levels. Keys in
+  // a part of the key range that straddles a node of the top tree take the
+  // full walk, so the more evenly spread the keys are, the more of them it
+  // helps. bits of 0 drops the table, and bits over 63 count as 63. Only for
+  // the pure and blocked layouts with integer keys and default params;
+  // throws std::invalid_argument otherwise. Batched lookups and ordered
+  // queries don't use it.
+  void build_jump_table(int bits);
+
+  // The number of keys in the tree.
+  size_t size() const { return numKeys; }
+  // The number of bytes the tree takes up, not counting the object itself
+  // (so a tree stored inline takes up none).
+  size_t memory_bytes() const;
+
+  // The room for the keys of a small tree.
+  static const size_t kInlineBytes = 64;
+
+  // Writes the tree to path as an image that open_mapped can load. Keys are
+  // written as raw bytes, so they have to be trivially copyable, and the
+  // image must be opened with the same Params.
+  void save(const std::string& path) const;
+  // Maps an image written by save read-only and uses it in place, so no
+  // construction happens and every process that maps the same file shares a
+  // single page-cache copy. The header is always checked against this key
+  // type; checking the checksum reads the whole file, so it's optional.
+  // Throws std::runtime_error if the image can't be used.
+  static VebTree open_mapped(const std::string& path,
+                             bool verifyChecksum = false);
+  // Builds the image save would write for a pure tree of the keys in
+  // keysPath, which holds raw key_type values in strictly increasing order,
+  // without ever loading the keys: only one outermost bottom tree and the
+  // outermost top tree are in memory at a time, a few times the square root
+  // of the key count. The keys are read once, each bottom tree is written as
+  // soon as its keys are in, and the top tree goes in last; then the image
+  // is read back once for the checksum. Bottom trees are laid out on up to
+  // threads threads, as in the constructor. Throws std::runtime_error if a
+  // file can't be read or written, or the keys are out of order.
+  static void build_image(const std::string& keysPath,
+                          const std::string& imagePath,
+                          unsigned threads = 0);
 
 private:
-  void recursivelyPlace(std::vector<int>& sortedInput,
-                        int inputMinIndex,
-                        int * tree,
-                        int treeMinIndex,
-                        int length);
+  // These share the key comparisons (and StaticVebTree the image format).
+  template <typename, int, typename> friend class StaticVebTree;
+  template <typename, typename> friend class WeightedVebTree;
+
+  VebTree();
+  VebTree(const VebTree&) = delete;
+  void operator=(const VebTree&) = delete;
+
+  // The tallest tree we support. Paths are kept in a uint64_t with a leading
+  // one bit, so this leaves room for 2^62 keys.
+  static const int kMaxHeight = 62;
+
+  // Arithmetic keys under the default params are compared directly; anything
+  // else goes through a single call to Params::compare.
+  typedef std::integral_constant<bool,
+      std::is_arithmetic<Key>::value &&
+      std::is_same<Params, VebTreeParams<Key> >::value> directCompare;
+
+  // Sets equal and greater according to how a compares to b.
+  static void compareKeys(const key_type& a, const key_type& b,
+                          bool& equal, bool& greater) {
+    compareKeys(a, b, equal, greater, directCompare());
+  }
+  static void compareKeys(const key_type& a, const key_type& b,
+                          bool& equal, bool& greater, std::true_type) {
+    equal = a == b;
+    greater = a > b;
+  }
+  static void compareKeys(const key_type& a, const key_type& b,
+                          bool& equal, bool& greater, std::false_type) {
+    int comp = Params::compare(a, b);
+    equal = comp == 0;
+    greater = comp > 0;
+  }
+
+  // The number of key slots in a leaf block of the blocked layout: as many as
+  // fit in a cache line, rounded down to a power of two. The last slot of each
+  // block is always padding, so a block holds a perfect subtree.
+  static const int kBlockSlots =
+      sizeof(Key) <= 4 ? 16 : sizeof(Key) <= 8 ? 8 : sizeof(Key) <= 16 ? 4 : 2;
+
+  // Which of the SIMD block kernels, if any, applies to this key type.
+  typedef std::integral_constant<int,
+      !(std::is_integral<Key>::value && std::is_signed<Key>::value &&
+        std::is_same<Params, VebTreeParams<Key> >::value) ? 0 :
+      sizeof(Key) == 4 ? 32 : sizeof(Key) == 8 ? 64 : 0> blockKernel;
+
+  // Returns the number of keys in the leaf block that are less than key and
+  // sets found if one of them is equal to it.
+  static int searchBlock(const key_type * block, const key_type& key,
+                         bool& found) {
+    return searchBlock(block, key, found, blockKernel());
+  }
+  static int searchBlock(const key_type * block, const key_type& key,
+                         bool& found, std::integral_constant<int, 32>) {
+    return vebSearchBlock32((const int32_t *) block, key, found);
+  }
+  static int searchBlock(const key_type * block, const key_type& key,
+                         bool& found, std::integral_constant<int, 64>) {
+    return vebSearchBlock64((const int64_t *) block, key, found);
+  }
+  static int searchBlock(const key_type * block, const key_type& key,
+                         bool& found, std::integral_constant<int, 0>) {
+    int less = 0;
+    found = false;
+    for (int i = 0; i < kBlockSlots; i++) {
+      bool equal, greater;
+      compareKeys(key, block[i], equal, greater);
+      found |= equal;
+      less += greater;
+    }
+    return less;
+  }
+
+  // The key type code stored in image headers.
+  static uint32_t keyTypeCode() {
+    return std::is_floating_point<Key>::value ? 'f' :
+           !std::is_integral<Key>::value ? 'r' :
+           std::is_signed<Key>::value ? 'i' : 'u';
+  }
+
+  key_type * allocateKeys(size_t count) const;
+  void freeKeys(key_type * keys, size_t count) const;
+
+  static const size_t kInlineSlots = kInlineBytes / sizeof(key_type);
+  key_type * inlineKeys() {
+    return reinterpret_cast<key_type *>(&inlineStorage);
+  }
+  bool isInline() const {
+    return kInlineSlots > 0 &&
+        tree == reinterpret_cast<const key_type *>(&inlineStorage);
+  }
+  void takeInline(VebTree& other);
+  // Returns the number of inline keys less than key and sets found if one of
+  // them is equal to it. The inline slots make up exactly one leaf block for
+  // keys of up to 16 bytes, so the block kernels do the scan; the padding
+  // compares greater than any key but the sentinel, which isn't stored.
+  size_t searchInline(const key_type& key, bool& found) const {
+    if (kInlineSlots == size_t(kBlockSlots)) {
+      size_t less = searchBlock(tree, key, found);
+      found = found && less < numKeys;
+      return less;
+    }
+    size_t less = 0;
+    found = false;
+    for (size_t i = 0; i < numKeys; i++) {
+      bool equal, greater;
+      compareKeys(key, tree[i], equal, greater);
+      found |= equal;
+      less += greater;
+    }
+    return less;
+  }
+  void buildPure(const key_type * keys, unsigned threads);
+  // The compressed layout packs twice as many keys into each leaf block.
+  static const int kPackedSlots = 2 * kBlockSlots;
+  static const int kPackedWords = 6;
+
+  // Integer keys under the default params can be compressed.
+  typedef std::integral_constant<bool,
+      std::is_integral<Key>::value && sizeof(Key) <= 8 &&
+      std::is_same<Params, VebTreeParams<Key> >::value> compressible;
+
+  // The number of key slots per leaf block (the last standing for the
+  // separator after the block), for the layouts that have leaf blocks.
+  size_t leafSlots() const {
+    return layout == kCompressedVebLayout ? kPackedSlots : kBlockSlots;
+  }
+  const void * leafAddress(size_t block) const {
+    return layout == kCompressedVebLayout ? (const void *) &packed[block]
+                                          : (const void *) &blocks[block * kBlockSlots];
+  }
+  int searchLeaf(size_t block, const key_type& key, bool& found) const {
+    if (layout == kCompressedVebLayout) {
+      return searchPacked(block, key, found, compressible());
+    }
+    return searchBlock(blocks + block * kBlockSlots, key, found);
+  }
+  int searchPacked(size_t block, const key_type& key, bool& found,
+                   std::true_type) const;
+  int searchPacked(size_t, const key_type&, bool&, std::false_type) const {
+    assert(false);
+    return 0;
+  }
+  template <typename KeyAt>
+  void buildPacked(KeyAt keyAt, unsigned threads, std::true_type);
+  template <typename KeyAt>
+  void buildPacked(KeyAt, unsigned, std::false_type) {
+    assert(false);
+  }
 
-  bool containsHelper(int key, int index, int order, int& answer, bool isParent=false) const;
+  void release();
+  void setHeight(int height, size_t storedKeys);
+  size_t layoutSize() const;
 
+  // Returns the position of the node at depth + 1 along path, given the
+  // positions of its ancestors.
+  size_t childPosition(const size_t * pos, int depth, uint64_t path) const {
+    const size_t * btd = BTD + 3 * (depth + 1);
+    return pos[btd[2]] + btd[1] + (path & btd[1]) * btd[0];
+  }
+  // The same, for the roots of the outermost bottom trees, where we also
+  // have to stay within the bottom trees that are stored.
+  size_t segmentPosition(uint64_t path) const {
+    const size_t * btd = BTD + 3 * (topHeight + 1);
+    return btd[1] + std::min<uint64_t>(path & btd[1], numSegments - 1) * btd[0];
+  }
 
-  int findSubtree(int key, int index, int order); 
-  int * tree;
-  int treeOrder;
-  int numSegments;
+  template <typename Visit>
+  uint64_t walk(Visit visit) const;
+  template <typename Visit>
+  uint64_t walkSegment(Visit visit, uint64_t path) const;
+  template <typename Visit>
+  uint64_t walkKey(const key_type& key, Visit visit) const;
+
+  // Integer keys under the default params can have a jump table.
+  typedef std::integral_constant<bool,
+      std::is_integral<Key>::value && sizeof(Key) <= 8 &&
+      std::is_same<Params, VebTreeParams<Key> >::value> jumpable;
+
+  void buildJumpTable(int bits, std::true_type);
+  void buildJumpTable(int bits, std::false_type);
+  // Sets path to the path out of the outermost top tree for key, if the jump
+  // table knows it.
+  bool jumpPath(const key_type& key, uint64_t& path, std::true_type) const {
+    if (key < jumpMin || key > jumpMax) {
+      return false;
+    }
+    uint32_t entry = jumpTable[(uint64_t(key) - uint64_t(jumpMin)) >> jumpShift];
+    path = (uint64_t(1) << topHeight) + entry - 1;
+    return entry != 0;
+  }
+  bool jumpPath(const key_type&, uint64_t&, std::false_type) const {
+    return false;
+  }
+
+  // A node of the vEB array, along with the positions of all its ancestors,
+  // for stepping through the nodes in order. index is the node's in-order
+  // index, or -1 if the cursor hasn't been placed yet.
+  struct Cursor {
+    int64_t index;
+    uint64_t path;
+    int depth;
+    size_t pos[kMaxHeight + 2];
+  };
+  size_t stepPosition(const Cursor& cursor) const {
+    return cursor.depth == topHeight ? segmentPosition(cursor.path)
+                                     : childPosition(cursor.pos, cursor.depth,
+                                                     cursor.path);
+  }
+  void seekCursor(Cursor& cursor, uint64_t index) const;
+  void advanceCursor(Cursor& cursor) const;
+  void retreatCursor(Cursor& cursor) const;
+  void moveCursor(Cursor& cursor, uint64_t index) const;
+
+  template <typename Function>
+  static void parallelFor(size_t n, size_t minChunk, unsigned threads,
+                          Function function);
+  template <typename ValueAt>
+  void placeInOrder(key_type * out, ValueAt valueAt, unsigned threads) const;
+  template <typename ValueAt>
+  void placeSubtree(key_type * out, int rootDepth, int bottomDepth,
+                    uint64_t rootPath, size_t rootPosition,
+                    ValueAt valueAt) const;
+  void buildBlocked(const key_type * keys, unsigned threads);
+
+  void sortedBatchNode(const key_type * keys, size_t lo, size_t hi,
+                       int depth, uint64_t path, size_t * pos, bool * out,
+                       size_t * ranks) const;
+  void sortedBatchLeaf(const key_type * keys, size_t lo, size_t hi,
+                       uint64_t path, bool * out, size_t * ranks) const;
+
+  bool containsHelper(const key_type& key, size_t index, int height,
+                      uint64_t& answer, bool isParent=false) const;
+
+  void boundSearch(const key_type& key, bool rightOnEqual,
+                   int64_t& lastLeft, int64_t& lastRight) const;
+  const key_type * keyAt(int64_t position) const;
+
+  key_type * tree;
+  // The number of keys in the tree, not counting padding.
+  size_t numKeys;
+  // The height of the perfect tree, and of the outermost top tree.
+  int treeHeight;
+  int topHeight;
+  // The number of outermost bottom trees that are actually stored.
+  size_t numSegments;
+  // The B, T, and D arrays from brodal2002cache, indexed by 1-based depth.
+  // For a node at depth d that is the root of a bottom tree, BTD[3d] is the
+  // size of that bottom tree, BTD[3d + 1] is the size of the top tree above
+  // it, and BTD[3d + 2] is the depth of that top tree's root. Shared with
+  // every other tree of the same height (see vebBTDTable).
+  const size_t * BTD;
+  VebLayout layout;
+  // The blocked layout only: treeHeight is then the height of the tree above
+  // the leaf blocks, which are stored here, kBlockSlots keys apiece.
+  key_type * blocks;
+  size_t numBlocks;
+  // The compressed layout only: its leaf blocks (numBlocks of them), and the
+  // keys of the blocks that didn't compress, kPackedSlots - 1 per block.
+  VebPackedBlock * packed;
+  key_type * overflow;
+  size_t numOverflow;
+  // The jump table, if build_jump_table made one, and the range of keys it
+  // covers: bucket i holds the keys whose offset from jumpMin is i after
+  // shifting right by jumpShift.
+  std::vector<uint32_t> jumpTable;
+  key_type jumpMin;
+  key_type jumpMax;
+  int jumpShift;
+  // For trees from open_mapped, the image that tree and blocks point into.
+  const char * mapping;
+  size_t mappingLength;
+  // How tree and blocks were allocated otherwise.
+  StoragePolicy storage;
+  // Where tree points for a small tree: its keys in sorted order, then
+  // padding up to kInlineSlots.
+  typename std::aligned_storage<kInlineSlots ? kInlineSlots * sizeof(Key) : 1,
+                                alignof(Key)>::type inlineStorage;
 }; 
 
+/* A bidirectional iterator over a VebTree's keys in sorted order. It keeps
+ * the rank of its key and a Cursor into the vEB array, which it moves along
+ * whenever it reaches a key stored there. In the blocked layout, that's only
+ * for the separators: keys inside a leaf block are read straight from the
+ * block by rank.
+ */
+template <typename Key, typename Params>
+class VebTree<Key, Params>::const_iterator {
+public:
+  typedef std::bidirectional_iterator_tag iterator_category;
+  typedef Key value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const Key * pointer;
+  typedef const Key& reference;
+
+  const_iterator() : owner(nullptr), rank(0), key(nullptr) {}
+
+  reference operator*() const { return *key; }
+  pointer operator->() const { return key; }
+
+  const_iterator& operator++() {
+    rank++;
+    settle();
+    return *this;
+  }
+  const_iterator operator++(int) {
+    const_iterator old = *this;
+    ++*this;
+    return old;
+  }
+  const_iterator& operator--() {
+    rank--;
+    settle();
+    return *this;
+  }
+  const_iterator operator--(int) {
+    const_iterator old = *this;
+    --*this;
+    return old;
+  }
+
+  bool operator==(const const_iterator& other) const {
+    return rank == other.rank;
+  }
+  bool operator!=(const const_iterator& other) const {
+    return rank != other.rank;
+  }
+
+private:
+  friend class VebTree;
+
+  const_iterator(const VebTree * owner, size_t rank)
+      : owner(owner), rank(rank) {
+    assert(owner->layout != kCompressedVebLayout);
+    cursor.index = -1;
+    settle();
+  }
+
+  // Points key at the key with the current rank, if there is one.
+  void settle() {
+    if (rank >= owner->numKeys) {
+      key = nullptr;
+      return;
+    }
+    if (owner->treeHeight == 0) {
+      key = &owner->tree[rank];
+      return;
+    }
+    uint64_t index = rank;
+    if (owner->layout == kBlockedVebLayout) {
+      if (rank % kBlockSlots != size_t(kBlockSlots - 1)) {
+        key = &owner->blocks[rank];
+        return;
+      }
+      index = rank / kBlockSlots;
+    }
+    owner->moveCursor(cursor, index);
+    key = &owner->tree[cursor.pos[cursor.depth]];
+  }
+
+  const VebTree * owner;
+  size_t rank;
+  const Key * key;
+  Cursor cursor;
+};
+
+template <typename Key, typename Params>
+VebTree<Key, Params>::VebTree(const std::vector<key_type>& keys,
+                              VebLayout layout, unsigned threads,
+                              StoragePolicy storage)
+    : VebTree(keys.data(), keys.size(), layout, threads, storage) {}
+
+template <typename Key, typename Params>
+VebTree<Key, Params>::VebTree(const key_type * keys, size_t n,
+                              VebLayout layout, unsigned threads,
+                              StoragePolicy storage)
+    : tree(nullptr), numKeys(n), BTD(nullptr), layout(layout),
+      blocks(nullptr), numBlocks(0), packed(nullptr), overflow(nullptr),
+      numOverflow(0), jumpMin(), jumpMax(), jumpShift(0), mapping(nullptr), mappingLength(0),
+      storage(storage) {
+  // Checked before anything is allocated, since the destructor won't run.
+  if (layout == kCompressedVebLayout && !compressible::value) {
+    throw std::invalid_argument(
+        "the compressed layout needs integer keys and default params");
+  }
+  if (layout != kPureVebLayout) {
+    buildBlocked(keys, threads);
+    return;
+  }
+  if (kInlineSlots > 0 && n <= kInlineSlots) {
+    treeHeight = 0;
+    topHeight = 0;
+    numSegments = 0;
+    tree = inlineKeys();
+    for (size_t i = 0; i < kInlineSlots; i++) {
+      new (&tree[i]) key_type(i < n ? keys[i] : Params::sentinel());
+    }
+    return;
+  }
+  buildPure(keys, threads);
+}
+
+// Lays the numKeys keys out in the pure layout, on the heap.
+template <typename Key, typename Params>
+void VebTree<Key, Params>::buildPure(const key_type * keys, unsigned threads) {
+  int height = 1;
+  while (height < kMaxHeight && (uint64_t(1) << height) - 1 < numKeys) {
+    height++;
+  }
+  setHeight(height, numKeys);
+  tree = allocateKeys(layoutSize());
+  size_t n = numKeys;
+  placeInOrder(tree, [=](uint64_t i) {
+    return i < n ? keys[i] : Params::sentinel();
+  }, threads);
+}
+
+template <typename Key, typename Params>
+VebTree<Key, Params>::VebTree()
+    : tree(nullptr), numKeys(0), BTD(nullptr), layout(kPureVebLayout),
+      blocks(nullptr), numBlocks(0), packed(nullptr), overflow(nullptr),
+      numOverflow(0), jumpMin(), jumpMax(), jumpShift(0), mapping(nullptr), mappingLength(0) {}
+
+template <typename Key, typename Params>
+VebTree<Key, Params>::VebTree(VebTree&& other)
+    : tree(other.tree), numKeys(other.numKeys),
+      treeHeight(other.treeHeight), topHeight(other.topHeight),
+      numSegments(other.numSegments), BTD(other.BTD), layout(other.layout),
+      blocks(other.blocks), numBlocks(other.numBlocks),
+      packed(other.packed), overflow(other.overflow),
+      numOverflow(other.numOverflow),
+      jumpTable(std::move(other.jumpTable)), jumpMin(other.jumpMin),
+      jumpMax(other.jumpMax), jumpShift(other.jumpShift),
+      mapping(other.mapping), mappingLength(other.mappingLength),
+      storage(other.storage) {
+  takeInline(other);
+  other.tree = nullptr;
+  other.BTD = nullptr;
+  other.blocks = nullptr;
+  other.numBlocks = 0;
+  other.packed = nullptr;
+  other.overflow = nullptr;
+  other.numOverflow = 0;
+  other.mapping = nullptr;
+}
+
+template <typename Key, typename Params>
+VebTree<Key, Params>& VebTree<Key, Params>::operator=(VebTree&& other) {
+  if (this != &other) {
+    release();
+    tree = other.tree;
+    numKeys = other.numKeys;
+    treeHeight = other.treeHeight;
+    topHeight = other.topHeight;
+    numSegments = other.numSegments;
+    BTD = other.BTD;
+    layout = other.layout;
+    blocks = other.blocks;
+    numBlocks = other.numBlocks;
+    packed = other.packed;
+    overflow = other.overflow;
+    numOverflow = other.numOverflow;
+    jumpTable = std::move(other.jumpTable);
+    jumpMin = other.jumpMin;
+    jumpMax = other.jumpMax;
+    jumpShift = other.jumpShift;
+    mapping = other.mapping;
+    mappingLength = other.mappingLength;
+    storage = other.storage;
+    takeInline(other);
+    other.tree = nullptr;
+    other.BTD = nullptr;
+    other.blocks = nullptr;
+    other.numBlocks = 0;
+    other.packed = nullptr;
+    other.overflow = nullptr;
+    other.numOverflow = 0;
+    other.mapping = nullptr;
+  }
+  return *this;
+}
+
+template <typename Key, typename Params>
+VebTree<Key, Params>::~VebTree() {
+  release();
+}
+
+// If other's keys are inline, moves them into our own inline storage, which
+// tree (copied from other's) has to point at instead.
+template <typename Key, typename Params>
+void VebTree<Key, Params>::takeInline(VebTree& other) {
+  if (!other.isInline()) {
+    return;
+  }
+  size_t slots = layoutSize();
+  key_type * from = other.tree;
+  tree = inlineKeys();
+  for (size_t i = 0; i < slots; i++) {
+    new (&tree[i]) key_type(std::move(from[i]));
+    from[i].~key_type();
+  }
+}
+
+// Allocates room for count keys according to the storage policy and
+// default-initializes them, which costs nothing for arithmetic keys.
+template <typename Key, typename Params>
+Key * VebTree<Key, Params>::allocateKeys(size_t count) const {
+  key_type * keys = (key_type *) allocateStorage(count * sizeof(key_type),
+                                                 storage);
+  for (size_t i = 0; i < count; i++) {
+    new (&keys[i]) key_type;
+  }
+  return keys;
+}
+
+template <typename Key, typename Params>
+void VebTree<Key, Params>::freeKeys(key_type * keys, size_t count) const {
+  for (size_t i = 0; i < count; i++) {
+    keys[i].~key_type();
+  }
+  freeStorage(keys, count * sizeof(key_type), storage);
+}
+
+// Frees everything the tree owns. A mapped tree owns the mapping instead of
+// the keys.
+template <typename Key, typename Params>
+void VebTree<Key, Params>::release() {
+  if (mapping != nullptr) {
+    vebUnmapImage(mapping, mappingLength);
+  } else if (isInline()) {
+    size_t slots = layoutSize();
+    for (size_t i = 0; i < slots; i++) {
+      tree[i].~key_type();
+    }
+  } else if (tree != nullptr) {
+    freeKeys(tree, layoutSize());
+    if (layout == kCompressedVebLayout) {
+      freeStorage(packed, numBlocks * sizeof(VebPackedBlock), storage);
+      freeKeys(overflow, numOverflow * (kPackedSlots - 1));
+    } else {
+      freeKeys(blocks, numBlocks * kBlockSlots);
+    }
+  }
+}
+
+/* Sets up a tree of the given height whose in-order sequence has storedKeys
+ * keys before the padding starts, and works out how many of the outermost
+ * bottom trees have to be stored.
+ *
+ * Bottom tree b is followed (in order) by separator b of the top tree, which
+ * has in-order index (b + 1) * (B + 1) - 1. A search for a real key never
+ * continues past the first separator that is padding, which is separator
+ * storedKeys / (B + 1), so that's the last bottom tree we need.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::setHeight(int height, size_t storedKeys) {
+  assert(height >= 1 && height <= kMaxHeight);
+  treeHeight = height;
+  topHeight = height == 1 ? 1 : (height + 1) / 2;
+  BTD = vebBTDTable(height);
+  numSegments = 0;
+  if (treeHeight > topHeight) {
+    const size_t * btd = BTD + 3 * (topHeight + 1);
+    numSegments = std::min<size_t>(btd[1] + 1, storedKeys / (btd[0] + 1) + 1);
+  }
+}
+
+// The number of keys in the vEB array (or inline), padding included.
+template <typename Key, typename Params>
+size_t VebTree<Key, Params>::layoutSize() const {
+  if (treeHeight == 0) {
+    return kInlineSlots;
+  }
+  if (layout != kPureVebLayout) {
+    return (size_t(1) << treeHeight) - 1;
+  }
+  if (treeHeight == topHeight) {
+    return 1;
+  }
+  const size_t * btd = BTD + 3 * (topHeight + 1);
+  return btd[1] + numSegments * btd[0];
+}
+
+template <typename Key, typename Params>
+size_t VebTree<Key, Params>::memory_bytes() const {
+  size_t bytes = isInline() ? 0 : layoutSize() * sizeof(key_type);
+  bytes += jumpTable.size() * sizeof(uint32_t);
+  if (layout == kCompressedVebLayout) {
+    return bytes + numBlocks * sizeof(VebPackedBlock) +
+           numOverflow * (kPackedSlots - 1) * sizeof(key_type);
+  }
+  return bytes + numBlocks * kBlockSlots * sizeof(key_type);
+}
+
+template <typename Key, typename Params>
+void VebTree<Key, Params>::save(const std::string& path) const {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "only trivially copyable keys can be saved");
+  if (layout == kCompressedVebLayout) {
+    throw std::runtime_error(path + ": compressed trees can't be saved");
+  }
+  if (treeHeight == 0) {
+    // Images always hold the layout.
+    VebTree laidOut;
+    laidOut.numKeys = numKeys;
+    laidOut.buildPure(tree, 1);
+    laidOut.save(path);
+    return;
+  }
+  VebTreeImageHeader header = VebTreeImageHeader();
+  header.keyType = keyTypeCode();
+  header.keySize = sizeof(key_type);
+  header.layout = layout;
+  header.blockSlots = layout == kBlockedVebLayout ? kBlockSlots : 0;
+  header.treeHeight = treeHeight;
+  header.topHeight = topHeight;
+  header.numKeys = numKeys;
+  header.numSegments = numSegments;
+  header.treeSlots = layoutSize();
+  header.numBlocks = numBlocks;
+  vebWriteImage(path, header, tree, blocks);
+}
+
+/* The header has already been checked for everything but the key type and
+ * the shape of the tree, so this checks those, working the shape out again
+ * from the key count exactly as the constructor would. BTD isn't stored;
+ * it's the shared table for the height. The pure layout may
+ * be taller than the constructor would have made it, as StaticVebTree's
+ * images are; the search doesn't care.
+ */
+template <typename Key, typename Params>
+VebTree<Key, Params> VebTree<Key, Params>::open_mapped(const std::string& path,
+                                                       bool verifyChecksum) {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "only trivially copyable keys can be mapped");
+  VebTreeImageHeader header;
+  VebTree result;
+  result.mapping = vebMapImage(path, verifyChecksum, header,
+                               result.mappingLength);
+  auto fail = [&](const char * reason) {
+    throw std::runtime_error(path + ": " + reason);
+  };
+  if (header.keyType != keyTypeCode() || header.keySize != sizeof(key_type)) {
+    fail("image holds a different key type");
+  }
+  if (header.layout != kPureVebLayout && header.layout != kBlockedVebLayout) {
+    fail("unknown layout");
+  }
+  result.layout = VebLayout(header.layout);
+  result.numKeys = header.numKeys;
+  if (header.treeHeight < 1 || header.treeHeight > kMaxHeight) {
+    fail("bad tree height");
+  }
+  if (result.layout == kBlockedVebLayout) {
+    result.setHeight(header.treeHeight, size_t(-1));
+    result.numBlocks = std::min<size_t>(size_t(1) << result.treeHeight,
+                                        result.numKeys / kBlockSlots + 1);
+    if (header.blockSlots != unsigned(kBlockSlots) ||
+        header.numBlocks != result.numBlocks) {
+      fail("blocks don't match the key count");
+    }
+  } else {
+    result.setHeight(header.treeHeight, result.numKeys);
+    uint64_t capacity = (uint64_t(1) << result.treeHeight) - 1;
+    if (header.numBlocks != 0 || capacity < result.numKeys) {
+      fail("tree height doesn't match the key count");
+    }
+  }
+  if (header.topHeight != result.topHeight ||
+      header.numSegments != result.numSegments ||
+      header.treeSlots != result.layoutSize()) {
+    fail("tree shape doesn't match the key count");
+  }
+  result.tree = (key_type *) (result.mapping + header.treeOffset);
+  result.blocks = (key_type *) (result.mapping + header.blocksOffset);
+  if (result.numBlocks == 0) {
+    result.blocks = nullptr;
+  }
+  return result;
+}
+
+/* Bottom tree b holds the keys with in-order indices b * (B + 1) up to the
+ * separator b of the top tree after it, so reading the keys in order hands
+ * us each bottom tree's keys in turn, and then its separator. Bottom trees
+ * are laid out with a tree of their own height, which comes out the same as
+ * the layout of any bottom tree of that height, and the separators are
+ * saved up for the top tree. Past the last key everything is padding.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::build_image(const std::string& keysPath,
+                                       const std::string& imagePath,
+                                       unsigned threads) {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "only trivially copyable keys can be saved");
+  VebKeyFileReader reader(keysPath, sizeof(key_type));
+  uint64_t n = reader.size();
+  int height = 1;
+  while (height < kMaxHeight && (uint64_t(1) << height) - 1 < n) {
+    height++;
+  }
+  if (height == 1) {
+    std::vector<key_type> keys(n);
+    reader.read(keys.data(), n);
+    VebTree(keys).save(imagePath);
+    return;
+  }
+  VebTree shape;
+  shape.numKeys = n;
+  shape.setHeight(height, n);
+  VebTree bottom;
+  bottom.setHeight(shape.treeHeight - shape.topHeight, size_t(-1));
+  const size_t * btd = shape.BTD + 3 * (shape.topHeight + 1);
+  size_t bottomSize = btd[0];
+  size_t topSize = btd[1];
+
+  VebTreeImageHeader header = VebTreeImageHeader();
+  header.keyType = keyTypeCode();
+  header.keySize = sizeof(key_type);
+  header.layout = kPureVebLayout;
+  header.treeHeight = shape.treeHeight;
+  header.topHeight = shape.topHeight;
+  header.numKeys = n;
+  header.numSegments = shape.numSegments;
+  header.treeSlots = shape.layoutSize();
+  VebImageWriter writer(imagePath, header);
+
+  std::vector<key_type> keys(bottomSize + 1);
+  std::vector<key_type> placed(bottomSize);
+  std::vector<key_type> separators(topSize, Params::sentinel());
+  key_type previous = key_type();
+  uint64_t seen = 0;
+  for (size_t b = 0; b < shape.numSegments; b++) {
+    size_t count = reader.read(keys.data(), bottomSize + 1);
+    for (size_t i = 0; i < count; i++, seen++) {
+      if ((seen > 0 && Params::compare(previous, keys[i]) >= 0) ||
+          Params::compare(keys[i], Params::sentinel()) >= 0) {
+        throw std::runtime_error(keysPath + ": keys are out of order, or "
+                                 "one of them is the padding");
+      }
+      previous = keys[i];
+    }
+    std::fill(keys.begin() + count, keys.end(), Params::sentinel());
+    bottom.placeInOrder(placed.data(), [&](uint64_t i) { return keys[i]; },
+                        threads);
+    writer.write((topSize + b * bottomSize) * sizeof(key_type),
+                 placed.data(), bottomSize * sizeof(key_type));
+    if (b < topSize) {
+      separators[b] = keys[bottomSize];
+    }
+  }
+  std::vector<key_type> top(topSize);
+  shape.placeSubtree(top.data(), 1, shape.topHeight, 1, 0,
+                     [&](uint64_t j) { return separators[j]; });
+  writer.write(0, top.data(), topSize * sizeof(key_type));
+  writer.finish();
+}
+
+/* Walks the tree from the root down to a leaf, without recursion and without
+ * branching on the keys. At every node, visit(position) is handed the node's
+ * position in the layout and returns whether to continue to the right child.
+ * The return value is the final path: the BFS index of the empty slot below
+ * the leaf where the walk ended. Subtracting 1 << treeHeight from it gives the
+ * number of slots (in order) to the left of that slot.
+ *
+ * We keep the BFS path of the current node and the position of every
+ * ancestor. The position of the next node then comes straight out of the BTD
+ * tables: it is the position of the root of the enclosing top tree, plus the
+ * size of that top tree, plus one bottom tree for every node of the top tree
+ * that lies to the left of our path. The only special case is stepping from
+ * the outermost top tree into a bottom tree, which is clamped to the bottom
+ * trees we stored; only a key that compares greater than the padding could
+ * otherwise run off the end.
+ */
+template <typename Key, typename Params>
+template <typename Visit>
+uint64_t VebTree<Key, Params>::walk(Visit visit) const {
+  size_t pos[kMaxHeight + 2];
+  uint64_t path = 1;
+  pos[1] = 0;
+  int depth = 1;
+  for (; depth < topHeight; depth++) {
+    path = (path << 1) | visit(pos[depth]);
+    pos[depth + 1] = childPosition(pos, depth, path);
+  }
+  path = (path << 1) | visit(pos[depth]);
+  if (depth == treeHeight) {
+    return path;
+  }
+  return walkSegment(visit, path);
+}
+
+/* The rest of walk, from the root of the outermost bottom tree that path
+ * (the path out of the outermost top tree) leads to. Nothing below there
+ * looks at the positions of the top tree's nodes, since every bottom tree is
+ * laid out on its own.
+ */
+template <typename Key, typename Params>
+template <typename Visit>
+uint64_t VebTree<Key, Params>::walkSegment(Visit visit, uint64_t path) const {
+  size_t pos[kMaxHeight + 2];
+  int depth = topHeight + 1;
+  pos[depth] = segmentPosition(path);
+  for (; depth < treeHeight; depth++) {
+    path = (path << 1) | visit(pos[depth]);
+    pos[depth + 1] = childPosition(pos, depth, path);
+  }
+  return (path << 1) | visit(pos[depth]);
+}
+
+/* Walks the tree for key, skipping the outermost top tree when the jump
+ * table knows which bottom tree key's search goes on to.
+ */
+template <typename Key, typename Params>
+template <typename Visit>
+uint64_t VebTree<Key, Params>::walkKey(const key_type& key,
+                                       Visit visit) const {
+  uint64_t path;
+  if (!jumpTable.empty() && jumpPath(key, path, jumpable())) {
+    return walkSegment(visit, path);
+  }
+  return walk(visit);
+}
+
+/* Bucket i of the jump table covers the keys from jumpMin + (i << jumpShift)
+ * up to the next bucket, and holds 1 + the index of the outermost bottom tree
+ * that the search for every one of those keys goes on to, or 0 if they don't
+ * all go to the same one. That's the case exactly when the outermost top
+ * tree has no node in the bucket's range, so the number of nodes less than
+ * the key is the same for the whole bucket. Walking the top tree for both
+ * ends of the range tells us whether it is.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::build_jump_table(int bits) {
+  buildJumpTable(bits, jumpable());
+}
+
+template <typename Key, typename Params>
+void VebTree<Key, Params>::buildJumpTable(int bits, std::true_type) {
+  if (layout == kCompressedVebLayout) {
+    throw std::invalid_argument(
+        "the jump table needs the pure or blocked layout");
+  }
+  jumpTable.clear();
+  jumpTable.shrink_to_fit();
+  if (bits <= 0 || numKeys == 0 || treeHeight == topHeight) {
+    return;
+  }
+  jumpMin = *select(0);
+  jumpMax = *select(numKeys - 1);
+  uint64_t span = uint64_t(jumpMax) - uint64_t(jumpMin);
+  int spanBits = span == 0 ? 0 : 64 - __builtin_clzll(span);
+  // At most 63 bits, so that a span of all 64 leaves some shift and the
+  // bucket count can't wrap.
+  bits = std::min(std::min(bits, 63), std::max(spanBits, 1));
+  jumpShift = spanBits - bits > 0 ? spanBits - bits : 0;
+  size_t numBuckets = (span >> jumpShift) + 1;
+  int bottomLevels = treeHeight - topHeight;
+  // The path out of the top tree, and whether it went through key.
+  auto topPath = [&](uint64_t offset, bool& found) {
+    key_type key = key_type(uint64_t(jumpMin) + offset);
+    int level = 0;
+    found = false;
+    uint64_t path = walk([&](size_t position) {
+      bool equal, greater;
+      compareKeys(key, tree[position], equal, greater);
+      found |= equal & (level++ < topHeight);
+      return greater;
+    });
+    return path >> bottomLevels;
+  };
+  jumpTable.resize(numBuckets);
+  for (size_t i = 0; i < numBuckets; i++) {
+    uint64_t lo = uint64_t(i) << jumpShift;
+    uint64_t hi = std::min(lo + ((uint64_t(1) << jumpShift) - 1), span);
+    bool foundLo, foundHi;
+    uint64_t first = topPath(lo, foundLo);
+    uint64_t last = topPath(hi, foundHi);
+    jumpTable[i] = first == last && !foundHi
+        ? uint32_t(first - (uint64_t(1) << topHeight) + 1) : 0;
+  }
+}
+
+template <typename Key, typename Params>
+void VebTree<Key, Params>::buildJumpTable(int, std::false_type) {
+  throw std::invalid_argument(
+      "the jump table needs integer keys and default params");
+}
+
+/* Places the cursor on the node with the given in-order index. In a perfect
+ * tree of height h, the node with 1-based in-order index x sits z = ctz(x)
+ * levels above the leaves, and its BFS index is (x + 2^h) >> (z + 1):
+ * dropping the trailing zeros and the one above them from x leaves the turns
+ * taken to get there, behind a leading one bit. The positions along the way
+ * come from the same BTD arithmetic as walk, with the turns read off the
+ * path instead of from key comparisons, so no keys are touched.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::seekCursor(Cursor& cursor, uint64_t index) const {
+  uint64_t x = index + 1;
+  int z = __builtin_ctzll(x);
+  uint64_t path = (x + (uint64_t(1) << treeHeight)) >> (z + 1);
+  int depth = treeHeight - z;
+  cursor.index = index;
+  cursor.pos[1] = 0;
+  for (cursor.depth = 1; cursor.depth < depth; cursor.depth++) {
+    cursor.path = path >> (depth - cursor.depth - 1);
+    cursor.pos[cursor.depth + 1] = stepPosition(cursor);
+  }
+  cursor.path = path;
+}
+
+/* Moves the cursor to the next node in order: the leftmost node of its right
+ * subtree if it has one, and otherwise the closest ancestor whose left
+ * subtree it is in. Ancestors' positions are still on the stack, so each
+ * step down costs one BTD lookup and each step up costs nothing, which is
+ * amortized constant time per node. The cursor must not be on the last node.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::advanceCursor(Cursor& cursor) const {
+  cursor.index++;
+  if (cursor.depth < treeHeight) {
+    cursor.path = (cursor.path << 1) | 1;
+    cursor.pos[cursor.depth + 1] = stepPosition(cursor);
+    cursor.depth++;
+    while (cursor.depth < treeHeight) {
+      cursor.path <<= 1;
+      cursor.pos[cursor.depth + 1] = stepPosition(cursor);
+      cursor.depth++;
+    }
+    return;
+  }
+  while (cursor.path & 1) {
+    cursor.path >>= 1;
+    cursor.depth--;
+  }
+  cursor.path >>= 1;
+  cursor.depth--;
+}
+
+// The mirror image of advanceCursor. The cursor must not be on the first node.
+template <typename Key, typename Params>
+void VebTree<Key, Params>::retreatCursor(Cursor& cursor) const {
+  cursor.index--;
+  if (cursor.depth < treeHeight) {
+    cursor.path <<= 1;
+    cursor.pos[cursor.depth + 1] = stepPosition(cursor);
+    cursor.depth++;
+    while (cursor.depth < treeHeight) {
+      cursor.path = (cursor.path << 1) | 1;
+      cursor.pos[cursor.depth + 1] = stepPosition(cursor);
+      cursor.depth++;
+    }
+    return;
+  }
+  while (!(cursor.path & 1)) {
+    cursor.path >>= 1;
+    cursor.depth--;
+  }
+  cursor.path >>= 1;
+  cursor.depth--;
+}
+
+// Moves the cursor to the node with the given in-order index, stepping if
+// it's a neighbour of the current node and seeking otherwise.
+template <typename Key, typename Params>
+void VebTree<Key, Params>::moveCursor(Cursor& cursor, uint64_t index) const {
+  if (cursor.index >= 0 && index == uint64_t(cursor.index) + 1) {
+    advanceCursor(cursor);
+  } else if (cursor.index > 0 && index == uint64_t(cursor.index) - 1) {
+    retreatCursor(cursor);
+  } else if (cursor.index < 0 || index != uint64_t(cursor.index)) {
+    seekCursor(cursor, index);
+  }
+}
+
+/* Runs function(first, last) over consecutive chunks of [0, n) on up to
+ * threads threads, with at least minChunk items per chunk. The calling
+ * thread takes the first chunk itself.
+ */
+template <typename Key, typename Params>
+template <typename Function>
+void VebTree<Key, Params>::parallelFor(size_t n, size_t minChunk,
+                                       unsigned threads, Function function) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, n / std::max<size_t>(minChunk, 1)));
+  std::vector<std::thread> workers;
+  workers.reserve(chunks - 1);
+  for (size_t chunk = 1; chunk < chunks; chunk++) {
+    workers.push_back(std::thread(function, n * chunk / chunks,
+                                  n * (chunk + 1) / chunks));
+  }
+  function(0, n / chunks);
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+/* Fills in the layout, where the node with in-order index i holds valueAt(i).
+ *
+ * The outermost top tree and each stored bottom tree are independent pieces
+ * of the output: bottom tree b holds the B keys with in-order indices
+ * starting at b * (B + 1), and the j-th node (in order) of the top tree is
+ * the separator with in-order index (j + 1) * (B + 1) - 1. So the top tree is
+ * placed first and the bottom trees are then shared out between threads.
+ */
+template <typename Key, typename Params>
+template <typename ValueAt>
+void VebTree<Key, Params>::placeInOrder(key_type * out, ValueAt valueAt,
+                                        unsigned threads) const {
+  if (treeHeight == topHeight) {
+    placeSubtree(out, 1, treeHeight, 1, 0, valueAt);
+    return;
+  }
+  const size_t * btd = BTD + 3 * (topHeight + 1);
+  size_t bottomSize = btd[0];
+  size_t topSize = btd[1];
+  placeSubtree(out, 1, topHeight, 1, 0, [&](uint64_t j) {
+    return valueAt((j + 1) * (bottomSize + 1) - 1);
+  });
+  const size_t kMinKeysPerThread = size_t(1) << 16;
+  parallelFor(numSegments, kMinKeysPerThread / bottomSize + 1, threads,
+              [&](size_t first, size_t last) {
+    for (size_t b = first; b < last; b++) {
+      uint64_t firstIndex = b * (bottomSize + 1);
+      placeSubtree(out, topHeight + 1, treeHeight,
+                   (uint64_t(1) << topHeight) | b, topSize + b * bottomSize,
+                   [&](uint64_t i) { return valueAt(firstIndex + i); });
+    }
+  });
+}
+
+/* Places the subtree rooted at the node at rootDepth along rootPath, which
+ * sits at rootPosition and reaches down to bottomDepth, where the node with
+ * in-order index i (within the subtree) holds valueAt(i). The root must be
+ * the root of a top or bottom tree of the recursion, so that every position
+ * inside the subtree only depends on ancestors inside it.
+ *
+ * This is an iterative in-order walk that keeps the position of every
+ * ancestor, so each node's position costs a constant amount of work.
+ */
+template <typename Key, typename Params>
+template <typename ValueAt>
+void VebTree<Key, Params>::placeSubtree(key_type * out, int rootDepth,
+                                        int bottomDepth, uint64_t rootPath,
+                                        size_t rootPosition,
+                                        ValueAt valueAt) const {
+  size_t pos[kMaxHeight + 2];
+  uint64_t index = 0;
+  uint64_t path = rootPath;
+  int depth = rootDepth;
+  pos[depth] = rootPosition;
+  while (true) {
+    // Go as far left as we can.
+    while (depth < bottomDepth) {
+      path <<= 1;
+      pos[depth + 1] = childPosition(pos, depth, path);
+      depth++;
+    }
+    out[pos[depth]] = valueAt(index++);
+    // Climb until we reach a node whose left subtree we just finished.
+    while (depth > rootDepth && (path & 1) == 1) {
+      path >>= 1;
+      depth--;
+    }
+    if (depth == rootDepth) {
+      return;
+    }
+    path >>= 1;
+    depth--;
+    out[pos[depth]] = valueAt(index++);
+    // Then move on to its right subtree.
+    path = (path << 1) | 1;
+    pos[depth + 1] = childPosition(pos, depth, path);
+    depth++;
+  }
+}
+
+/* Builds the blocked (or compressed) layout. Conceptually this is a perfect
+ * tree of height treeHeight + log2(slots) whose in-order sequence is the keys
+ * followed by padding, where slots is leafSlots(). Its bottom log2(slots)
+ * levels are cut off into leaf blocks: block b holds the in-order run that
+ * falls between separators b - 1 and b of the upper tree, plus one slot of
+ * padding to fill the cache line.
+ *
+ * The upper tree is stored whole in vEB order (it's a small fraction of the
+ * keys). Blocks are only stored up to the first one whose right separator is
+ * padding, since no search for a real key can end up past that.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::buildBlocked(const key_type * keys,
+                                        unsigned threads) {
+  const size_t slots = leafSlots();
+  const int blockKeys = kBlockSlots - 1;
+  int leafHeight = 0;
+  while ((size_t(1) << leafHeight) < slots) {
+    leafHeight++;
+  }
+  int height = 1;
+  while (height < kMaxHeight && (uint64_t(1) << height) - 1 < numKeys) {
+    height++;
+  }
+  setHeight(std::max(height - leafHeight, 1), size_t(-1));
+
+  size_t n = numKeys;
+  auto keyAt = [=](uint64_t i) {
+    return i < n ? keys[i] : Params::sentinel();
+  };
+  tree = allocateKeys(layoutSize());
+  placeInOrder(tree, [&](uint64_t i) {
+    return keyAt((i + 1) * slots - 1);
+  }, threads);
+
+  numBlocks = std::min<size_t>(size_t(1) << treeHeight, numKeys / slots + 1);
+  if (layout == kCompressedVebLayout) {
+    buildPacked(keyAt, threads, compressible());
+    return;
+  }
+  blocks = allocateKeys(numBlocks * kBlockSlots);
+  const size_t kMinBlocksPerThread = size_t(1) << 12;
+  key_type * out = blocks;
+  parallelFor(numBlocks, kMinBlocksPerThread, threads,
+              [&](size_t first, size_t last) {
+    for (size_t b = first; b < last; b++) {
+      for (int slot = 0; slot < kBlockSlots; slot++) {
+        out[b * kBlockSlots + slot] =
+            slot < blockKeys ? keyAt(b * kBlockSlots + slot)
+                             : Params::sentinel();
+      }
+    }
+  });
+}
+
+/* Fills in the compressed leaf blocks. A first pass over the blocks works out
+ * each one's offset width, which only needs its first and last keys, and
+ * hands out overflow slots to the blocks that need more than the widest
+ * offset that still fits kPackedSlots - 1 of them into the block. The blocks
+ * are then filled in on up to threads threads.
+ */
+template <typename Key, typename Params>
+template <typename KeyAt>
+void VebTree<Key, Params>::buildPacked(KeyAt keyAt, unsigned threads,
+                                       std::true_type) {
+  typedef typename std::make_unsigned<Key>::type Unsigned;
+  const int blockKeys = kPackedSlots - 1;
+  const int perWord = (blockKeys + kPackedWords - 1) / kPackedWords;
+  const int maxWidth = 64 / perWord;
+  packed = (VebPackedBlock *) allocateStorage(
+      numBlocks * sizeof(VebPackedBlock), storage);
+  for (size_t b = 0; b < numBlocks; b++) {
+    size_t first = b * kPackedSlots;
+    int count = int(std::min<size_t>(blockKeys,
+                                     numKeys > first ? numKeys - first : 0));
+    VebPackedBlock& block = packed[b];
+    block = VebPackedBlock();
+    block.count = count;
+    block.perWord = perWord;
+    if (count == 0) {
+      continue;
+    }
+    block.base = uint64_t(Unsigned(keyAt(first)));
+    uint64_t span = uint64_t(Unsigned(Unsigned(keyAt(first + count - 1)) -
+                                      Unsigned(keyAt(first))));
+    int width = 0;
+    while (width < 64 && (span >> width) != 0) {
+      width++;
+    }
+    if (width > maxWidth) {
+      if (numOverflow == UINT32_MAX) {
+        // The destructor won't run, so free what we've built.
+        numOverflow = 0;
+        release();
+        throw std::length_error(
+            "too many compressed blocks overflow for their index");
+      }
+      block.width = kVebOverflowWidth;
+      block.overflow = uint32_t(numOverflow++);
+    } else {
+      block.width = width;
+    }
+  }
+  overflow = allocateKeys(numOverflow * blockKeys);
+
+  const size_t kMinBlocksPerThread = size_t(1) << 12;
+  parallelFor(numBlocks, kMinBlocksPerThread, threads,
+              [&](size_t first, size_t last) {
+    for (size_t b = first; b < last; b++) {
+      VebPackedBlock& block = packed[b];
+      for (int i = 0; i < block.count; i++) {
+        key_type key = keyAt(b * kPackedSlots + i);
+        if (block.width == kVebOverflowWidth) {
+          overflow[block.overflow * blockKeys + i] = key;
+        } else {
+          uint64_t offset = Unsigned(Unsigned(key) - Unsigned(block.base));
+          block.bits[i / perWord] |= offset << (i % perWord * block.width);
+        }
+      }
+    }
+  });
+}
+
+/* Searches compressed leaf block b: keys below the block's base are less than
+ * everything in it, and otherwise the search key becomes an offset from the
+ * base too. Blocks that overflowed are searched directly.
+ */
+template <typename Key, typename Params>
+int VebTree<Key, Params>::searchPacked(size_t b, const key_type& key,
+                                       bool& found, std::true_type) const {
+  typedef typename std::make_unsigned<Key>::type Unsigned;
+  const VebPackedBlock& block = packed[b];
+  if (block.width == kVebOverflowWidth) {
+    const key_type * keys = overflow + block.overflow * (kPackedSlots - 1);
+    int less = 0;
+    found = false;
+    for (int i = 0; i < block.count; i++) {
+      found |= keys[i] == key;
+      less += keys[i] < key;
+    }
+    return less;
+  }
+  key_type base = key_type(Unsigned(block.base));
+  if (block.count == 0 || key < base) {
+    found = false;
+    return 0;
+  }
+  return vebSearchPacked(block, Unsigned(Unsigned(key) - Unsigned(base)), found);
+}
+
+/* Walks from the root to a leaf the same way contains does and remembers the
+ * last node where the search turned left and the last node where it turned
+ * right. Searches go right when key is greater than the node, or also when
+ * it is equal if rightOnEqual is set.
+ *
+ * In a binary search tree the last left turn is the smallest node on the
+ * "greater" side of the search and the last right turn is the largest node on
+ * the "smaller" side, which gives all four ordered queries from one walk.
+ * Positions are -1 if the search never turned that way.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::boundSearch(const key_type& key, bool rightOnEqual,
+                                       int64_t& lastLeft,
+                                       int64_t& lastRight) const {
+  assert(layout == kPureVebLayout);
+  int64_t left = -1;
+  int64_t right = -1;
+  walk([&](size_t position) {
+    bool equal, greater;
+    compareKeys(key, tree[position], equal, greater);
+    bool goRight = greater | (equal & rightOnEqual);
+    right = goRight ? (int64_t) position : right;
+    left = goRight ? left : (int64_t) position;
+    return goRight;
+  });
+  lastLeft = left;
+  lastRight = right;
+}
+
+// Returns the key at the given position, or nullptr if there is no key there
+// (the position is -1 or holds padding).
+template <typename Key, typename Params>
+const Key * VebTree<Key, Params>::keyAt(int64_t position) const {
+  if (position < 0 || Params::compare(tree[position], Params::sentinel()) == 0) {
+    return nullptr;
+  }
+  return &tree[position];
+}
+
+template <typename Key, typename Params>
+size_t VebTree<Key, Params>::rank(const key_type& key) const {
+  size_t result;
+  contains(key, result);
+  return result;
+}
+
+/* Maps a rank straight to a position in the layout (see seekCursor). In the
+ * blocked layout, rank i is slot i % kBlockSlots of block i / kBlockSlots,
+ * except that the last slot of every block stands for the separator after
+ * it, which is node i / kBlockSlots (in order) of the upper tree.
+ */
+template <typename Key, typename Params>
+const Key * VebTree<Key, Params>::select(size_t i) const {
+  assert(layout != kCompressedVebLayout);
+  if (i >= numKeys) {
+    return nullptr;
+  }
+  if (treeHeight == 0) {
+    return &tree[i];
+  }
+  if (layout == kBlockedVebLayout) {
+    if (i % kBlockSlots != size_t(kBlockSlots - 1)) {
+      return &blocks[i];
+    }
+    i /= kBlockSlots;
+  }
+  Cursor cursor;
+  seekCursor(cursor, i);
+  return &tree[cursor.pos[cursor.depth]];
+}
+
+/* Streams the keys with ranks in [rank(lo), rank(hi) + 1) (or rank(hi) if hi
+ * isn't present). In the pure layout that's a cursor walk over the vEB
+ * array. In the blocked layout, runs of keys inside a block are read
+ * straight through, and the cursor only steps from separator to separator.
+ */
+template <typename Key, typename Params>
+template <typename Function>
+void VebTree<Key, Params>::for_each_in_range(const key_type& lo,
+                                             const key_type& hi,
+                                             Function fn) const {
+  assert(layout != kCompressedVebLayout);
+  size_t first = rank(lo);
+  size_t last;
+  if (contains(hi, last)) {
+    last++;
+  }
+  if (first >= last) {
+    return;
+  }
+  if (treeHeight == 0) {
+    for (size_t r = first; r < last; r++) {
+      fn(tree[r]);
+    }
+    return;
+  }
+  Cursor cursor;
+  if (layout == kPureVebLayout) {
+    seekCursor(cursor, first);
+    fn(tree[cursor.pos[cursor.depth]]);
+    for (size_t r = first + 1; r < last; r++) {
+      advanceCursor(cursor);
+      fn(tree[cursor.pos[cursor.depth]]);
+    }
+    return;
+  }
+  cursor.index = -1;
+  size_t r = first;
+  while (true) {
+    size_t separator = r / kBlockSlots * kBlockSlots + kBlockSlots - 1;
+    for (size_t runEnd = std::min(last, separator); r < runEnd; r++) {
+      fn(blocks[r]);
+    }
+    if (r == last) {
+      return;
+    }
+    moveCursor(cursor, r / kBlockSlots);
+    fn(tree[cursor.pos[cursor.depth]]);
+    if (++r == last) {
+      return;
+    }
+  }
+}
+
+// Since keys are distinct, the keys up to and including b number rank(b),
+// plus one if b itself is present.
+template <typename Key, typename Params>
+size_t VebTree<Key, Params>::count_range(const key_type& a,
+                                         const key_type& b) const {
+  size_t low = rank(a);
+  size_t high;
+  if (contains(b, high)) {
+    high++;
+  }
+  return high > low ? high - low : 0;
+}
+
+template <typename Key, typename Params>
+const Key * VebTree<Key, Params>::predecessor(const key_type& key) const {
+  if (treeHeight == 0) {
+    bool found;
+    size_t less = searchInline(key, found);
+    return less > 0 ? &tree[less - 1] : nullptr;
+  }
+  int64_t lastLeft, lastRight;
+  boundSearch(key, false, lastLeft, lastRight);
+  return keyAt(lastRight);
+}
+
+template <typename Key, typename Params>
+const Key * VebTree<Key, Params>::successor(const key_type& key) const {
+  return upper_bound(key);
+}
+
+template <typename Key, typename Params>
+const Key * VebTree<Key, Params>::lower_bound(const key_type& key) const {
+  if (treeHeight == 0) {
+    bool found;
+    size_t less = searchInline(key, found);
+    return less < numKeys ? &tree[less] : nullptr;
+  }
+  int64_t lastLeft, lastRight;
+  boundSearch(key, false, lastLeft, lastRight);
+  return keyAt(lastLeft);
+}
+
+template <typename Key, typename Params>
+const Key * VebTree<Key, Params>::upper_bound(const key_type& key) const {
+  if (treeHeight == 0) {
+    bool found;
+    size_t less = searchInline(key, found) + found;
+    return less < numKeys ? &tree[less] : nullptr;
+  }
+  int64_t lastLeft, lastRight;
+  boundSearch(key, true, lastLeft, lastRight);
+  return keyAt(lastLeft);
+}
+
+
+
+/* This method functionally has 2 return values: The boolean indicates whether
+ * or not the key was present in this subtree. If it was present, then the
+ * returnAnswer int is updated to be the in-order index of that node in this
+ * subtree.
+ *
+ * If it wasn't found, then returnAnswer is updated to be the index of the
+ * subtree that might contain this key.
+ *
+ * Say you has a subtree of height 2 (just 3 nodes) like this:
+ *
+ *                  10
+ *                /    \
+ *               5      15
+ *
+ * If you searched for 5, it would return true and set the int to 0.
+ *
+ * If you search for 3, it would return false and set the int to 0 (since 3
+ * would be in the leftmost of the 4 subtrees that could be hanngin off this
+ * tree.
+ *
+ * If you search for 12, it would return false and set the int to 2, since it
+ * would be in the 3rd subtree hanging off this subtree. (The one to the left
+ * of 15).
+ *
+ * It does this by first recursively checking the top-structure of this tree,
+ * (in this example, the height 1 tree that has one node: 10) and returns if 
+ * it found it.
+ * 
+ * If the node wasn't in the top, then it uses the answer from the top query
+ * to index into one of the bottom trees (here we have two: the tree with 5
+ * and the tree with 15) and search for it there.
+ * 
+ * If it is found in the bottom tree, then we return true and set the int
+ * accordingly (keeping track of the number of nodes in the top and bottom
+ * that were smaller than this node).
+ *
+ * If it wasn't in the bottom tree, then we calculate which subtree it would be
+ * in, and return false.
+ */
+template <typename Key, typename Params>
+bool VebTree<Key, Params>::containsHelper(const key_type& key, size_t index,
+                                          int height, uint64_t& returnAnswer,
+                                          bool isParent) const {
+  if (height == 1) {
+    int comp = Params::compare(key, tree[index]);
+    if (comp == 0) {
+      // Found the answer. Report that the key was in the 0th child
+      returnAnswer = 0;
+      return true;
+    } else { 
+      // Not found, say if we're in the 0th (left) or 1th (right) subtree
+      if (comp < 0) returnAnswer = 0;
+      else                      returnAnswer = 1;
+      return false;
+    }
+  }
+  uint64_t topAns;
+  int topHeight = (height + 1) / 2;
+  size_t sizeOfTop = (size_t(1) << topHeight) - 1;
+  size_t sizeOfChild = (size_t(1) << (height - topHeight)) - 1;
+  if (containsHelper(key, index, topHeight, topAns)) {
+    // Found the index in our top structure, report which node it was in
+    uint64_t numSmallerChildren = topAns + 1;
+    returnAnswer = topAns + (sizeOfChild * numSmallerChildren);
+    return true;
+  } else {
+    // Not found in the top, ans is the index of the child to check
+    // skip sizeOfTop indices to get past top, then skip sizeOfChild
+    // for each child to skip.
+    size_t indexOfChild = index + sizeOfTop + sizeOfChild * topAns;
+    if (isParent) {
+      // We have an unusual number of children. Make sure this
+      // one is valid
+      if (topAns >= numSegments) {
+        //TODO: Do I need to set returnAnswer?
+        return false;               
+      }
+    }
+    uint64_t childAns;
+    if (containsHelper(key, indexOfChild, height - topHeight, childAns)) {
+      // Found in the bottom tree, report which node we found it in
+
+      // We have topAns full bottom trees, and topAns nodes in the top struct
+      // that are less than this node.
+      uint64_t nodesBeforeThisBottomTree = topAns * (sizeOfChild + 1);
+      returnAnswer = nodesBeforeThisBottomTree + childAns;
+      return true;
+    } else {
+      // Not found, report which subtree (below our current bottom trees)
+      // the key would be in.
+      uint64_t subTreesFromOtherBottoms = (sizeOfChild + 1) * topAns;
+      uint64_t subTreesFromThisBottom = childAns;
+      returnAnswer = subTreesFromOtherBottoms + subTreesFromThisBottom;
+      return false;
+    }
+  }
+}
+
+/* Looks up the key with a single branch-free walk (see walk), so the loop
+ * body compiles down to conditional moves. A key equal to the sentinel
+ * matches the padding, which the walk then leaves numKeys or more nodes to
+ * its left; no stored key does.
+ */
+template <typename Key, typename Params>
+bool VebTree<Key, Params>::contains(const key_type& key) const {
+  if (treeHeight == 0) {
+    bool found;
+    searchInline(key, found);
+    return found;
+  }
+  if (layout != kPureVebLayout) {
+    size_t rank;
+    return contains(key, rank);
+  }
+  bool found = false;
+  uint64_t less = walkKey(key, [&](size_t position) {
+    bool equal, greater;
+    compareKeys(key, tree[position], equal, greater);
+    found |= equal;
+    return greater;
+  }) - (uint64_t(1) << treeHeight);
+  return found && less < numKeys;
+}
+
+/* The walk only goes right past nodes that are less than key, so the slot it
+ * ends in has exactly the nodes less than key to its left. Since the padding
+ * all comes after the keys, that's the rank, capped at the number of keys.
+ *
+ * The blocked and compressed layouts walk through the upper tree only, and
+ * the final path picks out the leaf block (clamped to the blocks we stored,
+ * in case the key is at least as large as the padding). Block b starts at
+ * in-order index b * leafSlots(), where the slot that isn't stored stands for
+ * the separator to its right, so the rank is that plus the keys of the block
+ * that are less than key. That holds even when key is the separator itself,
+ * since the walk then ends in the block to its left.
+ */
+template <typename Key, typename Params>
+bool VebTree<Key, Params>::contains(const key_type& key, size_t& rank) const {
+  if (treeHeight == 0) {
+    bool found;
+    rank = searchInline(key, found);
+    return found;
+  }
+  bool found = false;
+  uint64_t less = walkKey(key, [&](size_t position) {
+    bool equal, greater;
+    compareKeys(key, tree[position], equal, greater);
+    found |= equal;
+    return greater;
+  }) - (uint64_t(1) << treeHeight);
+  if (layout != kPureVebLayout) {
+    size_t block = std::min<size_t>(less, numBlocks - 1);
+    bool blockFound;
+    less = block * leafSlots() + searchLeaf(block, key, blockFound);
+    found |= blockFound;
+  }
+  rank = std::min<uint64_t>(less, numKeys);
+  // A match past the last key is padding (see contains(key)).
+  return found && less < numKeys;
+}
+
+/* Group prefetching: the keys are searched kBatchGroup at a time, moving
+ * every search in the group down one level before any of them moves down the
+ * next. Each search prefetches its next node as soon as it knows where that
+ * is, so by the time we come back around to it the node is (hopefully) in
+ * cache, and the group keeps kBatchGroup misses in flight instead of one.
+ *
+ * Since every search in a group is at the same depth, they share the BTD
+ * entries. The blocked layout finishes by prefetching and then searching
+ * each search's leaf block. Ranks come from the final paths as in
+ * contains(key, rank); for the layouts with leaf blocks, the path is moved
+ * along to the key's slot within its block first.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::contains_batch(const key_type * keys, size_t n,
+                                          bool * out, size_t * ranks) const {
+  if (treeHeight == 0) {
+    for (size_t i = 0; i < n; i++) {
+      size_t rank;
+      out[i] = contains(keys[i], rank);
+      if (ranks != nullptr) {
+        ranks[i] = rank;
+      }
+    }
+    return;
+  }
+  const size_t kBatchGroup = 16;
+  size_t pos[kBatchGroup][kMaxHeight + 2];
+  uint64_t path[kBatchGroup];
+  bool found[kBatchGroup];
+  for (size_t start = 0; start < n; start += kBatchGroup) {
+    size_t group = std::min(kBatchGroup, n - start);
+    const key_type * groupKeys = keys + start;
+    for (size_t i = 0; i < group; i++) {
+      pos[i][1] = 0;
+      path[i] = 1;
+      found[i] = false;
+    }
+    for (int depth = 1; depth <= treeHeight; depth++) {
+      for (size_t i = 0; i < group; i++) {
+        bool equal, greater;
+        compareKeys(groupKeys[i], tree[pos[i][depth]], equal, greater);
+        found[i] |= equal;
+        path[i] = (path[i] << 1) | greater;
+        if (depth == treeHeight) {
+          continue;
+        }
+        size_t next = depth == topHeight ? segmentPosition(path[i])
+                                         : childPosition(pos[i], depth, path[i]);
+        pos[i][depth + 1] = next;
+        __builtin_prefetch(&tree[next]);
+      }
+    }
+    if (layout != kPureVebLayout) {
+      for (size_t i = 0; i < group; i++) {
+        size_t block = std::min<size_t>(path[i] - (uint64_t(1) << treeHeight),
+                                        numBlocks - 1);
+        pos[i][0] = block;
+        __builtin_prefetch(leafAddress(block));
+      }
+      for (size_t i = 0; i < group; i++) {
+        bool blockFound;
+        int less = searchLeaf(pos[i][0], groupKeys[i], blockFound);
+        found[i] |= blockFound;
+        path[i] = (uint64_t(1) << treeHeight) + pos[i][0] * leafSlots() + less;
+      }
+    }
+    for (size_t i = 0; i < group; i++) {
+      uint64_t less = path[i] - (uint64_t(1) << treeHeight);
+      out[start + i] = found[i] && less < numKeys;
+      if (ranks != nullptr) {
+        ranks[start + i] = std::min<uint64_t>(less, numKeys);
+      }
+    }
+  }
+}
+
+/* A depth-first walk over the union of the keys' search paths. Each node
+ * gets the range of keys whose searches reach it, finds where in that range
+ * the keys go from at most the node to greater than it (by binary search,
+ * so the total work over a level is at most linear in the batch), and hands
+ * each side to the child it goes to. Children are placed with the same BTD
+ * arithmetic as walk, using the positions of the node's ancestors, which
+ * the walk keeps in pos as it goes down. Each node is read once however
+ * many keys pass through it, and since every top and bottom tree of the
+ * recursion is contiguous, the nodes of a path come in a few cache lines at
+ * a time just as for a single search.
+ */
+template <typename Key, typename Params>
+void VebTree<Key, Params>::contains_sorted_batch(const key_type * keys,
+                                                 size_t n, bool * out,
+                                                 size_t * ranks) const {
+  if (n == 0) {
+    return;
+  }
+  if (treeHeight == 0) {
+    contains_batch(keys, n, out, ranks);
+    return;
+  }
+  std::fill(out, out + n, false);
+  size_t pos[kMaxHeight + 2];
+  pos[1] = 0;
+  sortedBatchNode(keys, 0, n, 1, 1, pos, out, ranks);
+}
+
+template <typename Key, typename Params>
+void VebTree<Key, Params>::sortedBatchNode(const key_type * keys, size_t lo,
+                                           size_t hi, int depth,
+                                           uint64_t path, size_t * pos,
+                                           bool * out, size_t * ranks) const {
+  if (hi - lo == 1) {
+    // A lone key just finishes its search without the bookkeeping.
+    bool found = false;
+    for (;; depth++) {
+      bool equal, greater;
+      compareKeys(keys[lo], tree[pos[depth]], equal, greater);
+      found |= equal;
+      path = (path << 1) | greater;
+      if (depth == treeHeight) {
+        break;
+      }
+      pos[depth + 1] = depth == topHeight ? segmentPosition(path)
+                                          : childPosition(pos, depth, path);
+    }
+    out[lo] |= found;
+    sortedBatchLeaf(keys, lo, hi, path, out, ranks);
+    return;
+  }
+  const key_type& node = tree[pos[depth]];
+  // Find the first key not less than node, and then the first greater.
+  bool equal, greater;
+  size_t first = lo;
+  size_t count = hi - lo;
+  while (count > 0) {
+    size_t half = count / 2;
+    compareKeys(keys[first + half], node, equal, greater);
+    bool less = !equal && !greater;
+    first = less ? first + half + 1 : first;
+    count = less ? count - half - 1 : half;
+  }
+  size_t mid = first;
+  while (mid < hi) {
+    compareKeys(keys[mid], node, equal, greater);
+    if (!equal) {
+      break;
+    }
+    out[mid++] = true;
+  }
+  for (int right = 0; right < 2; right++) {
+    size_t childLo = right ? mid : lo;
+    size_t childHi = right ? hi : mid;
+    uint64_t childPath = (path << 1) | right;
+    if (childLo == childHi) {
+      continue;
+    }
+    if (depth == treeHeight) {
+      sortedBatchLeaf(keys, childLo, childHi, childPath, out, ranks);
+      continue;
+    }
+    pos[depth + 1] = depth == topHeight ? segmentPosition(childPath)
+                                        : childPosition(pos, depth, childPath);
+    sortedBatchNode(keys, childLo, childHi, depth + 1, childPath, pos, out,
+                    ranks);
+  }
+}
+
+// Finishes the keys whose searches end at the empty slot below the leaves
+// that path leads to, as contains(key, rank) does.
+template <typename Key, typename Params>
+void VebTree<Key, Params>::sortedBatchLeaf(const key_type * keys, size_t lo,
+                                           size_t hi, uint64_t path,
+                                           bool * out, size_t * ranks) const {
+  uint64_t less = path - (uint64_t(1) << treeHeight);
+  if (layout == kPureVebLayout) {
+    if (less >= numKeys) {
+      // Only the padding is this far right.
+      std::fill(out + lo, out + hi, false);
+    }
+    if (ranks != nullptr) {
+      std::fill(ranks + lo, ranks + hi, std::min<uint64_t>(less, numKeys));
+    }
+    return;
+  }
+  size_t block = std::min<size_t>(less, numBlocks - 1);
+  for (size_t i = lo; i < hi; i++) {
+    bool blockFound;
+    uint64_t rank = block * leafSlots() + searchLeaf(block, keys[i], blockFound);
+    out[i] = (out[i] | blockFound) && rank < numKeys;
+    if (ranks != nullptr) {
+      ranks[i] = std::min<uint64_t>(rank, numKeys);
+    }
+  }
+}
+
+template <typename Key, typename Params>
+bool VebTree<Key, Params>::containsRecursive(const key_type& key) const {
+  assert(layout == kPureVebLayout);
+  if (treeHeight == 0) {
+    return contains(key);
+  }
+  uint64_t index;
+  // The true indicates that this is the highest level tree, and so it
+  // has an unusual number of children that must be manually checked.
+  // A match past the last key is padding.
+  return containsHelper(key, 0, treeHeight, index, true) && index < numKeys;
+}
+
+// The int instantiation is compiled once, in vEB-tree.cc.
+extern template class VebTree<int>;
 
 #endif
@@ -0,0 +1,275 @@
+#ifndef WEIGHTED_VEB_TREE
+#define WEIGHTED_VEB_TREE
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "tree-storage.h"
+#include "vEB-tree.h"
+
+// A static set of keys that are looked up with known, uneven frequencies.
+//
+// The keys go into a weight-balanced binary search tree in the manner of
+// Mehlhorn's approximation to the optimal tree: the root of every subtree is
+// the key that splits the subtree's weight most evenly, so a key with a
+// fraction p of the weight ends up at depth at most about log2(1 / p) + 1
+// and the expected search length is within a small constant of optimal. That
+// tree is no longer perfect, so it can't use VebTree's implicit layout;
+// instead its nodes store the positions of their children and are laid out
+// the van Emde Boas way, cut at half the height of each piece, just like
+// VebTree. The hot keys near the root then share the first few cache lines,
+// and every search path crosses O(log_B n) cache lines, as in VebTree.
+//
+// Before building, a sixteenth of the total weight is spread evenly over
+// all the keys. That costs at most a tenth of a comparison per search on
+// average, and keeps keys with (next to) no weight, and misses, within
+// about log2(16 n) levels of the root.
+template <typename Key, typename Params = VebTreeParams<Key> >
+class WeightedVebTree {
+public:
+  typedef Key key_type;
+
+  // Builds a tree from keys in sorted order and their access weights, which
+  // needn't add up to one, in O(n log n) time. The nodes are allocated
+  // according to storage.
+  WeightedVebTree(const std::vector<key_type>& keys,
+                  const std::vector<double>& weights,
+                  StoragePolicy storage = StoragePolicy());
+  WeightedVebTree(WeightedVebTree&& other);
+  ~WeightedVebTree();
+
+  bool contains(const key_type& key) const;
+  // The number of keys a search for key compares against, i.e. the depth
+  // the search stops at.
+  int depth(const key_type& key) const;
+
+  // The number of keys in the tree.
+  size_t size() const { return numKeys; }
+  // The number of levels in the tree.
+  int height() const { return treeHeight; }
+  // The number of bytes the tree takes up, not counting the object itself.
+  size_t memory_bytes() const { return numKeys * sizeof(Node); }
+
+private:
+  WeightedVebTree(const WeightedVebTree&) = delete;
+  void operator=(const WeightedVebTree&) = delete;
+
+  // A node of the layout. child[0] and child[1] are the positions of the
+  // left and right children, or 0 if there is none, since no node points at
+  // the root.
+  struct Node {
+    key_type key;
+    uint32_t child[2];
+  };
+
+  // The tree before it is laid out, over indices into the sorted keys.
+  struct Shape {
+    std::vector<int64_t> left;
+    std::vector<int64_t> right;
+    std::vector<int> height;
+  };
+
+  static int64_t buildShape(const std::vector<double>& prefix, size_t lo,
+                            size_t hi, Shape& shape);
+  static void layoutPiece(const Shape& shape, int64_t root, int limit,
+                          std::vector<int64_t>& order);
+  static void pieceRoots(const Shape& shape, int64_t node, int depth,
+                         std::vector<int64_t>& roots);
+
+  Node * nodes;
+  size_t numKeys;
+  int treeHeight;
+  StoragePolicy storage;
+};
+
+template <typename Key, typename Params>
+WeightedVebTree<Key, Params>::WeightedVebTree(
+    const std::vector<key_type>& keys, const std::vector<double>& weights,
+    StoragePolicy storage)
+    : nodes(nullptr), numKeys(keys.size()), treeHeight(0), storage(storage) {
+  assert(keys.size() == weights.size());
+  if (numKeys >= (size_t(1) << 32)) {
+    throw std::length_error("too many keys for a WeightedVebTree");
+  }
+  if (numKeys == 0) {
+    return;
+  }
+  double total = 0;
+  for (double weight : weights) {
+    total += weight;
+  }
+  double floor = total > 0 ? total / 16 / numKeys : 1;
+  std::vector<double> prefix(numKeys + 1, 0);
+  for (size_t i = 0; i < numKeys; i++) {
+    prefix[i + 1] = prefix[i] + weights[i] + floor;
+  }
+
+  Shape shape;
+  shape.left.resize(numKeys);
+  shape.right.resize(numKeys);
+  shape.height.resize(numKeys);
+  int64_t root = buildShape(prefix, 0, numKeys, shape);
+  treeHeight = shape.height[root];
+
+  std::vector<int64_t> order;
+  order.reserve(numKeys);
+  layoutPiece(shape, root, treeHeight, order);
+  std::vector<uint32_t> position(numKeys);
+  for (size_t i = 0; i < numKeys; i++) {
+    position[order[i]] = uint32_t(i);
+  }
+  nodes = (Node *) allocateStorage(numKeys * sizeof(Node), storage);
+  for (size_t i = 0; i < numKeys; i++) {
+    int64_t index = order[i];
+    Node * node = new (&nodes[i]) Node;
+    node->key = keys[index];
+    node->child[0] = shape.left[index] < 0 ? 0 : position[shape.left[index]];
+    node->child[1] = shape.right[index] < 0 ? 0 : position[shape.right[index]];
+  }
+}
+
+template <typename Key, typename Params>
+WeightedVebTree<Key, Params>::WeightedVebTree(WeightedVebTree&& other)
+    : nodes(other.nodes), numKeys(other.numKeys),
+      treeHeight(other.treeHeight), storage(other.storage) {
+  other.nodes = nullptr;
+}
+
+template <typename Key, typename Params>
+WeightedVebTree<Key, Params>::~WeightedVebTree() {
+  if (nodes == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < numKeys; i++) {
+    nodes[i].~Node();
+  }
+  freeStorage(nodes, numKeys * sizeof(Node), storage);
+}
+
+/* Builds the subtree over keys [lo, hi) and returns its root. The root is
+ * the key r for which the weight to its left, prefix[r] - prefix[lo], and
+ * the weight to its right, prefix[hi] - prefix[r + 1], are closest, i.e.
+ * prefix[r] + prefix[r + 1] is closest to prefix[lo] + prefix[hi]; that sum
+ * increases with r, so a binary search finds it.
+ */
+template <typename Key, typename Params>
+int64_t WeightedVebTree<Key, Params>::buildShape(
+    const std::vector<double>& prefix, size_t lo, size_t hi, Shape& shape) {
+  if (lo == hi) {
+    return -1;
+  }
+  double target = prefix[lo] + prefix[hi];
+  size_t first = lo;
+  size_t count = hi - lo;
+  while (count > 0) {
+    size_t half = count / 2;
+    if (prefix[first + half] + prefix[first + half + 1] < target) {
+      first += half + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+  size_t root = std::min(first, hi - 1);
+  if (root > lo &&
+      target - (prefix[root - 1] + prefix[root]) <
+          prefix[root] + prefix[root + 1] - target) {
+    root--;
+  }
+  shape.left[root] = buildShape(prefix, lo, root, shape);
+  shape.right[root] = buildShape(prefix, root + 1, hi, shape);
+  int leftHeight = shape.left[root] < 0 ? 0 : shape.height[shape.left[root]];
+  int rightHeight = shape.right[root] < 0 ? 0 : shape.height[shape.right[root]];
+  shape.height[root] = 1 + std::max(leftHeight, rightHeight);
+  return int64_t(root);
+}
+
+/* Appends the nodes of the piece of the tree made of root and its
+ * descendants fewer than limit levels below it to order, in the van Emde
+ * Boas order. As in VebTree, a piece of height h is cut into a top piece of
+ * ceil(h / 2) levels, laid out first, and the pieces hanging below it,
+ * left to right; here the height is the piece's actual height, which can be
+ * less than limit, and the pieces below can be any shape.
+ */
+template <typename Key, typename Params>
+void WeightedVebTree<Key, Params>::layoutPiece(const Shape& shape,
+                                               int64_t root, int limit,
+                                               std::vector<int64_t>& order) {
+  int height = std::min(shape.height[root], limit);
+  if (height == 1) {
+    order.push_back(root);
+    return;
+  }
+  int top = (height + 1) / 2;
+  layoutPiece(shape, root, top, order);
+  std::vector<int64_t> roots;
+  pieceRoots(shape, root, top, roots);
+  for (int64_t bottom : roots) {
+    layoutPiece(shape, bottom, height - top, order);
+  }
+}
+
+// Collects the nodes depth levels below node, left to right.
+template <typename Key, typename Params>
+void WeightedVebTree<Key, Params>::pieceRoots(const Shape& shape,
+                                              int64_t node, int depth,
+                                              std::vector<int64_t>& roots) {
+  if (node < 0) {
+    return;
+  }
+  if (depth == 0) {
+    roots.push_back(node);
+    return;
+  }
+  pieceRoots(shape, shape.left[node], depth - 1, roots);
+  pieceRoots(shape, shape.right[node], depth - 1, roots);
+}
+
+/* Unlike VebTree's branch-free walk, this stops as soon as it finds the
+ * key: the point of the tree is that the keys looked up most often are
+ * found near the top.
+ */
+template <typename Key, typename Params>
+bool WeightedVebTree<Key, Params>::contains(const key_type& key) const {
+  if (numKeys == 0) {
+    return false;
+  }
+  uint32_t position = 0;
+  do {
+    const Node& node = nodes[position];
+    bool equal, greater;
+    VebTree<Key, Params>::compareKeys(key, node.key, equal, greater);
+    if (equal) {
+      return true;
+    }
+    position = node.child[greater];
+  } while (position != 0);
+  return false;
+}
+
+template <typename Key, typename Params>
+int WeightedVebTree<Key, Params>::depth(const key_type& key) const {
+  int result = 0;
+  if (numKeys == 0) {
+    return result;
+  }
+  uint32_t position = 0;
+  do {
+    const Node& node = nodes[position];
+    bool equal, greater;
+    VebTree<Key, Params>::compareKeys(key, node.key, equal, greater);
+    result++;
+    if (equal) {
+      break;
+    }
+    position = node.child[greater];
+  } while (position != 0);
+  return result;
+}
+
+#endif